@@ -1,18 +1,20 @@
 // The main ray tracer.
 
-#include <Fl/fl_ask.h>
 #include <deque>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
 
 #include "RayTracer.h"
 #include "scene/light.h"
 #include "fileio/bitmap.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/bvh.h"
+#include "scene/accelcache.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
-#include "ui/TraceUI.h"
-
-extern TraceUI *traceUI;
 
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
@@ -22,16 +24,17 @@ vec3f RayTracer::trace( Scene *scene, double x, double y )
 {
     ray r( vec3f(0,0,0), vec3f(0,0,0) );
     scene->getCamera()->rayThrough( x,y,r );
-	const float threshold	= traceUI->getTreshold();
-	const vec3f thresh(threshold, threshold, threshold);
-	const int	depth		= traceUI->getDepth();
-	return traceRay( scene, r, thresh, depth ).clamp();
+	++threadRayStats().primaryRays;
+	const vec3f thresh(settings.threshold, settings.threshold, settings.threshold);
+	return traceRay( scene, r, thresh, settings.depth, x, y ).clamp();
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+// (screen_x, screen_y) is the window point of the primary ray, which is
+// where rays that leave the scene look up the background image.
 vec3f RayTracer::traceRay( Scene *scene, ray& r, 
-	const vec3f& thresh, int depth )
+	const vec3f& thresh, int depth, double screen_x, double screen_y )
 {
 
 	// Recursion end condition
@@ -52,17 +55,18 @@ vec3f RayTracer::traceRay( Scene *scene, ray& r,
 		// more steps: add in the contributions from reflected and refracted
 		// rays.
 
-		if (traceUI->TextureMapping()) return SphereInverse(r, i);
+		if (settings.textureMapping) return SphereInverse(r, i);
 		const Material& m	= i.getMaterial();
 		vec3f intensity		= m.shade(scene, r, i);
 
 		//cout << "intensity = " << intensity << endl;
 		// Bonus 1 : Adaptive Termination
-		if (traceUI->getDepth() != depth && intensity[0] < thresh[0] && intensity[1] < thresh[1] && intensity[2] < thresh[2]) {
+		if (settings.depth != depth && intensity[0] < thresh[0] && intensity[1] < thresh[1] && intensity[2] < thresh[2]) {
+			COUNT_RAY_STAT( thresholdCutoffs );
 			return vec3f(0.0f, 0.0f, 0.0f);
 		}
 
-		stack<const Material *> prevMaterial = r.prevMaterial;
+		MediumStack prevMaterial = r.prevMaterial;
 
 		// ======================== Handle reflection =======================================
 		
@@ -78,7 +82,8 @@ vec3f RayTracer::traceRay( Scene *scene, ray& r,
 		// Get the reflection intensity
 		ray reflected_ray(point, reflect_dir);
 		reflected_ray.prevMaterial = prevMaterial;
-		vec3f reflect_i = this->traceRay(scene, reflected_ray, thresh, depth-1);
+		if (depth > 0) ++threadRayStats().reflectedRays;
+		vec3f reflect_i = this->traceRay(scene, reflected_ray, thresh, depth-1, screen_x, screen_y);
 		//cout << "reflection = " << reflect_i << endl;
 		// Get the index of refraction
 		// We also need to consider the entering material
@@ -101,10 +106,16 @@ vec3f RayTracer::traceRay( Scene *scene, ray& r,
 		if (!this->TIR(-L, N, n_i, n_t)) {
 			// Total Internal Reflection doesn't occur
 			const vec3f refract_dir = this->getRefrationDir(-L, entering ? N : -N, n_i, n_t);
-			const vec3f point		= r.at(i.t) - N * NORMAL_EPSILON * (entering ? 1 : -1);
-			ray refract_ray(point, refract_dir);
-			refract_ray.prevMaterial = prevMaterial;
-			refraction_i = this->traceRay(scene, refract_ray, thresh, depth-1);
+
+			// getRefrationDir returns a zero vector when the ray is in fact
+			// totally reflected, and a ray with no direction can't be traced.
+			if (!refract_dir.iszero()) {
+				const vec3f point		= r.at(i.t) - N * NORMAL_EPSILON * (entering ? 1 : -1);
+				ray refract_ray(point, refract_dir);
+				refract_ray.prevMaterial = prevMaterial;
+				if (depth > 0) ++threadRayStats().refractedRays;
+				refraction_i = this->traceRay(scene, refract_ray, thresh, depth-1, screen_x, screen_y);
+			}
 		}
 
 
@@ -116,7 +127,7 @@ vec3f RayTracer::traceRay( Scene *scene, ray& r,
 		// it according to the background color, which in this (simple) case
 		// is just black.
 		//cout << "Not Intersecting" << endl;
-		if (background_switch && background) return getBackgroundColor(scene->getCamera()->camera_x, scene->getCamera()->camera_y);
+		if (background_switch && background) return getBackgroundColor(screen_x, screen_y);
 		else return vec3f( 0, 0, 0 );
 	}
 }
@@ -131,6 +142,8 @@ RayTracer::RayTracer()
 	background_width = background_height = 0;	
 	background_switch = false; // closed at first
 
+	buildMode = BVH_BUILD_SAH;
+	useAccelCache = true;
 	m_bSceneLoaded = false;
 }
 
@@ -194,18 +207,23 @@ bool RayTracer::TIR(const vec3f &L, const vec3f &N, const double &n_i, const dou
 
 bool RayTracer::loadScene( char* fn )
 {
+	loadError.clear();
+
 	try
 	{
-		scene = readScene( fn );
+		scene = readScene( fn, &loadError );
 	}
 	catch( ParseError pe )
 	{
-		fl_alert( "ParseError: %s\n", pe );
+		loadError = "ParseError: " + pe.getMsg();
 		return false;
 	}
 
-	if( !scene )
+	if( !scene ) {
+		if( loadError.empty() )
+			loadError = string( "Couldn't load scene " ) + fn;
 		return false;
+	}
 	
 	buffer_width = 256;
 	buffer_height = (int)(buffer_width / scene->getCamera()->getAspectRatio() + 0.5);
@@ -213,8 +231,19 @@ bool RayTracer::loadScene( char* fn )
 	bufferSize = buffer_width * buffer_height * 3;
 	buffer = new unsigned char[ bufferSize ];
 	
-	// separate objects into bounded and unbounded
-	scene->initScene();
+	// separate objects into bounded and unbounded, and build (or load)
+	// the hierarchies over them
+	if( useAccelCache ) {
+		AccelCache cache( fn );
+		BVHBuilder builder( buildMode, 0, &cache );
+		scene->initScene( builder );
+
+		// a cache that can't be written only costs the next run a build
+		cache.save();
+	} else {
+		BVHBuilder builder( buildMode );
+		scene->initScene( builder );
+	}
 	
 	// Add any specialized scene loading code here
 	
@@ -282,8 +311,12 @@ vec3f RayTracer::gettextureColor(double x, double y) {
 }
 
 
-void RayTracer::traceSetup( int w, int h )
+void RayTracer::traceSetup( int w, int h, const RenderSettings& s )
 {
+	settings = s;
+	if( settings.depth > MAX_TRACE_DEPTH )
+		settings.depth = MAX_TRACE_DEPTH;
+
 	if( buffer_width != w || buffer_height != h )
 	{
 		buffer_width = w;
@@ -294,6 +327,22 @@ void RayTracer::traceSetup( int w, int h )
 		buffer = new unsigned char[ bufferSize ];
 	}
 	memset( buffer, 0, w*h*3 );
+	stats.clear();
+
+	if( settings.costMap )
+		costBuffer.assign( w * h * NUM_PIXEL_COSTS, 0.0f );
+	else
+		vector<float>().swap( costBuffer );
+}
+
+// Add the counters of the calling thread to the render's totals and
+// start the thread over from zero.
+void RayTracer::collectThreadStats()
+{
+	RayStats& local = threadRayStats();
+	lock_guard<mutex> lock( statsLock );
+	stats += local;
+	local.clear();
 }
 
 void RayTracer::traceLines( int start, int stop )
@@ -305,10 +354,62 @@ void RayTracer::traceLines( int start, int stop )
 	if( stop > buffer_height )
 		stop = buffer_height;
 
+	threadRayStats().clear();
 	for( int j = start; j < stop; ++j )
 		for( int i = 0; i < buffer_width; ++i )
 			tracePixel(i,j);
+	collectThreadStats();
 }
+
+// Render the whole image with numThreads worker threads.  The image is cut
+// into tileSize x tileSize tiles and each worker keeps taking the next
+// untraced tile until none are left.  Every pixel is written by exactly one
+// thread, so the result is the same as traceLines(0, buffer_height).
+void RayTracer::traceTiles( int numThreads, int tileSize )
+{
+	if( !scene )
+		return;
+
+	if( numThreads < 1 )
+		numThreads = 1;
+
+	const int tilesX = (buffer_width + tileSize - 1) / tileSize;
+	const int tilesY = (buffer_height + tileSize - 1) / tileSize;
+	const int numTiles = tilesX * tilesY;
+
+	atomic<int> nextTile( 0 );
+
+	auto worker = [&]() {
+		threadRayStats().clear();
+		for( int tile = nextTile++; tile < numTiles; tile = nextTile++ ) {
+			const int x0 = (tile % tilesX) * tileSize;
+			const int y0 = (tile / tilesX) * tileSize;
+			const int x1 = min( x0 + tileSize, buffer_width );
+			const int y1 = min( y0 + tileSize, buffer_height );
+
+			for( int j = y0; j < y1; ++j )
+				for( int i = x0; i < x1; ++i )
+					tracePixel( i, j );
+		}
+		collectThreadStats();
+	};
+
+	vector<thread> threads;
+	for( int t = 1; t < numThreads; ++t )
+		threads.push_back( thread( worker ) );
+	worker();
+
+	for( size_t t = 0; t < threads.size(); ++t )
+		threads[t].join();
+}
+
+// A small linear congruential generator returning values in [0, 1).
+static double nextJitter( unsigned int& seed )
+{
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) / 16777216.0;
+}
+
 vec3f RayTracer::SphereInverse(const ray& r, isect& i)
 {
 	vec3f Sp = vec3f(0, 1, 0);
@@ -334,10 +435,25 @@ void RayTracer::tracePixel( int i, int j )
 	if( !scene )
 		return;
 
+	// Cost map: note where the counters and the clock stand, so that the
+	// difference at the end is what this pixel took.
+	const RayStats& counters = threadRayStats();
+	unsigned long long raysBefore = 0, testsBefore = 0;
+	chrono::steady_clock::time_point start;
+	if( settings.costMap ) {
+		raysBefore = counters.totalRays();
+		testsBefore = counters.intersectTests + counters.triangleTests;
+		start = chrono::steady_clock::now();
+	}
+
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 
-	const int samplingSize = traceUI->getSuperSample();
+	// The jitter sequence is seeded from the pixel position instead of
+	// using rand(), so pixels can be traced on any thread in any order.
+	unsigned int seed = (unsigned int)i * 73856093u ^ (unsigned int)j * 19349663u;
+
+	const int samplingSize = settings.superSample;
 	if (samplingSize > 0) {
 		// Bonus 2 : Supersampling
 		const double pixel_w = 1.0 / buffer_width;	// Width of one pixel
@@ -350,10 +466,9 @@ void RayTracer::tracePixel( int i, int j )
 			const double base_y = y + ((double) i / samplingSize - 0.5) * pixel_h;
 			for (int j = 0; j < samplingSize; ++j) {
 				const double base_x = x + ((double) j / samplingSize - 0.5) * pixel_w;
-				const double jitter_y = (rand() / (double) RAND_MAX - 0.5) * sub_pixel_h + base_y;
-				const double jitter_x = (rand() / (double) RAND_MAX - 0.5) * sub_pixel_w + base_x;
-				const bool isJittering = traceUI->Jittering();
-				col += trace(scene, isJittering ? jitter_x : base_x, isJittering ? jitter_y : base_y);
+				const double jitter_y = (nextJitter(seed) - 0.5) * sub_pixel_h + base_y;
+				const double jitter_x = (nextJitter(seed) - 0.5) * sub_pixel_w + base_x;
+				col += trace(scene, settings.jittering ? jitter_x : base_x, settings.jittering ? jitter_y : base_y);
 			}
 		}
 
@@ -369,4 +484,11 @@ void RayTracer::tracePixel( int i, int j )
 	pixel[0] = (int)( 255.0 * col[0]);
 	pixel[1] = (int)( 255.0 * col[1]);
 	pixel[2] = (int)( 255.0 * col[2]);
+
+	if( settings.costMap ) {
+		float *cost = &costBuffer[ ( i + j * buffer_width ) * NUM_PIXEL_COSTS ];
+		cost[COST_RAYS] = (float)( counters.totalRays() - raysBefore );
+		cost[COST_INTERSECT_TESTS] = (float)( counters.intersectTests + counters.triangleTests - testsBefore );
+		cost[COST_NANOSECONDS] = (float)chrono::duration<double, nano>( chrono::steady_clock::now() - start ).count();
+	}
 }
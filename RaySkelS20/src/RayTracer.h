@@ -3,8 +3,38 @@
 
 // The main ray tracer.
 
+#include <mutex>
+
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "scene/raystats.h"
+
+// The options that control a render.  A copy is handed to traceSetup()
+// when a render starts and stays fixed until the next one, so the tracer
+// never has to go back to the UI (or any other global) while tracing.
+struct RenderSettings
+{
+	RenderSettings()
+		: depth( 0 ), threshold( 0.0 ), superSample( 0 ),
+		  jittering( false ), textureMapping( false ), costMap( false ) {}
+
+	int		depth;				// maximum recursion depth
+	double	threshold;			// adaptive termination threshold
+	int		superSample;		// sub-pixels per side, 0 for one ray per pixel
+	bool	jittering;			// jitter the supersampling grid
+	bool	textureMapping;		// shade with the texture image instead
+	bool	costMap;			// record what every pixel cost, see getCostBuffer
+};
+
+// What tracing one pixel cost, recorded when RenderSettings::costMap is on.
+enum PixelCost
+{
+	COST_RAYS,					// rays traced, including shadow rays
+	COST_INTERSECT_TESTS,		// Geometry::intersect calls, and the mesh and
+								// height field triangles tested inside them
+	COST_NANOSECONDS,			// wall clock time
+	NUM_PIXEL_COSTS
+};
 
 class RayTracer
 {
@@ -13,16 +43,32 @@ public:
     ~RayTracer();
 
     vec3f trace( Scene *scene, double x, double y );
-	vec3f traceRay( Scene *scene, ray& r, const vec3f& thresh, int depth );
+	vec3f traceRay( Scene *scene, ray& r, const vec3f& thresh, int depth,
+		double screen_x, double screen_y );
 
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
+
+	// The per-pixel costs of the last render, NUM_PIXEL_COSTS floats per
+	// pixel laid out like the image buffer, or NULL if costMap was off.
+	const float *getCostBuffer() const { return costBuffer.empty() ? NULL : &costBuffer[0]; }
 	double aspectRatio();
-	void traceSetup( int w, int h );
+	void traceSetup( int w, int h, const RenderSettings& s = RenderSettings() );
+	const RenderSettings& getSettings() const { return settings; }
+
+	// Rays traced since the last traceSetup().
+	const RayStats& getStats() const { return stats; }
 	void traceLines( int start = 0, int stop = 10000000 );
+	void traceTiles( int numThreads, int tileSize = 32 );
 	void tracePixel( int i, int j );
 
+	// How loadScene builds the scene's hierarchies.
+	void setBuildMode( BVHBuildMode mode ) { buildMode = mode; }
+	// Whether loadScene keeps the hierarchies in a cache next to the
+	// scene file, and takes them from it when it can (see accelcache.h).
+	void setAccelCache( bool use ) { useAccelCache = use; }
 	bool loadScene( char* fn );
+	const string& getLoadError() const { return loadError; }
 	Scene *getScene() const { return this->scene; }
 	bool loadBackground(char* fn);
 	void loadtextureMappingImage(char* fn);
@@ -44,6 +90,13 @@ private:
 	int texture_width, texture_height; // to check the texture image
 	int bufferSize;
 	Scene *scene;
+	RenderSettings settings;
+	string loadError;
+	BVHBuildMode buildMode;
+	bool useAccelCache;
+	RayStats stats;
+	mutex statsLock;
+	vector<float> costBuffer;
 
 	bool m_bSceneLoaded;
 
@@ -51,6 +104,7 @@ private:
 	vec3f getRefrationDir(const vec3f &L, const vec3f &N, const double &n_i, const double &n_t) const;
 	bool  isEntering(const vec3f &L, const vec3f &N) const;
 	bool  TIR(const vec3f &L, const vec3f &N, const double &n_i, const double &n_t) const;
+	void  collectThreadStats();
 };
 
 #endif // __RAYTRACER_H__
@@ -1,13 +1,16 @@
 #include <cmath>
 #include <assert.h>
 #include <limits>
+#include <utility>
 
 #include "Box.h"
+#include "../scene/raystats.h"
 
 // Intersection detection for box
 // Reference: https://education.siggraph.org/static/HyperGraph/raytrace/rtinter3.htm
 bool Box::intersectLocal( const ray& r, isect& i ) const
 {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_BOX ] );
 	// YOUR CODE HERE:
     // Add box intersection code here.
 	// it currently ignores all boxes and just returns false.
@@ -28,6 +31,46 @@ bool Box::intersectLocal( const ray& r, isect& i ) const
 
 }
 
+// The slab test again, over the whole line and keeping the face the ray
+// leaves by as well as the one it enters by.
+bool Box::intersectLocalSpans( const ray& r, SpanList& spans ) const
+{
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_BOX ] );
+	const vec3f p = r.getPosition();
+	const vec3f d = r.getDirection();
+
+	double tNear = -std::numeric_limits<double>::max();
+	double tFar = std::numeric_limits<double>::max();
+	int nearAxis = 0, farAxis = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		if (d[axis] == 0) {
+			// parallel to the slab: inside it all along, or never
+			if (fabs(p[axis]) > 0.5) return true;
+			continue;
+		}
+
+		double t1 = (-0.5 - p[axis]) / d[axis];
+		double t2 = (0.5 - p[axis]) / d[axis];
+		if (t1 > t2) std::swap(t1, t2);
+		if (t1 > tNear) {
+			tNear = t1;
+			nearAxis = axis;
+		}
+		if (t2 < tFar) {
+			tFar = t2;
+			farAxis = axis;
+		}
+	}
+
+	if (tNear >= tFar) return true;
+
+	vec3f nearNormal, farNormal;
+	nearNormal[nearAxis] = d[nearAxis] > 0 ? -1 : 1;
+	farNormal[farAxis] = d[farAxis] > 0 ? 1 : -1;
+	spans.add(SpanEnd(tNear, nearNormal, this), SpanEnd(tFar, farNormal, this));
+	return true;
+}
+
 // Just a copy of ComputeLocalBoundingBox.
 // Need because this version can be used in const function
 BoundingBox Box::getLocalBoundingBox() const {
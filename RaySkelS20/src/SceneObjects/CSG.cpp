@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <cfloat>
+
+#include "CSG.h"
+#include "../scene/raystats.h"
+
+CSGNode::CSGNode( Scene *scene, CSGOperation op, SceneObject *a, SceneObject *b )
+	: SceneObject( scene ), op( op ), a( a ), b( b )
+{
+	switch( op ) {
+	case CSG_UNION:
+		bounded = a->hasBoundingBoxCapability() && b->hasBoundingBoxCapability();
+		break;
+	case CSG_INTERSECTION:
+		bounded = a->hasBoundingBoxCapability() || b->hasBoundingBoxCapability();
+		break;
+	default:
+		bounded = a->hasBoundingBoxCapability();
+		break;
+	}
+}
+
+CSGNode::~CSGNode()
+{
+	delete a;
+	delete b;
+}
+
+// Orders objects by the middle of their boxes along an axis, those without
+// a box last.
+struct CSGCenterOrder
+{
+	int axis;
+
+	bool operator ()( const SceneObject *x, const SceneObject *y ) const
+	{
+		if( !x->hasBoundingBoxCapability() || !y->hasBoundingBoxCapability() )
+			return x->hasBoundingBoxCapability() && !y->hasBoundingBoxCapability();
+		const BoundingBox& bx = x->getBoundingBox();
+		const BoundingBox& by = y->getBoundingBox();
+		return bx.min[axis] + bx.max[axis] < by.min[axis] + by.max[axis];
+	}
+};
+
+// Split objs[lo, hi) in half at the median along the axis their boxes'
+// middles spread furthest on, as a BVH build would, and join each half.
+static SceneObject *joinRange( Scene *scene, CSGOperation op, vector<SceneObject *>& objs,
+	size_t lo, size_t hi, TransformNode *transform )
+{
+	if( hi - lo == 1 )
+		return objs[lo];
+
+	vec3f low, high;
+	bool first = true;
+	for( size_t k = lo; k < hi; ++k ) {
+		if( !objs[k]->hasBoundingBoxCapability() )
+			continue;
+		const BoundingBox& box = objs[k]->getBoundingBox();
+		const vec3f center = (box.min + box.max) / 2;
+		low = first ? center : minimum( low, center );
+		high = first ? center : maximum( high, center );
+		first = false;
+	}
+
+	const vec3f spread = high - low;
+	CSGCenterOrder order;
+	order.axis = 0;
+	if( spread[1] > spread[ order.axis ] )
+		order.axis = 1;
+	if( spread[2] > spread[ order.axis ] )
+		order.axis = 2;
+
+	const size_t mid = (lo + hi) / 2;
+	std::nth_element( objs.begin() + lo, objs.begin() + mid, objs.begin() + hi, order );
+
+	CSGNode *node = new CSGNode( scene, op, joinRange( scene, op, objs, lo, mid, transform ),
+		joinRange( scene, op, objs, mid, hi, transform ) );
+	node->setTransform( transform );
+	return node;
+}
+
+SceneObject *CSGNode::join( Scene *scene, CSGOperation op, vector<SceneObject *>& objs,
+	TransformNode *transform )
+{
+	for( size_t k = 0; k < objs.size(); ++k )
+		objs[k]->ComputeBoundingBox();
+	return joinRange( scene, op, objs, 0, objs.size(), transform );
+}
+
+void CSGNode::split( SceneObject *obj, CSGOperation op, vector<SceneObject *>& parts )
+{
+	CSGNode *node = dynamic_cast<CSGNode *>( obj );
+	if( !node || node->op != op ) {
+		parts.push_back( obj );
+		return;
+	}
+
+	split( node->a, op, parts );
+	if( op == CSG_DIFFERENCE )
+		parts.push_back( node->b );
+	else
+		split( node->b, op, parts );
+
+	node->a = node->b = NULL;
+	delete node;
+}
+
+const Material& CSGNode::getMaterial() const
+{
+	return a->getMaterial();
+}
+
+void CSGNode::setMaterial( Material *m )
+{
+	a->setMaterial( m );
+}
+
+// The operands are not in the scene, so their boxes are worked out here
+// rather than by Scene::add.
+void CSGNode::ComputeBoundingBox()
+{
+	a->ComputeBoundingBox();
+	b->ComputeBoundingBox();
+	const BoundingBox& boxA = a->getBoundingBox();
+	const BoundingBox& boxB = b->getBoundingBox();
+
+	switch( op ) {
+	case CSG_UNION:
+		bounds.min = minimum( boxA.min, boxB.min );
+		bounds.max = maximum( boxA.max, boxB.max );
+		break;
+
+	case CSG_INTERSECTION:
+		if( !b->hasBoundingBoxCapability() ) {
+			bounds = boxA;
+		} else if( !a->hasBoundingBoxCapability() ) {
+			bounds = boxB;
+		} else {
+			// boxes that don't overlap leave an empty one, which is kept
+			// the right way round for the scene's hierarchy
+			bounds.min = maximum( boxA.min, boxB.min );
+			bounds.max = maximum( bounds.min, minimum( boxA.max, boxB.max ) );
+		}
+		break;
+
+	default:
+		bounds = boxA;
+		break;
+	}
+}
+
+void CSGNode::buildAccelerationStructure( BVHBuilder& builder )
+{
+	a->buildAccelerationStructure( builder );
+	b->buildAccelerationStructure( builder );
+}
+
+double CSGNode::intersectCost() const
+{
+	return a->intersectCost() + b->intersectCost();
+}
+
+// Merge the spans of a and b into those of op applied to them, walking the
+// ends of both lists in order along the ray and noting where being inside
+// the result changes.  At equal distances an entry is taken before an
+// exit, so solids that touch are joined without a surface between them.
+//
+// The result is only known as far as both lists are, so it stops there;
+// a span still open at that point is left open rather than closed by a
+// surface that isn't there.
+static void combineSpans( CSGOperation op, const SpanList& a, const SpanList& b, SpanList& result )
+{
+	result.clear();
+	const double limit = a.limit() < b.limit() ? a.limit() : b.limit();
+
+	int ka = 0, kb = 0;
+	bool inA = false, inB = false;
+	bool inside = false;
+	SpanEnd start;
+
+	while( ka < a.size() || kb < b.size() ) {
+		const SpanEnd *endA = ka < a.size() ? (inA ? &a[ka].out : &a[ka].in) : NULL;
+		const SpanEnd *endB = kb < b.size() ? (inB ? &b[kb].out : &b[kb].in) : NULL;
+
+		bool fromA;
+		if( !endB ) {
+			fromA = true;
+		} else if( !endA ) {
+			fromA = false;
+		} else if( endA->t != endB->t ) {
+			fromA = endA->t < endB->t;
+		} else {
+			fromA = !inA || inB;
+		}
+
+		if( (fromA ? endA : endB)->t > limit )
+			break;
+
+		if( fromA ) {
+			inA = !inA;
+			if( !inA )
+				++ka;
+		} else {
+			inB = !inB;
+			if( !inB )
+				++kb;
+		}
+
+		bool now;
+		switch( op ) {
+		case CSG_UNION:
+			now = inA || inB;
+			break;
+		case CSG_INTERSECTION:
+			now = inA && inB;
+			break;
+		default:
+			now = inA && !inB;
+			break;
+		}
+		if( now == inside )
+			continue;
+		inside = now;
+
+		SpanEnd end = fromA ? *endA : *endB;
+		if( !fromA && op == CSG_DIFFERENCE )
+			end.N = -end.N;
+
+		if( inside ) {
+			start = end;
+		} else if( end.t > start.t ) {
+			result.add( start, end );
+		}
+	}
+
+	if( inside ) {
+		SpanEnd open = start;
+		open.t = DBL_MAX;
+		result.add( start, open );
+	}
+	result.cutOff( limit );
+}
+
+void CSGNode::intersectSpans( const ray& r, SpanList& spans ) const
+{
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_CSG ] );
+	spans.clear();
+
+	double tMin, tMax;
+	if( hasBoundingBoxCapability() && !bounds.intersect( r, tMin, tMax ) )
+		return;
+
+	// Past a list that is empty all along the ray the other one is either
+	// the answer or of no use, so it is only asked for when it matters.
+	SpanList spansA;
+	a->intersectSpans( r, spansA );
+	const bool noA = spansA.empty() && spansA.complete();
+	if( noA && op != CSG_UNION )
+		return;
+
+	SpanList spansB;
+	b->intersectSpans( r, spansB );
+	if( spansB.empty() && spansB.complete() ) {
+		if( op != CSG_INTERSECTION )
+			spans = spansA;
+		return;
+	}
+	if( noA ) {
+		spans = spansB;
+		return;
+	}
+
+	combineSpans( op, spansA, spansB, spans );
+}
+
+bool CSGNode::intersect( const ray& r, isect& i ) const
+{
+	++threadRayStats().intersectTests;
+
+	SpanList spans;
+	intersectSpans( r, spans );
+
+	// the first end of a span ahead of the ray's start
+	for( int k = 0; k < spans.size(); ++k ) {
+		const SpanEnd *end;
+		if( spans[k].in.t > RAY_EPSILON )
+			end = &spans[k].in;
+		else if( spans[k].out.t > RAY_EPSILON )
+			end = &spans[k].out;
+		else
+			continue;
+
+		// the far end of a surface that never closes, or of a span the
+		// list stops inside
+		if( end->t == DBL_MAX )
+			return false;
+
+		COUNT_RAY_STAT( hits );
+		i.obj = end->obj;
+		i.t = end->t;
+		i.N = end->N.normalize();
+		i.bary = end->bary;
+		i.face = end->face;
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,76 @@
+#ifndef __CSG_H__
+#define __CSG_H__
+
+#include "../scene/scene.h"
+
+// Bonus : CSG
+//
+// The union, intersection or difference of two solids, either of which
+// may be a CSGNode itself.  A ray is tested against a node by asking both
+// operands for the spans of it that lie inside them (see
+// Geometry::intersectSpans) and merging the two lists in a single pass.
+// Every node has a box around what it can cover, so a ray that misses it
+// skips the whole subtree below.
+//
+// A hit keeps the object, normal and face of the surface it is on, so
+// each part of the result is shaded with its own solid's material; on the
+// parts of a subtracted solid that bound a difference, the normal is
+// turned around.
+enum CSGOperation
+{
+	CSG_UNION,
+	CSG_INTERSECTION,
+	CSG_DIFFERENCE		// a less b
+};
+
+class CSGNode
+	: public SceneObject
+{
+public:
+	// Takes a and b, which must not be in the scene's object list, and
+	// deletes them with the node.  Their own transforms place them in the
+	// world; the node's transform is not applied on top.
+	CSGNode( Scene *scene, CSGOperation op, SceneObject *a, SceneObject *b );
+	virtual ~CSGNode();
+
+	// Combine objs (one or more) by op, which must be a union or an
+	// intersection, so that their order doesn't matter, as a balanced tree
+	// of nodes whose subtrees each hold objects lying near each other, for
+	// boxes that cull well.  A single object is returned as it is.
+	static SceneObject *join( Scene *scene, CSGOperation op, vector<SceneObject *>& objs,
+		TransformNode *transform );
+
+	// Add to parts the objects obj combines by op: for a union or an
+	// intersection all the operands of the nodes of that kind down from
+	// it, for a difference the object being cut and then the ones cut
+	// from it, so that ((a - b) - c) gives a, b, c.  The nodes they are
+	// taken from are deleted, and anything else is added as it is.
+	static void split( SceneObject *obj, CSGOperation op, vector<SceneObject *>& parts );
+
+	CSGOperation getOperation() const { return op; }
+	SceneObject *getA() const { return a; }
+	SceneObject *getB() const { return b; }
+
+	// The node has no material of its own; these are a's.
+	virtual const Material& getMaterial() const;
+	virtual void setMaterial( Material *m );
+
+	virtual bool intersect( const ray& r, isect& i ) const;
+	virtual void intersectSpans( const ray& r, SpanList& spans ) const;
+
+	virtual bool hasBoundingBoxCapability() const { return bounded; }
+	virtual void ComputeBoundingBox();
+	virtual void buildAccelerationStructure( BVHBuilder& builder );
+	virtual double intersectCost() const;
+
+private:
+	CSGOperation op;
+	SceneObject *a;
+	SceneObject *b;
+
+	// whether the result has a box, which depends on the operands having
+	// them and is asked for at every node a ray reaches
+	bool bounded;
+};
+
+#endif // __CSG_H__
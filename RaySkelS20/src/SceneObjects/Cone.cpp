@@ -2,9 +2,11 @@
 #include <cmath>
 
 #include "Cone.h"
+#include "../scene/raystats.h"
 
 bool Cone::intersectLocal( const ray& r, isect& i ) const
 {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_CONE ] );
 	i.obj = this;
 
 	if( intersectCaps( r, i ) ) {
@@ -1,9 +1,12 @@
+#include <cfloat>
 #include <cmath>
 
 #include "Cylinder.h"
+#include "../scene/raystats.h"
 
 bool Cylinder::intersectLocal( const ray& r, isect& i ) const
 {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_CYLINDER ] );
 	i.obj = this;
 
 	if( intersectCaps( r, i ) ) {
@@ -141,3 +144,72 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 
 	return false;
 }
+
+// Only a capped cylinder is a solid.  The ray is inside it where it is
+// both between the caps and inside the infinite tube.
+bool Cylinder::intersectLocalSpans( const ray& r, SpanList& spans ) const
+{
+	if( !capped ) {
+		return false;
+	}
+
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_CYLINDER ] );
+	const vec3f p = r.getPosition();
+	const vec3f d = r.getDirection();
+
+	double tNear, tFar;
+	vec3f nNear, nFar;
+	if( 0.0 == d[2] ) {
+		if( p[2] < 0.0 || p[2] > 1.0 ) {
+			return true;
+		}
+		tNear = -DBL_MAX;
+		tFar = DBL_MAX;
+	} else if( d[2] > 0.0 ) {
+		tNear = -p[2] / d[2];
+		tFar = (1.0 - p[2]) / d[2];
+		nNear = vec3f( 0.0, 0.0, -1.0 );
+		nFar = vec3f( 0.0, 0.0, 1.0 );
+	} else {
+		tNear = (1.0 - p[2]) / d[2];
+		tFar = -p[2] / d[2];
+		nNear = vec3f( 0.0, 0.0, 1.0 );
+		nFar = vec3f( 0.0, 0.0, -1.0 );
+	}
+
+	double a = d[0]*d[0] + d[1]*d[1];
+	if( 0.0 == a ) {
+		// along the axis: inside the tube all along, or never
+		if( p[0]*p[0] + p[1]*p[1] > 1.0 ) {
+			return true;
+		}
+	} else {
+		double b = 2.0*(p[0]*d[0] + p[1]*d[1]);
+		double c = p[0]*p[0] + p[1]*p[1] - 1.0;
+		double discriminant = b*b - 4.0*a*c;
+		if( discriminant <= 0.0 ) {
+			return true;
+		}
+
+		discriminant = sqrt( discriminant );
+		double t1 = (-b - discriminant) / (2.0 * a);
+		double t2 = (-b + discriminant) / (2.0 * a);
+		if( t1 > tNear ) {
+			vec3f P = r.at( t1 );
+			tNear = t1;
+			nNear = vec3f( P[0], P[1], 0.0 ).normalize();
+		}
+		if( t2 < tFar ) {
+			vec3f P = r.at( t2 );
+			tFar = t2;
+			nFar = vec3f( P[0], P[1], 0.0 ).normalize();
+		}
+	}
+
+	if( tNear >= tFar ) {
+		return true;
+	}
+
+	spans.add( SpanEnd( tNear, nNear, this ), SpanEnd( tFar, nFar, this ) );
+	return true;
+}
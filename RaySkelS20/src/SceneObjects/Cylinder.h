@@ -13,6 +13,7 @@ public:
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool intersectLocalSpans( const ray& r, SpanList& spans ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -26,6 +27,8 @@ public:
     bool intersectBody( const ray& r, isect& i ) const;
 	bool intersectCaps( const ray& r, isect& i ) const;
 
+	bool isCapped() const { return capped; }
+
 protected:
 	bool capped;
 };
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "Heightfield.h"
+#include "trimesh.h"
+#include "../scene/raystats.h"
+
+// How far the boxes of the pyramid are grown on every side, so that a
+// face hit right on the edge of its block is not lost to rounding in the
+// slab test.
+static const double BLOCK_PAD = 1e-7;
+
+Heightfield::Heightfield( Scene *scene, Material *mat, int width, int depth, vector<float>& heights,
+	double sizeX, double sizeZ )
+	: MaterialSceneObject( scene, mat ), width( width ), depth( depth ), sizeX( sizeX ), sizeZ( sizeZ )
+{
+	this->heights.swap( heights );
+
+	// the first level covers 2x2 cells, so 3x3 samples, per block
+	const int cellsX = width - 1;
+	const int cellsZ = depth - 1;
+	Level first;
+	first.width = (cellsX + 1) / 2;
+	first.depth = (cellsZ + 1) / 2;
+	first.ranges.resize( first.width * first.depth );
+	for( int b = 0; b < first.depth; ++b ) {
+		for( int a = 0; a < first.width; ++a ) {
+			Range& range = first.ranges[ a + b * first.width ];
+			range.lo = FLT_MAX;
+			range.hi = -FLT_MAX;
+			for( int j = 2 * b; j <= std::min( 2 * b + 2, cellsZ ); ++j ) {
+				for( int i = 2 * a; i <= std::min( 2 * a + 2, cellsX ); ++i ) {
+					range.lo = std::min( range.lo, height( i, j ) );
+					range.hi = std::max( range.hi, height( i, j ) );
+				}
+			}
+		}
+	}
+	levels.push_back( first );
+
+	while( levels.back().width > 1 || levels.back().depth > 1 ) {
+		const Level& below = levels.back();
+		Level next;
+		next.width = (below.width + 1) / 2;
+		next.depth = (below.depth + 1) / 2;
+		next.ranges.resize( next.width * next.depth );
+		for( int b = 0; b < next.depth; ++b ) {
+			for( int a = 0; a < next.width; ++a ) {
+				Range& range = next.ranges[ a + b * next.width ];
+				range.lo = FLT_MAX;
+				range.hi = -FLT_MAX;
+				for( int j = 2 * b; j < std::min( 2 * b + 2, below.depth ); ++j ) {
+					for( int i = 2 * a; i < std::min( 2 * a + 2, below.width ); ++i ) {
+						const Range& child = below.ranges[ i + j * below.width ];
+						range.lo = std::min( range.lo, child.lo );
+						range.hi = std::max( range.hi, child.hi );
+					}
+				}
+			}
+		}
+		levels.push_back( next );
+	}
+}
+
+vec3f Heightfield::sample( int i, int j ) const
+{
+	return vec3f( sizeX * i / (width - 1), height( i, j ), sizeZ * j / (depth - 1) );
+}
+
+// Face 0 of a cell is (i, j), (i, j+1), (i+1, j) and face 1 is
+// (i, j+1), (i+1, j+1), (i+1, j), both facing up.
+vec3f Heightfield::faceNormal( int i, int j, int f ) const
+{
+	const vec3f a = f ? sample( i, j + 1 ) : sample( i, j );
+	const vec3f b = f ? sample( i + 1, j + 1 ) : sample( i, j + 1 );
+	const vec3f c = sample( i + 1, j );
+	return ((b - a).cross( c - a )).normalize();
+}
+
+// The average of the normals of the (up to six) faces around the sample.
+vec3f Heightfield::sampleNormal( int i, int j ) const
+{
+	const int cellsX = width - 1;
+	const int cellsZ = depth - 1;
+	vec3f sum;
+	int count = 0;
+
+	if( i < cellsX && j < cellsZ ) {
+		sum += faceNormal( i, j, 0 );
+		++count;
+	}
+	if( i > 0 && j < cellsZ ) {
+		sum += faceNormal( i - 1, j, 0 ) + faceNormal( i - 1, j, 1 );
+		count += 2;
+	}
+	if( i < cellsX && j > 0 ) {
+		sum += faceNormal( i, j - 1, 0 ) + faceNormal( i, j - 1, 1 );
+		count += 2;
+	}
+	if( i > 0 && j > 0 ) {
+		sum += faceNormal( i - 1, j - 1, 1 );
+		++count;
+	}
+
+	return sum / count;
+}
+
+BoundingBox Heightfield::blockBox( int i0, int i1, int j0, int j1, float lo, float hi ) const
+{
+	BoundingBox box;
+	box.min = vec3f( sizeX * i0 / (width - 1) - BLOCK_PAD, lo - BLOCK_PAD, sizeZ * j0 / (depth - 1) - BLOCK_PAD );
+	box.max = vec3f( sizeX * i1 / (width - 1) + BLOCK_PAD, hi + BLOCK_PAD, sizeZ * j1 / (depth - 1) + BLOCK_PAD );
+	return box;
+}
+
+BoundingBox Heightfield::ComputeLocalBoundingBox()
+{
+	const Range& all = levels.back().ranges[0];
+	BoundingBox localbounds;
+	localbounds.min = vec3f( 0, all.lo, 0 );
+	localbounds.max = vec3f( sizeX, all.hi, sizeZ );
+	return localbounds;
+}
+
+double Heightfield::intersectCost() const
+{
+	// a handful of blocks on each level, then a few cells
+	return 4.0 * (levels.size() + 1);
+}
+
+// The watertight test of TrimeshGeometry::intersectFace, on the face with
+// vertices a, b and c and unit normal n.
+static bool intersectTriangle( const TrimeshGeometry::FaceRay& r, const vec3f& n,
+	const vec3f& va, const vec3f& vb, const vec3f& vc, double& t, vec3f& bary )
+{
+	if( -(r.d * n) < NORMAL_EPSILON )
+		return false;
+
+	const vec3f a = va - r.p;
+	const vec3f b = vb - r.p;
+	const vec3f c = vc - r.p;
+
+	const double ax = a[r.kx] - r.sx * a[r.kz];
+	const double ay = a[r.ky] - r.sy * a[r.kz];
+	const double bx = b[r.kx] - r.sx * b[r.kz];
+	const double by = b[r.ky] - r.sy * b[r.kz];
+	const double cx = c[r.kx] - r.sx * c[r.kz];
+	const double cy = c[r.ky] - r.sy * c[r.kz];
+
+	const double u = cx * by - cy * bx;
+	const double v = ax * cy - ay * cx;
+	const double w = bx * ay - by * ax;
+	if( (u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0) )
+		return false;
+
+	const double det = u + v + w;
+	if( det == 0 )
+		return false;
+
+	t = (u * r.sz * a[r.kz] + v * r.sz * b[r.kz] + w * r.sz * c[r.kz]) / det;
+	if( t < RAY_EPSILON )
+		return false;
+
+	bary = vec3f( u / det, v / det, w / det );
+	return true;
+}
+
+// A block of the pyramid (level >= 0) or a single cell (level -1) waiting
+// to be visited, with the distance at which the ray enters its box.
+struct HeightfieldNode
+{
+	int level;
+	int a, b;
+	double tNear;
+};
+
+bool Heightfield::intersectLocal( const ray& r, isect& i ) const
+{
+	const int cellsX = width - 1;
+	const int cellsZ = depth - 1;
+
+	const Range& all = levels.back().ranges[0];
+	double tNear, tFar;
+	if( !blockBox( 0, cellsX, 0, cellsZ, all.lo, all.hi ).intersect( r, tNear, tFar ) ||
+		tFar < RAY_EPSILON )
+		return false;
+
+	// Each visit pushes at most four nodes, the nearest last, and a node
+	// only has children one level down, so the stack never holds more
+	// than three per level plus the four cells of the last block.
+	HeightfieldNode stack[ 3 * 32 + 4 ];
+	int top = 0;
+	stack[ top ].level = levels.size() - 1;
+	stack[ top ].a = stack[ top ].b = 0;
+	stack[ top ].tNear = tNear;
+	++top;
+
+	const TrimeshGeometry::FaceRay faceRay( r );
+	double bestT = DBL_MAX;
+	int bestFace = -1;
+	vec3f bestBary;
+	int tested = 0;
+
+	while( top > 0 ) {
+		const HeightfieldNode node = stack[ --top ];
+		if( node.tNear > bestT )
+			continue;
+
+		if( node.level < 0 ) {
+			COUNT_RAY_STAT( intersectLocalCalls[ PRIM_HEIGHTFIELD_CELL ] );
+			const int ci = node.a;
+			const int cj = node.b;
+			const vec3f s00 = sample( ci, cj );
+			const vec3f s01 = sample( ci, cj + 1 );
+			const vec3f s10 = sample( ci + 1, cj );
+			const vec3f s11 = sample( ci + 1, cj + 1 );
+
+			for( int f = 0; f < 2; ++f ) {
+				++tested;
+				const vec3f& va = f ? s01 : s00;
+				const vec3f& vb = f ? s11 : s01;
+				const vec3f cv = (vb - va).cross( s10 - va );
+				double t;
+				vec3f bary;
+				if( intersectTriangle( faceRay, cv.normalize(), va, vb, s10, t, bary ) ) {
+					const int face = 2 * (ci + cj * cellsX) + f;
+					if( t < bestT || (t == bestT && face < bestFace) ) {
+						bestT = t;
+						bestFace = face;
+						bestBary = bary;
+					}
+				}
+			}
+			continue;
+		}
+
+		// the children: blocks of the level below, or the cells of a
+		// first level block, whose heights come straight from the samples
+		HeightfieldNode children[4];
+		int count = 0;
+		for( int dj = 0; dj < 2; ++dj ) {
+			for( int di = 0; di < 2; ++di ) {
+				HeightfieldNode child;
+				child.level = node.level - 1;
+				child.a = 2 * node.a + di;
+				child.b = 2 * node.b + dj;
+
+				BoundingBox box;
+				if( child.level < 0 ) {
+					if( child.a >= cellsX || child.b >= cellsZ )
+						continue;
+					const float h00 = height( child.a, child.b );
+					const float h01 = height( child.a, child.b + 1 );
+					const float h10 = height( child.a + 1, child.b );
+					const float h11 = height( child.a + 1, child.b + 1 );
+					box = blockBox( child.a, child.a + 1, child.b, child.b + 1,
+						std::min( std::min( h00, h01 ), std::min( h10, h11 ) ),
+						std::max( std::max( h00, h01 ), std::max( h10, h11 ) ) );
+				} else {
+					const Level& level = levels[ child.level ];
+					if( child.a >= level.width || child.b >= level.depth )
+						continue;
+					const Range& range = level.ranges[ child.a + child.b * level.width ];
+					const int size = 2 << child.level;
+					box = blockBox( child.a * size, std::min( (child.a + 1) * size, cellsX ),
+						child.b * size, std::min( (child.b + 1) * size, cellsZ ),
+						range.lo, range.hi );
+				}
+
+				if( !box.intersect( r, child.tNear, tFar ) || tFar < RAY_EPSILON || child.tNear > bestT )
+					continue;
+
+				// keep children sorted far to near
+				int k = count++;
+				for( ; k > 0 && children[ k - 1 ].tNear < child.tNear; --k )
+					children[k] = children[ k - 1 ];
+				children[k] = child;
+			}
+		}
+
+		for( int k = 0; k < count; ++k )
+			stack[ top++ ] = children[k];
+	}
+
+	threadRayStats().triangleTests += tested;
+	if( bestFace < 0 )
+		return false;
+
+	// interpolate the normals of the face's samples, as a mesh does
+	const int cell = bestFace / 2;
+	const int ci = cell % cellsX;
+	const int cj = cell / cellsX;
+	vec3f normal;
+	if( bestFace % 2 == 0 ) {
+		normal = bestBary[0] * sampleNormal( ci, cj )
+			+ bestBary[1] * sampleNormal( ci, cj + 1 )
+			+ bestBary[2] * sampleNormal( ci + 1, cj );
+	} else {
+		normal = bestBary[0] * sampleNormal( ci, cj + 1 )
+			+ bestBary[1] * sampleNormal( ci + 1, cj + 1 )
+			+ bestBary[2] * sampleNormal( ci + 1, cj );
+	}
+
+	i.obj = this;
+	i.setT( bestT );
+	i.setN( normal.normalize() );
+	i.bary = bestBary;
+	i.face = bestFace;
+	return true;
+}
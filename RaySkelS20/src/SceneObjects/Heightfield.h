@@ -0,0 +1,72 @@
+#ifndef __HEIGHTFIELD_H__
+#define __HEIGHTFIELD_H__
+
+#include <vector>
+
+#include "../scene/scene.h"
+
+// A height field: a grid of width by depth height samples over a
+// rectangle, by default the unit square, sample (i, j) being the point
+//
+//   ( sizeX * i / (width - 1), heights[ i + j * width ], sizeZ * j / (depth - 1) )
+//
+// Each cell of four samples is the two triangles loadHeightMap used to
+// make of it, shaded with normals averaged over the neighbouring faces
+// as generateNormals would, and like mesh faces they can only be hit from
+// above.  Only the heights are stored (no vertices, faces or hierarchy of
+// boxes), with a pyramid of the lowest and highest height under each 2x2,
+// 4x4, ... block of cells.  A ray walks down the pyramid front to back,
+// skipping every block whose height range it passes above or below, so
+// only the few cells along its path near the surface are tested.
+class Heightfield
+	: public MaterialSceneObject
+{
+public:
+	// Takes the heights, which must number width * depth, and leaves
+	// heights empty.  width and depth must be at least 2.
+	Heightfield( Scene *scene, Material *mat, int width, int depth, vector<float>& heights,
+		double sizeX = 1.0, double sizeZ = 1.0 );
+
+	int getWidth() const { return width; }
+	int getDepth() const { return depth; }
+	const vector<float>& getHeights() const { return heights; }
+	double getSizeX() const { return sizeX; }
+	double getSizeZ() const { return sizeZ; }
+
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual BoundingBox ComputeLocalBoundingBox();
+	virtual double intersectCost() const;
+
+private:
+	struct Range
+	{
+		float lo, hi;
+	};
+
+	// Level k of the pyramid has a Range for each block of 2^(k+1) by
+	// 2^(k+1) cells, row by row; the last level is a single block.
+	struct Level
+	{
+		int width, depth;
+		vector<Range> ranges;
+	};
+
+	float height( int i, int j ) const { return heights[ i + j * width ]; }
+	vec3f sample( int i, int j ) const;
+
+	// The normal of face f (0 or 1) of the cell whose first sample is
+	// (i, j), and the normal generateNormals would give sample (i, j).
+	vec3f faceNormal( int i, int j, int f ) const;
+	vec3f sampleNormal( int i, int j ) const;
+
+	// The box holding cells [i0, i1) x [j0, j1) at heights lo to hi.
+	BoundingBox blockBox( int i0, int i1, int j0, int j1, float lo, float hi ) const;
+
+	int width, depth;
+	double sizeX, sizeZ;
+	vector<float> heights;
+	vector<Level> levels;
+};
+
+#endif // __HEIGHTFIELD_H__
@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "Metaball.h"
+#include "../scene/raystats.h"
+
+const double Metaball::THRESHOLD = 0.25;
+
+// The square of the distance at which a ball's field ends, for which the
+// field is THRESHOLD at the ball's radius: (1 - r^2/R^2)^2 = 1/4.
+static double influence2( const Metaball::Ball& b )
+{
+	return 2.0 * b.radius * b.radius;
+}
+
+// The steepest the field of a ball with influence R (R2 = R^2) gets
+// between distances lo and hi from its center.  The slope of
+// (1 - d^2/R^2)^2 is 4d/R^2 (1 - d^2/R^2), which peaks at d = R/sqrt(3).
+static double ballSlope( double lo, double hi, double R2 )
+{
+	const double R = sqrt( R2 );
+	hi = std::min( hi, R );
+	if( lo >= hi )
+		return 0.0;
+
+	const double peak = R / sqrt( 3.0 );
+	if( lo <= peak && peak <= hi )
+		return 8.0 / (3.0 * sqrt( 3.0 ) * R);
+
+	const double slopeLo = 4.0 * lo / R2 * (1.0 - lo * lo / R2);
+	const double slopeHi = 4.0 * hi / R2 * (1.0 - hi * hi / R2);
+	return std::max( slopeLo, slopeHi );
+}
+
+Metaball::Metaball( Scene *scene, Material *mat, const vector<Ball>& balls, int gridSize, double size )
+	: MaterialSceneObject( scene, mat ), balls( balls ), gridSize( gridSize ), size( size )
+{
+	for( size_t k = 0; k < balls.size(); ++k ) {
+		const double R = sqrt( influence2( balls[k] ) );
+		const vec3f reach( R, R, R );
+		if( k == 0 ) {
+			bounds.min = balls[k].center - reach;
+			bounds.max = balls[k].center + reach;
+		} else {
+			bounds.min = minimum( bounds.min, balls[k].center - reach );
+			bounds.max = maximum( bounds.max, balls[k].center + reach );
+		}
+	}
+
+	if( size > 0 ) {
+		gridBounds.min = vec3f( -size, -size, -size );
+		gridBounds.max = vec3f( size, size, size );
+		bounds.min = maximum( bounds.min, gridBounds.min );
+		bounds.max = minimum( bounds.max, gridBounds.max );
+	} else {
+		gridBounds = bounds;
+	}
+
+	cellSize = (gridBounds.max - gridBounds.min) / gridSize;
+
+	// Steps are never shorter than this, so that a ray running along the
+	// surface doesn't crawl.  Only features much thinner than the smallest
+	// ball are lost.
+	minStep = std::min( std::min( cellSize[0], cellSize[1] ), cellSize[2] );
+	for( size_t k = 0; k < balls.size(); ++k )
+		minStep = std::min( minStep, balls[k].radius );
+	minStep /= 64.0;
+}
+
+void Metaball::buildAccelerationStructure( BVHBuilder& builder )
+{
+	if( !cellStart.empty() )
+		return;
+
+	const int cells = gridSize * gridSize * gridSize;
+	vector<int> counts( cells, 0 );
+
+	// Twice over the balls: count the cells each one reaches, then fill
+	// them in.
+	for( int pass = 0; pass < 2; ++pass ) {
+		if( pass == 1 ) {
+			cellStart.resize( cells + 1 );
+			cellStart[0] = 0;
+			for( int c = 0; c < cells; ++c )
+				cellStart[ c + 1 ] = cellStart[c] + counts[c];
+			cellBalls.resize( cellStart[ cells ] );
+			std::fill( counts.begin(), counts.end(), 0 );
+		}
+
+		for( size_t k = 0; k < balls.size(); ++k ) {
+			const vec3f& center = balls[k].center;
+			const double R2 = influence2( balls[k] );
+			const double R = sqrt( R2 );
+
+			int lo[3], hi[3];
+			for( int axis = 0; axis < 3; ++axis ) {
+				lo[axis] = (int)floor( (center[axis] - R - gridBounds.min[axis]) / cellSize[axis] );
+				hi[axis] = (int)floor( (center[axis] + R - gridBounds.min[axis]) / cellSize[axis] );
+				lo[axis] = std::max( lo[axis], 0 );
+				hi[axis] = std::min( hi[axis], gridSize - 1 );
+			}
+
+			for( int z = lo[2]; z <= hi[2]; ++z ) {
+				for( int y = lo[1]; y <= hi[1]; ++y ) {
+					for( int x = lo[0]; x <= hi[0]; ++x ) {
+						const vec3f cellMin = gridBounds.min + prod( vec3f( x, y, z ), cellSize );
+						const vec3f nearest = minimum( maximum( center, cellMin ), cellMin + cellSize );
+						if( (nearest - center).length_squared() > R2 )
+							continue;
+
+						const int c = x + gridSize * (y + gridSize * z);
+						if( pass == 1 )
+							cellBalls[ cellStart[c] + counts[c] ] = k;
+						++counts[c];
+					}
+				}
+			}
+		}
+	}
+
+	// how fast the field can change in each cell
+	cellSlope.assign( cells, 0.0 );
+	for( int c = 0; c < cells; ++c ) {
+		const int x = c % gridSize;
+		const int y = (c / gridSize) % gridSize;
+		const int z = c / (gridSize * gridSize);
+		const vec3f cellMin = gridBounds.min + prod( vec3f( x, y, z ), cellSize );
+		const vec3f cellMax = cellMin + cellSize;
+
+		for( int k = cellStart[c]; k < cellStart[ c + 1 ]; ++k ) {
+			const Ball& b = balls[ cellBalls[k] ];
+			const vec3f nearest = minimum( maximum( b.center, cellMin ), cellMax );
+			vec3f farthest;
+			for( int axis = 0; axis < 3; ++axis ) {
+				farthest[axis] = b.center[axis] - cellMin[axis] > cellMax[axis] - b.center[axis] ?
+					cellMin[axis] : cellMax[axis];
+			}
+			cellSlope[c] += ballSlope( (nearest - b.center).length(),
+				(farthest - b.center).length(), influence2( b ) );
+		}
+	}
+}
+
+double Metaball::intersectCost() const
+{
+	// a walk through part of the grid, with a few steps in the cells
+	// that have balls in them
+	return 0.5 * gridSize + 4.0;
+}
+
+double Metaball::field( int c, const vec3f& p ) const
+{
+	double sum = 0.0;
+	for( int k = cellStart[c]; k < cellStart[ c + 1 ]; ++k ) {
+		const Ball& b = balls[ cellBalls[k] ];
+		const double R2 = influence2( b );
+		const double d2 = (p - b.center).length_squared();
+		if( d2 < R2 ) {
+			const double s = 1.0 - d2 / R2;
+			sum += s * s;
+		}
+	}
+	return sum - THRESHOLD;
+}
+
+int Metaball::cellOf( const vec3f& p ) const
+{
+	int cell[3];
+	for( int axis = 0; axis < 3; ++axis ) {
+		cell[axis] = (int)floor( (p[axis] - gridBounds.min[axis]) / cellSize[axis] );
+		cell[axis] = std::min( std::max( cell[axis], 0 ), gridSize - 1 );
+	}
+	return cell[0] + gridSize * (cell[1] + gridSize * cell[2]);
+}
+
+bool Metaball::intersectLocal( const ray& r, isect& i ) const
+{
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_METABALL ] );
+
+	double tMin, tMax;
+	if( cellStart.empty() || !bounds.intersect( r, tMin, tMax ) )
+		return false;
+	tMin = std::max( tMin, RAY_EPSILON );
+	if( tMin >= tMax )
+		return false;
+
+	// Set up the walk through the grid (Amanatides and Woo), from the
+	// cell the clipped ray starts in.
+	const vec3f& d = r.getDirection();
+	const vec3f start = r.at( tMin );
+	int cell[3], step[3];
+	double tNext[3], tDelta[3];
+	for( int axis = 0; axis < 3; ++axis ) {
+		cell[axis] = (int)floor( (start[axis] - gridBounds.min[axis]) / cellSize[axis] );
+		cell[axis] = std::min( std::max( cell[axis], 0 ), gridSize - 1 );
+		if( d[axis] > 0 ) {
+			step[axis] = 1;
+			tNext[axis] = (gridBounds.min[axis] + (cell[axis] + 1) * cellSize[axis] - r.getPosition()[axis]) / d[axis];
+			tDelta[axis] = cellSize[axis] / d[axis];
+		} else if( d[axis] < 0 ) {
+			step[axis] = -1;
+			tNext[axis] = (gridBounds.min[axis] + cell[axis] * cellSize[axis] - r.getPosition()[axis]) / d[axis];
+			tDelta[axis] = -cellSize[axis] / d[axis];
+		} else {
+			step[axis] = 0;
+			tNext[axis] = DBL_MAX;
+			tDelta[axis] = DBL_MAX;
+		}
+	}
+
+	double t = tMin;
+	int c = cell[0] + gridSize * (cell[1] + gridSize * cell[2]);
+	// the last point on the side of the surface the ray starts on
+	double prevT = t;
+	const bool inside = field( c, start ) > 0;
+	bool crossed = false;
+	double v;
+
+	while( !crossed ) {
+		const double tExit = std::min( std::min( std::min( tNext[0], tNext[1] ), tNext[2] ), tMax );
+
+		if( cellStart[c] == cellStart[ c + 1 ] ) {
+			// no ball reaches an empty cell, so the field there is zero
+			crossed = inside;
+			prevT = inside ? prevT : t;
+		} else {
+			// Inside the cell the field changes by at most cellSlope[c]
+			// per unit, so it can't reach the threshold within |v| / slope.
+			const double slope = cellSlope[c];
+			while( true ) {
+				v = field( c, r.at( t ) );
+				if( (v > 0) != inside ) {
+					crossed = true;
+					break;
+				}
+				prevT = t;
+
+				const double safe = slope > 0 ? fabs( v ) / slope : tExit - t;
+				const double next = t + std::max( safe, minStep );
+				if( next >= tExit )
+					break;
+				t = next;
+			}
+		}
+		if( crossed )
+			break;
+
+		if( tExit >= tMax ) {
+			// the rest of the ray up to the end of the box
+			t = tMax;
+			v = field( c, r.at( t ) );
+			crossed = (v > 0) != inside;
+			break;
+		}
+
+		// on to the next cell
+		int axis = 0;
+		if( tNext[1] < tNext[axis] )
+			axis = 1;
+		if( tNext[2] < tNext[axis] )
+			axis = 2;
+		cell[axis] += step[axis];
+		if( cell[axis] < 0 || cell[axis] >= gridSize )
+			return false;
+		tNext[axis] += tDelta[axis];
+		t = tExit;
+		c = cell[0] + gridSize * (cell[1] + gridSize * cell[2]);
+	}
+
+	if( !crossed )
+		return false;
+
+	// The field crosses the threshold between prevT and t; close in on
+	// where by bisection.
+	double a = prevT;
+	double b = t;
+	for( int k = 0; k < 60 && b - a > 1e-12 * (1.0 + b); ++k ) {
+		const double m = 0.5 * (a + b);
+		const vec3f p = r.at( m );
+		if( (field( cellOf( p ), p ) > 0) == inside )
+			a = m;
+		else
+			b = m;
+	}
+	const double hit = 0.5 * (a + b);
+	if( hit < RAY_EPSILON )
+		return false;
+
+	// The normal points down the field: minus its gradient, which is the
+	// sum of -4 (1 - d^2/R^2) / R^2 (p - center) over the balls.
+	const vec3f p = r.at( hit );
+	const int hc = cellOf( p );
+	vec3f normal;
+	for( int k = cellStart[hc]; k < cellStart[ hc + 1 ]; ++k ) {
+		const Ball& ball = balls[ cellBalls[k] ];
+		const double R2 = influence2( ball );
+		const vec3f offset = p - ball.center;
+		const double d2 = offset.length_squared();
+		if( d2 < R2 )
+			normal += (4.0 * (1.0 - d2 / R2) / R2) * offset;
+	}
+
+	i.obj = this;
+	i.setT( hit );
+	i.setN( normal.iszero() ? -d : normal.normalize() );
+	return true;
+}
@@ -0,0 +1,74 @@
+#ifndef __METABALL_H__
+#define __METABALL_H__
+
+#include <vector>
+
+#include "../scene/scene.h"
+
+// Metaballs: the surface where the summed field of a set of balls reaches
+// THRESHOLD.  Each ball's field is (1 - d^2/R^2)^2 at distance d < R from
+// its center and 0 beyond, with R = sqrt(2) times the ball's radius, so a
+// ball on its own is a sphere of that radius and balls near each other
+// blend together.
+//
+// The balls are sorted into a uniform grid of gridSize cells on each
+// side, each cell listing the balls whose field reaches it and a bound on
+// how fast their sum can change there.  A ray walks the grid cell by
+// cell, skipping the empty ones, and in the others steps along by the
+// distance the field can't reach the threshold within (sphere tracing),
+// until it crosses it; the crossing is then found by bisection.
+//
+// With a size, the grid is the cube from -size to size on each axis and
+// the surface is cut off at its sides; without one it covers the balls.
+class Metaball
+	: public MaterialSceneObject
+{
+public:
+	struct Ball
+	{
+		vec3f center;
+		double radius;
+	};
+
+	// radius must be positive for every ball.  size <= 0 means none.
+	Metaball( Scene *scene, Material *mat, const vector<Ball>& balls, int gridSize, double size );
+
+	const vector<Ball>& getBalls() const { return balls; }
+	int getGridSize() const { return gridSize; }
+	double getSize() const { return size; }
+
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual BoundingBox ComputeLocalBoundingBox() { return bounds; }
+	virtual void buildAccelerationStructure( BVHBuilder& builder );
+	virtual double intersectCost() const;
+
+	static const double THRESHOLD;
+
+private:
+	// The field at p, which must lie in cell c, less THRESHOLD.
+	double field( int c, const vec3f& p ) const;
+
+	// The cell holding p, clamped to the grid.
+	int cellOf( const vec3f& p ) const;
+
+	vector<Ball> balls;
+	int gridSize;
+	double size;
+
+	// The box around every ball's field (cut to the cube if there is
+	// one), which rays are clipped to, and the box the grid covers.
+	BoundingBox bounds;
+	BoundingBox gridBounds;
+	vec3f cellSize;
+	double minStep;
+
+	// Cell c lists the balls cellBalls[ cellStart[c] ] up to
+	// cellBalls[ cellStart[c + 1] ], and the sum of their fields changes
+	// by at most cellSlope[c] per unit of distance inside it.
+	vector<int> cellStart;
+	vector<int> cellBalls;
+	vector<double> cellSlope;
+};
+
+#endif // __METABALL_H__
@@ -1,9 +1,11 @@
 #include <cmath>
 
 #include "Sphere.h"
+#include "../scene/raystats.h"
 
 bool Sphere::intersectLocal( const ray& r, isect& i ) const
 {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_SPHERE ] );
 	vec3f v = -r.getPosition();
 	double b = v.dot(r.getDirection());
 	double discriminant = b*b - v.dot(v) + 1;
@@ -34,3 +36,23 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 	return true;
 }
 
+bool Sphere::intersectLocalSpans( const ray& r, SpanList& spans ) const
+{
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_SPHERE ] );
+	vec3f v = -r.getPosition();
+	double b = v.dot(r.getDirection());
+	double discriminant = b*b - v.dot(v) + 1;
+
+	// a ray that misses, or only touches, is never inside
+	if( discriminant <= 0.0 ) {
+		return true;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t1 = b - discriminant;
+	double t2 = b + discriminant;
+	spans.add( SpanEnd( t1, r.at( t1 ).normalize(), this ),
+		SpanEnd( t2, r.at( t2 ).normalize(), this ) );
+	return true;
+}
+
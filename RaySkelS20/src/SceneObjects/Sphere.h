@@ -13,6 +13,7 @@ public:
 	}
     
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool intersectLocalSpans( const ray& r, SpanList& spans ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -1,9 +1,11 @@
 #include <cmath>
 
 #include "Square.h"
+#include "../scene/raystats.h"
 
 bool Square::intersectLocal( const ray& r, isect& i ) const
 {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_SQUARE ] );
 	vec3f p = r.getPosition();
 	vec3f d = r.getDirection();
 
@@ -1,57 +1,96 @@
-#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 
 #include "Torus.h"
+#include "../scene/raystats.h"
 #include "../vecmath/quartic.h"
 
-Torus::Torus(Scene *scene, Material *mat, const float &A, const float &B)
+Torus::Torus(Scene *scene, Material *mat, double A, double B)
 	: MaterialSceneObject(scene, mat), A(A), B(B) {} 
 
-bool Torus::intersectLocal(const ray &r, isect &iSect) const {
-	
-	// Build the torus intersection equation
+// The roots of the torus equation along r from tLow on, in order, of which
+// there are at most four.
+int Torus::findRoots(const ray &r, double tLow, double *roots) const {
 	const vec3f D = r.getDirection();
-	const float Dx = D[0], Dy = D[1], Dz = D[2];
 	const vec3f E = r.getPosition();
-	const float Ex = E[0], Ey = E[1], Ez = E[2];
-
-	const float G = 4 * this->A * this->A * (Ex * Ex + Ey * Ey);
-	const float H = 8 * this->A * this->A * (Dx * Ex + Dy * Ey);
-	const float I = 4 * this->A * this->A * (Dx * Dx + Dy * Dy);
-	const float J = E.length_squared();
-	const float K = 2 * D.dot(E);
-	const float L = D.length_squared() + (this->A * this->A - this->B * this->B);
-
-	const float const_term	= L * L - I;
-	const float linear_term = 2 * K * L - H;
-	const float quad_term	= 2 * J * L + K * K - G;
-	const float third_term	= 2 * J * K;
-	const float forth_term	= J * J;
-
-	auto *solutions = solve_quartic(third_term / forth_term, quad_term / forth_term, linear_term / forth_term, const_term / forth_term);
-	std::vector<double> ts;
-	for (auto ti = 0; ti < 4; ti++) 	{
-		if (solutions[ti].imag() != 0.0 || solutions[ti].real() < 0 || solutions[ti].real() < RAY_EPSILON) 		{
-			continue;
-		}
-		ts.push_back(solutions[ti].real());
+	const double DD = D.length_squared();
+
+	// Clip the ray to the sphere of radius A + B around the torus and to
+	// the slab |z| <= B it lies in, which most rays that reach here miss.
+	const double R = this->A + this->B;
+	const double DE = D.dot(E);
+	const double disc = DE * DE - DD * (E.length_squared() - R * R);
+	if (disc <= 0) { return 0; }
+
+	const double root = sqrt(disc);
+	double tMin = (-DE - root) / DD;
+	double tMax = (-DE + root) / DD;
+	if (D[2] != 0) {
+		double t0 = (-this->B - E[2]) / D[2];
+		double t1 = (this->B - E[2]) / D[2];
+		if (t0 > t1) { std::swap(t0, t1); }
+		tMin = std::max(tMin, t0);
+		tMax = std::min(tMax, t1);
+	} else if (fabs(E[2]) > this->B) {
+		return 0;
 	}
-	delete[] solutions;
+	tMin = std::max(tMin, tLow);
+	if (tMin >= tMax) { return 0; }
 
-	if (ts.empty()) { return false; }
+	// Build the torus intersection equation for the ray O + uD starting
+	// where the clipped one does, which keeps the coefficients small.
+	const vec3f O = E + tMin * D;
+	const double A2 = this->A * this->A;
+	const double G = 4 * A2 * (D[0] * D[0] + D[1] * D[1]);
+	const double H = 8 * A2 * (D[0] * O[0] + D[1] * O[1]);
+	const double I = 4 * A2 * (O[0] * O[0] + O[1] * O[1]);
+	const double J = DD;
+	const double K = 2 * D.dot(O);
+	const double L = O.length_squared() + A2 - this->B * this->B;
 
-	std::sort(ts.begin(), ts.end());
+	// J^2 u^4 + 2JK u^3 + (2JL + K^2 - G) u^2 + (2KL - H) u + (L^2 - I) = 0
+	const double J2 = J * J;
+	const int count = solveQuarticInterval(roots, 2 * K / J, (2 * J * L + K * K - G) / J2,
+		(2 * K * L - H) / J2, (L * L - I) / J2, 0.0, tMax - tMin);
+	for (int k = 0; k < count; k++) { roots[k] += tMin; }
+	return count;
+}
 
-	const auto t = iSect.t = ts[0];
+// The normal points away from the circle through the middle of the tube.
+vec3f Torus::normalAt(const vec3f &p) const {
+	const double alpha = 1.0 - this->A / sqrt(p[0] * p[0] + p[1] * p[1]);
+	return vec3f(alpha * p[0], alpha * p[1], p[2]).normalize();
+}
+
+bool Torus::intersectLocal(const ray &r, isect &iSect) const {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_TORUS ] );
 
-	const auto pp = r.at(t);
+	double roots[4];
+	if (!findRoots(r, RAY_EPSILON, roots)) { return false; }
 
-	const auto alpha = 1.0 - this->A / sqrt(pp[0] * pp[0] + pp[1] * pp[1]);
-	iSect.N = -vec3f {alpha * pp[0], alpha * pp[1], pp[2]}.normalize();
+	const double t = iSect.t = roots[0];
+	iSect.N = normalAt(r.at(t));
 	iSect.obj = this;
 
 	return true;
 }
 
+// The ray is inside the torus between the first and second roots, and
+// between the third and fourth.
+bool Torus::intersectLocalSpans(const ray &r, SpanList &spans) const {
+	COUNT_RAY_STAT( intersectLocalCalls[ PRIM_TORUS ] );
+
+	double roots[4];
+	const int count = findRoots(r, -DBL_MAX, roots);
+	for (int k = 0; k + 1 < count; k += 2) {
+		spans.add(SpanEnd(roots[k], normalAt(r.at(roots[k])), this),
+			SpanEnd(roots[k + 1], normalAt(r.at(roots[k + 1])), this));
+	}
+	return true;
+}
+
+// Roots are only looked for inside the box, so the torus can go in the BVH.
 bool Torus::hasBoundingBoxCapability() const {
 	return true;
 }
@@ -62,4 +101,3 @@ BoundingBox Torus::ComputeLocalBoundingBox() {
 	localBounds.max = vec3f(this->A + this->B, this->A + this->B, this->B);
 	return localBounds;
 }
-
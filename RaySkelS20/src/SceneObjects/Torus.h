@@ -4,14 +4,24 @@
 
 // Bonus 12 : New Geometry
 // Reference: http://cosinekitty.com/raytrace/chapter13_torus.html
+//
+// The torus lies around the z axis: its tube, of radius B, circles the
+// origin at distance A in the xy plane.
 class Torus : public MaterialSceneObject {
 public:
-	Torus(Scene *scene, Material *mat, const float &A, const float &B);
+	Torus(Scene *scene, Material *mat, double A, double B);
 	virtual bool intersectLocal(const ray &r, isect &iSect) const override;
+	virtual bool intersectLocalSpans(const ray &r, SpanList &spans) const override;
 	virtual bool hasBoundingBoxCapability() const override;
 	virtual BoundingBox ComputeLocalBoundingBox() override;
+
+	double getA() const { return A; }
+	double getB() const { return B; }
 	
 private:
-	float A;
-	float B;
+	int findRoots(const ray &r, double tLow, double *roots) const;
+	vec3f normalAt(const vec3f &p) const;
+
+	double A;
+	double B;
 };
\ No newline at end of file
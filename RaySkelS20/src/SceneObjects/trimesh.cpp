@@ -1,43 +1,47 @@
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <float.h>
 #include "trimesh.h"
+#include "../scene/bvh.h"
+#include "../scene/raystats.h"
 
-Trimesh::~Trimesh()
+TrimeshGeometry::~TrimeshGeometry()
 {
     for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
     {
         delete *i;
     }
+    delete bvh;
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
-    vertices.push_back( v );
+    geometry->vertices.push_back( v );
 }
 
 void Trimesh::addMaterial( Material *m )
 {
-    materials.push_back( m );
+    geometry->materials.push_back( m );
 }
 
 void Trimesh::addNormal( const vec3f &n )
 {
-    normals.push_back( n );
+    geometry->normals.push_back( n );
 }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace( int a, int b, int c )
 {
-    int vcnt = vertices.size();
+    int vcnt = geometry->vertices.size();
 
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    geometry->indices.push_back( a );
+    geometry->indices.push_back( b );
+    geometry->indices.push_back( c );
     return true;
 }
 
@@ -46,104 +50,203 @@ Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 {
-    if( materials.size() && materials.size() != vertices.size() )
+    const TrimeshGeometry& g = *geometry;
+    if( g.materials.size() && g.materials.size() != g.vertices.size() )
         return "Bad Trimesh: Wrong number of materials.";
-    if( normals.size() && normals.size() != vertices.size() )
+    if( g.normals.size() && g.normals.size() != g.vertices.size() )
         return "Bad Trimesh: Wrong number of normals.";
 
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
-{
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
+TrimeshGeometry::FaceRay::FaceRay( const ray& r )
+    : p( r.getPosition() ), d( r.getDirection() )
+{
+    kz = 0;
+    if( fabs( d[1] ) > fabs( d[kz] ) )
+        kz = 1;
+    if( fabs( d[2] ) > fabs( d[kz] ) )
+        kz = 2;
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+
+    // keep the winding of the faces when looking down -z
+    if( d[kz] < 0 )
+        std::swap( kx, ky );
+
+    sx = d[kx] / d[kz];
+    sy = d[ky] / d[kz];
+    sz = 1.0 / d[kz];
+}
+
+// Intersect ray r with face f.  If it hits returns true, and puts the
+// parameter in i.t and the barycentric coordinates of the intersection
+// in i.bary, which resolveMaterial() and the normal interpolation use.
+// As before only the front side of a face can be hit.
+bool TrimeshGeometry::intersectFace( int f, const FaceRay& r, isect& i ) const
+{
+    COUNT_RAY_STAT( intersectLocalCalls[ PRIM_TRIMESH_FACE ] );
+
+    // degenerate faces have a zero normal and fail this too
+    const vec3f& n = faceNormals[f];
+    if( -(r.d * n) < NORMAL_EPSILON )
         return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
+
+    const int *ids = &indices[ 3 * f ];
+    const vec3f a = vertices[ids[0]] - r.p;
+    const vec3f b = vertices[ids[1]] - r.p;
+    const vec3f c = vertices[ids[2]] - r.p;
+
+    // shear the vertices into the ray's frame
+    const double ax = a[r.kx] - r.sx * a[r.kz];
+    const double ay = a[r.ky] - r.sy * a[r.kz];
+    const double bx = b[r.kx] - r.sx * b[r.kz];
+    const double by = b[r.ky] - r.sy * b[r.kz];
+    const double cx = c[r.kx] - r.sx * c[r.kz];
+    const double cy = c[r.ky] - r.sy * c[r.kz];
+
+    // The edge functions, each twice the area of the sub-triangle opposite
+    // a vertex.  Points on an edge give exactly zero and are kept.
+    const double u = cx * by - cy * bx;
+    const double v = ax * cy - ay * cx;
+    const double w = bx * ay - by * ax;
+    if( (u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0) )
         return false;
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
-    {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
-        {
-            k = j;
-            greatestMag = val;
-        }
-    }
+    const double det = u + v + w;
+    if( det == 0 )
+        return false;
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+    const double t = (u * r.sz * a[r.kz] + v * r.sz * b[r.kz] + w * r.sz * c[r.kz]) / det;
+    if( t < RAY_EPSILON )
         return false;
 
+    vec3f bary( u / det, v / det, w / det );
+
     // if we get this far, we have an intersection.  Fill in the info.
     i.setT( t );
-    if(parent->normals.size())
+    if(normals.size())
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( (bary[0] * normals[ids[0]]
+                 + bary[1] * normals[ids[1]]
+                 + bary[2] * normals[ids[2]]).normalize() );
     } else {
         i.setN( n );           // use face normal
     }
+    i.bary = bary;
+    i.face = f;
+    
+    return true;
+}
+
+// The closest-hit query intersectLocal runs over the face hierarchy.  Of
+// two faces hit at the same distance, the one added first wins.
+struct MeshHitQuery
+{
+    const TrimeshGeometry& mesh;
+    TrimeshGeometry::FaceRay r;
+    isect& i;
+    bool have_one;
+    isect cur;
+    int tested;
+
+    MeshHitQuery( const TrimeshGeometry& mesh, const ray& r, isect& i )
+        : mesh( mesh ), r( r ), i( i ), have_one( false ), tested( 0 ) {}
+
+    double limit() const { return have_one ? i.t : DBL_MAX; }
+
+    void test( int f )
+    {
+        ++tested;
+        if( mesh.intersectFace( f, r, cur ) ) {
+            if( !have_one || cur.t < i.t || (cur.t == i.t && f < i.face) ) {
+                i = cur;
+                have_one = true;
+            }
+        }
+    }
+};
+
+bool TrimeshGeometry::intersect( const ray& r, isect& i ) const
+{
+    if( !bvh )
+        return false;
+
+    MeshHitQuery query( *this, r, i );
+    bvh->closestHit( r, query );
+    threadRayStats().triangleTests += query.tested;
+    return query.have_one;
+}
+
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    if( !geometry->intersect( r, i ) )
+        return false;
+
     i.obj = this;
+    return true;
+}
+
+BoundingBox TrimeshGeometry::bounds() const
+{
+    BoundingBox localbounds;
+    if( vertices.empty() )
+        return localbounds;
+
+    localbounds.min = localbounds.max = vertices[0];
+    for( size_t k = 1; k < vertices.size(); ++k )
+    {
+        localbounds.min = minimum( localbounds.min, vertices[k] );
+        localbounds.max = maximum( localbounds.max, vertices[k] );
+    }
+    return localbounds;
+}
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
+void TrimeshGeometry::buildAccelerationStructure( BVHBuilder& builder )
+{
+    if( bvh )
+        return;
+
+    const int count = numFaces();
+    vector<BoundingBox> boxes( count );
+    faceNormals.resize( count );
+    for( int f = 0; f < count; ++f )
     {
-        Material *m = new Material();
+        const int *ids = &indices[ 3 * f ];
+        vec3f cv = (vertices[ids[1]] - vertices[ids[0]]).cross( vertices[ids[2]] - vertices[ids[0]] );
+
+        // there exist some bad triangles such that two vertices coincide
+        faceNormals[f] = cv.iszero() ? vec3f() : cv.normalize();
+
+        boxes[f].min = minimum( minimum( vertices[ids[0]], vertices[ids[1]] ), vertices[ids[2]] );
+        boxes[f].max = maximum( maximum( vertices[ids[0]], vertices[ids[1]] ), vertices[ids[2]] );
+    }
+
+    bvh = builder.build( boxes );
+}
+
+double Trimesh::intersectCost() const
+{
+    return geometry->bvh ? geometry->bvh->sahCost() : 1.0;
+}
+
+// linearly interpolate materials
+void Trimesh::resolveMaterial( isect& i ) const
+{
+    const TrimeshGeometry& g = *geometry;
+    if( g.materials.size() )
+    {
+        const int *ids = &g.indices[ 3 * i.face ];
+        Material m;
         for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
+            m += i.bary[jj] * (*g.materials[ ids[jj] ]);
         i.setMaterial( m );
     }
-    
-    return true;
 }
 
 void
-Trimesh::generateNormals()
+TrimeshGeometry::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
 {
@@ -152,18 +255,18 @@ Trimesh::generateNormals()
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    for( size_t fi = 0; fi < indices.size(); fi += 3 )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3f a = vertices[indices[fi]];
+        vec3f b = vertices[indices[fi + 1]];
+        vec3f c = vertices[indices[fi + 2]];
         
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[indices[fi + i]] += faceNormal;
+            ++numFaces[indices[fi + i]];
         }
     }
 
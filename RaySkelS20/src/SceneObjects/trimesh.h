@@ -2,32 +2,101 @@
 #define TRIMESH_H__
 
 #include <list>
+#include <memory>
 #include <vector>
 
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+class BVH;
 
-class Trimesh : public MaterialSceneObject
+// The part of a triangle mesh that does not depend on where it is placed:
+// its vertex data, its faces and the bounding volume hierarchy over them,
+// all in the mesh's own coordinates.  Every Trimesh placing the same mesh
+// shares one, so a scene with many copies of a model only stores and
+// builds it once.
+class TrimeshGeometry
 {
-    friend class TrimeshFace;
+public:
     typedef vector<vec3f> Normals;
     typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
     typedef vector<Material*> Materials;
+
+    TrimeshGeometry() : bvh( NULL ) {}
+    ~TrimeshGeometry();
+
+    int numFaces() const { return indices.size() / 3; }
+
+    void generateNormals();
+
+    // Build the face hierarchy, unless it has been built already.
+    void buildAccelerationStructure( BVHBuilder& builder );
+
+    BoundingBox bounds() const;
+
+    // A ray set up for the watertight triangle test of Woop, Benthin and
+    // Wald (JCGT 2013): the axis the ray mostly runs along becomes z and
+    // the shear that makes the ray point straight down it is kept, so the
+    // test of each face reduces to three 2D edge functions.  The setup is
+    // done once per ray rather than once per face.
+    struct FaceRay
+    {
+        FaceRay( const ray& r );
+
+        vec3f p;                // origin
+        vec3f d;                // direction
+        int kx, ky, kz;
+        double sx, sy, sz;
+    };
+
+    // Intersect r with face f alone.  Faces that share an edge compute it
+    // from the same two vertices, so a ray that hits the edge hits at
+    // least one of them.
+    bool intersectFace( int f, const FaceRay& r, isect& i ) const;
+
+    // Find the closest face r hits.  Everything but i.obj is filled in.
+    bool intersect( const ray& r, isect& i ) const;
+
     Vertices vertices;
     Normals normals;
     Materials materials;
+
+    // Three vertex indices per face: face f is indices[3f], indices[3f+1]
+    // and indices[3f+2].  Faces have no material of their own; they use
+    // the mesh's, or interpolate the per-vertex materials if there are any.
+    vector<int> indices;
+
+    // Built with the hierarchy: the unit normal of each face, or zero for
+    // a face whose vertices are collinear.
+    Normals faceNormals;
+
+    BVH *bvh;                   // over the faces
+};
+
+// A triangle mesh placed in the scene.  The mesh is a single object to the
+// scene, whatever its number of triangles: the scene's hierarchy holds its
+// transformed bounding box, and the faces inside are found with the
+// geometry's own hierarchy in local coordinates.
+class Trimesh : public MaterialSceneObject
+{
+    shared_ptr<TrimeshGeometry> geometry;
+
 public:
+    // A mesh with geometry of its own, to be filled in with the add
+    // functions below.
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat)
+        : MaterialSceneObject(scene, mat), geometry( new TrimeshGeometry )
     {
-        this->transform = transform;
+        setTransform( transform );
+    }
+
+    // Another copy of the mesh in "other", sharing its geometry.
+    Trimesh( Scene *scene, Material *mat, TransformNode *transform, const Trimesh& other )
+        : MaterialSceneObject(scene, mat), geometry( other.geometry )
+    {
+        setTransform( transform );
     }
 
-    ~Trimesh();
-    
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const vec3f & );
     void addMaterial( Material *m );
@@ -36,47 +105,25 @@ public:
     bool addFace( int a, int b, int c );
 
     char *doubleCheck();
-    
-    void generateNormals();
 
-    Faces faces;
-};
+    void generateNormals() { geometry->generateNormals(); }
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
+    int numFaces() const { return geometry->numFaces(); }
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+    // The vertex data and faces, which other copies may share.
+    TrimeshGeometry& getGeometry() { return *geometry; }
+    const TrimeshGeometry& getGeometry() const { return *geometry; }
 
     virtual bool intersectLocal( const ray& r, isect& i ) const;
+    virtual void resolveMaterial( isect& i ) const;
 
     virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
+    virtual BoundingBox ComputeLocalBoundingBox() { return geometry->bounds(); }
+    virtual void buildAccelerationStructure( BVHBuilder& builder )
     {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
+        geometry->buildAccelerationStructure( builder );
     }
-    
+    virtual double intersectCost() const;
 };
 
-
 #endif // TRIMESH_H__
@@ -0,0 +1,691 @@
+//
+// raybench.cpp
+//
+// Benchmark runner.  Renders every .ray file in the given directories
+// (simpleSamples and bonus by default) at a fixed set of image widths and
+// recursion depths, and reports for each render the wall time, rays per
+// second, the primary/reflected/refracted/shadow ray counts, how many mesh
+// triangles were tested per second, the peak resident set size of the
+// process, and how long building the BVHs took and the SAH cost of the
+// result.  -a picks the BVH builder, as it does for ray.  The BVH cache is
+// off unless -k is given, so that the build times are those of a build.
+// The results go to a CSV or JSON file, and can be checked against a
+// baseline CSV written by an earlier run:
+//
+//   raybench -o baseline.csv                  (once, on the reference build)
+//   raybench -b baseline.csv -o current.csv   (after a change)
+//
+// The second run exits with status 1 if any render got more than the
+// tolerance (-T, in percent) slower than in the baseline.  Only renders
+// made with the same -j and -a as the baseline's are compared.
+//
+// With -p nothing is rendered: each scene is only read, -n times, and the
+// fastest read is reported as parse throughput in MB/s.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <io.h>
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+
+#include "../RayTracer.h"
+#include "../fileio/read.h"
+
+using namespace std;
+
+// ***********************************************************
+// from getopt.cpp
+//
+extern int getopt(int argc, char **argv, char *optstring);
+extern char* optarg;
+extern int optind, opterr, optopt;
+// ***********************************************************
+
+struct BenchResult
+{
+	string	scene;
+	int		width;
+	int		height;
+	int		depth;
+	int		threads;
+	double	loadTime;			// seconds
+	double	renderTime;			// seconds, best of the repeats
+	RayStats stats;
+	long	peakRSS;			// kilobytes
+	AccelerationStats accel;
+	string	builder;			// the -a argument, "sah" or "lbvh"
+
+	BenchResult()
+		: width( 0 ), height( 0 ), depth( 0 ), threads( 0 ), loadTime( 0.0 ),
+		  renderTime( 0.0 ), peakRSS( 0 ) {}
+
+	double raysPerSecond() const
+	{
+		return renderTime > 0.0 ? stats.totalRays() / renderTime : 0.0;
+	}
+
+	double trianglesPerSecond() const
+	{
+		return renderTime > 0.0 ? stats.triangleTests / renderTime : 0.0;
+	}
+
+	string key() const
+	{
+		char buf[64];
+		sprintf( buf, ",%d,%d", width, depth );
+		return scene + buf;
+	}
+};
+
+struct ParseResult
+{
+	string	scene;
+	long	bytes;
+	double	parseTime;			// seconds, best of the repeats
+
+	double megabytesPerSecond() const
+	{
+		return parseTime > 0.0 ? bytes / parseTime / (1024.0 * 1024.0) : 0.0;
+	}
+};
+
+//
+// options from program parameters
+//
+vector<int> g_widths;
+vector<int> g_depths;
+int g_threads = 1;
+int g_repeats = 1;
+BVHBuildMode g_buildMode = BVH_BUILD_SAH;
+bool g_accelCache = false;
+bool g_parseOnly = false;
+double g_tolerance = 10.0;
+char *progname, *outName, *baselineName;
+
+void usage()
+{
+	fprintf( stderr, "usage: %s [options] [scene directories]\n", progname );
+	fprintf( stderr, "  -w <#,#..>  image widths (default 256)\n" );
+	fprintf( stderr, "  -r <#,#..>  recursion depths (default 0,5)\n" );
+	fprintf( stderr, "  -j <#>      number of render threads (default %d)\n", g_threads );
+	fprintf( stderr, "  -n <#>      renders per setting, the fastest is kept (default %d)\n", g_repeats );
+	fprintf( stderr, "  -a sah|lbvh build the BVH with binned SAH (default) or as a linear BVH\n" );
+	fprintf( stderr, "  -k          use the BVH cache next to each scene, as ray does\n" );
+	fprintf( stderr, "  -p          only read the scenes, and report parse throughput\n" );
+	fprintf( stderr, "  -o <file>   write the results, as JSON if the name ends in .json\n" );
+	fprintf( stderr, "  -b <file>   compare against a baseline CSV from an earlier run\n" );
+	fprintf( stderr, "  -T <#>      allowed slowdown against the baseline in percent (default %g)\n", g_tolerance );
+}
+
+// Parse a comma separated list of non-negative integers.
+static bool parseList( const char *s, vector<int>& list )
+{
+	list.clear();
+	while( *s ) {
+		char *end;
+		long v = strtol( s, &end, 10 );
+		if( end == s || v < 0 )
+			return false;
+		list.push_back( (int)v );
+		s = end;
+		if( *s == ',' )
+			++s;
+		else if( *s )
+			return false;
+	}
+	return !list.empty();
+}
+
+bool processArgs(int argc, char **argv) {
+	// getopt() takes a char *, which a string literal can't be passed as
+	static char options[] = "w:r:j:n:o:b:T:a:kp";
+	int i;
+
+	while ( (i = getopt( argc, argv, options )) != EOF )
+	{
+		switch ( i )
+		{
+			case 'w':
+			if ( !parseList( optarg, g_widths ) )
+				return false;
+			break;
+
+			case 'r':
+			if ( !parseList( optarg, g_depths ) )
+				return false;
+			break;
+
+			case 'j':
+			g_threads = atoi( optarg );
+			if ( g_threads < 1 )
+				return false;
+			break;
+
+			case 'n':
+			g_repeats = atoi( optarg );
+			if ( g_repeats < 1 )
+				return false;
+			break;
+
+			case 'a':
+			if ( strcmp( optarg, "sah" ) == 0 )
+				g_buildMode = BVH_BUILD_SAH;
+			else if ( strcmp( optarg, "lbvh" ) == 0 )
+				g_buildMode = BVH_BUILD_LBVH;
+			else
+				return false;
+			break;
+
+			case 'k':
+			g_accelCache = true;
+			break;
+
+			case 'p':
+			g_parseOnly = true;
+			break;
+
+			case 'o':
+			outName = optarg;
+			break;
+
+			case 'b':
+			baselineName = optarg;
+			break;
+
+			case 'T':
+			g_tolerance = atof( optarg );
+			break;
+
+			default:
+			return false;
+		}
+	}
+
+	// parse results have nothing to compare against a render baseline
+	if ( g_parseOnly && baselineName )
+		return false;
+
+	if ( g_widths.empty() )
+		g_widths.push_back( 256 );
+	if ( g_depths.empty() ) {
+		g_depths.push_back( 0 );
+		g_depths.push_back( 5 );
+	}
+
+	return true;
+}
+
+// All the .ray files in dir, sorted by name.
+static vector<string> listScenes( const string& dir )
+{
+	vector<string> names;
+
+#ifdef WIN32
+	struct _finddata_t data;
+	intptr_t handle = _findfirst( (dir + "\\*.ray").c_str(), &data );
+	if( handle != -1 ) {
+		do {
+			names.push_back( data.name );
+		} while( _findnext( handle, &data ) == 0 );
+		_findclose( handle );
+	}
+#else
+	DIR *d = opendir( dir.c_str() );
+	if( d ) {
+		while( struct dirent *e = readdir( d ) ) {
+			const size_t len = strlen( e->d_name );
+			if( len > 4 && strcmp( e->d_name + len - 4, ".ray" ) == 0 )
+				names.push_back( e->d_name );
+		}
+		closedir( d );
+	}
+#endif
+
+	sort( names.begin(), names.end() );
+	for( size_t k = 0; k < names.size(); ++k )
+		names[k] = dir + "/" + names[k];
+	return names;
+}
+
+// The peak resident set size of the process so far, in kilobytes.  It
+// never goes down, so for a render it includes whatever the renders
+// before it needed.
+static long peakRSS()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if( GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) )
+		return (long)(pmc.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	struct rusage usage;
+	if( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static double secondsSince( chrono::steady_clock::time_point start )
+{
+	return chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+}
+
+static const char *CSV_HEADER =
+	"scene,width,height,depth,threads,load_s,render_s,rays_per_s,"
+	"primary_rays,reflected_rays,refracted_rays,shadow_rays,peak_rss_kb,"
+	"triangle_tests,tris_per_s,build_s,sah_cost,builder";
+
+static void writeCSV( FILE *fp, const vector<BenchResult>& results )
+{
+	fprintf( fp, "%s\n", CSV_HEADER );
+	for( size_t k = 0; k < results.size(); ++k ) {
+		const BenchResult& r = results[k];
+		fprintf( fp, "%s,%d,%d,%d,%d,%.6f,%.6f,%.0f,%llu,%llu,%llu,%llu,%ld,%llu,%.0f,%.6f,%.3f,%s\n",
+			r.scene.c_str(), r.width, r.height, r.depth, r.threads,
+			r.loadTime, r.renderTime, r.raysPerSecond(),
+			r.stats.primaryRays, r.stats.reflectedRays, r.stats.refractedRays,
+			r.stats.shadowRays, r.peakRSS, r.stats.triangleTests,
+			r.trianglesPerSecond(), r.accel.buildSeconds, r.accel.sahCost, r.builder.c_str() );
+	}
+}
+
+static void writeJSON( FILE *fp, const vector<BenchResult>& results )
+{
+	fprintf( fp, "[\n" );
+	for( size_t k = 0; k < results.size(); ++k ) {
+		const BenchResult& r = results[k];
+		fprintf( fp, "  { \"scene\": \"%s\", \"width\": %d, \"height\": %d, "
+			"\"depth\": %d, \"threads\": %d, \"load_s\": %.6f, \"render_s\": %.6f, "
+			"\"rays_per_s\": %.0f, \"primary_rays\": %llu, \"reflected_rays\": %llu, "
+			"\"refracted_rays\": %llu, \"shadow_rays\": %llu, \"peak_rss_kb\": %ld, "
+			"\"triangle_tests\": %llu, \"tris_per_s\": %.0f, \"build_s\": %.6f, "
+			"\"sah_cost\": %.3f, \"builder\": \"%s\" }%s\n",
+			r.scene.c_str(), r.width, r.height, r.depth, r.threads,
+			r.loadTime, r.renderTime, r.raysPerSecond(),
+			r.stats.primaryRays, r.stats.reflectedRays, r.stats.refractedRays,
+			r.stats.shadowRays, r.peakRSS, r.stats.triangleTests,
+			r.trianglesPerSecond(), r.accel.buildSeconds, r.accel.sahCost,
+			r.builder.c_str(), k + 1 < results.size() ? "," : "" );
+	}
+	fprintf( fp, "]\n" );
+}
+
+static void writeParseResults( FILE *fp, const vector<ParseResult>& results, bool json )
+{
+	if( json )
+		fprintf( fp, "[\n" );
+	else
+		fprintf( fp, "scene,bytes,parse_s,mb_per_s\n" );
+
+	for( size_t k = 0; k < results.size(); ++k ) {
+		const ParseResult& r = results[k];
+		if( json )
+			fprintf( fp, "  { \"scene\": \"%s\", \"bytes\": %ld, \"parse_s\": %.6f, "
+				"\"mb_per_s\": %.1f }%s\n", r.scene.c_str(), r.bytes, r.parseTime,
+				r.megabytesPerSecond(), k + 1 < results.size() ? "," : "" );
+		else
+			fprintf( fp, "%s,%ld,%.6f,%.1f\n", r.scene.c_str(), r.bytes, r.parseTime,
+				r.megabytesPerSecond() );
+	}
+
+	if( json )
+		fprintf( fp, "]\n" );
+}
+
+// Split a CSV line, without its line break, at its commas.
+static vector<string> splitCSV( const char *line )
+{
+	vector<string> fields;
+	const char *start = line;
+	for( const char *s = line; ; ++s ) {
+		if( *s == ',' || *s == '\0' || *s == '\n' || *s == '\r' ) {
+			fields.push_back( string( start, s ) );
+			if( *s != ',' )
+				break;
+			start = s + 1;
+		}
+	}
+	return fields;
+}
+
+// Set the field of r that the CSV column named column holds.  Columns
+// that are worked out from others, or that this version doesn't know,
+// are skipped.
+static void setBaselineField( BenchResult& r, const string& column, const string& value )
+{
+	const char *v = value.c_str();
+
+	if( column == "scene" )
+		r.scene = value;
+	else if( column == "width" )
+		r.width = atoi( v );
+	else if( column == "height" )
+		r.height = atoi( v );
+	else if( column == "depth" )
+		r.depth = atoi( v );
+	else if( column == "threads" )
+		r.threads = atoi( v );
+	else if( column == "load_s" )
+		r.loadTime = atof( v );
+	else if( column == "render_s" )
+		r.renderTime = atof( v );
+	else if( column == "primary_rays" )
+		r.stats.primaryRays = strtoull( v, NULL, 10 );
+	else if( column == "reflected_rays" )
+		r.stats.reflectedRays = strtoull( v, NULL, 10 );
+	else if( column == "refracted_rays" )
+		r.stats.refractedRays = strtoull( v, NULL, 10 );
+	else if( column == "shadow_rays" )
+		r.stats.shadowRays = strtoull( v, NULL, 10 );
+	else if( column == "peak_rss_kb" )
+		r.peakRSS = atol( v );
+	else if( column == "triangle_tests" )
+		r.stats.triangleTests = strtoull( v, NULL, 10 );
+	else if( column == "build_s" )
+		r.accel.buildSeconds = atof( v );
+	else if( column == "sah_cost" )
+		r.accel.sahCost = atof( v );
+	else if( column == "builder" )
+		r.builder = value;
+}
+
+// Read a CSV written by writeCSV into a map keyed by BenchResult::key().
+// Columns are found by the names in its header, so files written before
+// columns were added can still be read; what they lack is left at zero.
+static bool readBaseline( const char *fn, map<string, BenchResult>& baseline )
+{
+	FILE *fp = fopen( fn, "r" );
+	if( !fp )
+		return false;
+
+	char line[1024];
+	if( !fgets( line, sizeof( line ), fp ) ) {
+		fclose( fp );
+		return false;
+	}
+
+	// every baseline must at least say which render each row is and how
+	// long it took
+	const vector<string> columns = splitCSV( line );
+	static const char *REQUIRED[] = { "scene", "width", "depth", "render_s" };
+	for( size_t k = 0; k < sizeof( REQUIRED ) / sizeof( REQUIRED[0] ); ++k ) {
+		if( find( columns.begin(), columns.end(), REQUIRED[k] ) == columns.end() ) {
+			fclose( fp );
+			return false;
+		}
+	}
+
+	while( fgets( line, sizeof( line ), fp ) ) {
+		const vector<string> fields = splitCSV( line );
+		if( fields.size() < columns.size() )
+			continue;
+
+		BenchResult r;
+		for( size_t k = 0; k < columns.size(); ++k )
+			setBaselineField( r, columns[k], fields[k] );
+		baseline[ r.key() ] = r;
+	}
+
+	fclose( fp );
+	return true;
+}
+
+// Report every render that is slower than its baseline by more than the
+// tolerance, and return how many there were.  Changed ray counts are
+// reported too, since they mean the renders are no longer comparable.
+// Renders the baseline ran with a different number of threads or another
+// BVH builder are not compared at all; baselines from before the builder
+// column was added were all built with SAH.
+static int compareToBaseline( const vector<BenchResult>& results,
+	const map<string, BenchResult>& baseline )
+{
+	int regressions = 0;
+	double current = 0.0, previous = 0.0;
+
+	for( size_t k = 0; k < results.size(); ++k ) {
+		const BenchResult& r = results[k];
+		map<string, BenchResult>::const_iterator b = baseline.find( r.key() );
+		if( b == baseline.end() ) {
+			printf( "%-36s w=%-4d r=%-2d  not in baseline\n", r.scene.c_str(), r.width, r.depth );
+			continue;
+		}
+
+		const string baselineBuilder = b->second.builder.empty() ? "sah" : b->second.builder;
+		if( b->second.threads != r.threads || baselineBuilder != r.builder ) {
+			printf( "%-36s w=%-4d r=%-2d  not comparable, baseline ran with -j %d -a %s\n",
+				r.scene.c_str(), r.width, r.depth, b->second.threads, baselineBuilder.c_str() );
+			continue;
+		}
+
+		const double change = b->second.renderTime > 0.0 ?
+			100.0 * (r.renderTime - b->second.renderTime) / b->second.renderTime : 0.0;
+		const bool slower = change > g_tolerance;
+		if( slower )
+			++regressions;
+
+		current += r.renderTime;
+		previous += b->second.renderTime;
+
+		printf( "%-36s w=%-4d r=%-2d  %8.3fs -> %8.3fs  %+6.1f%%%s%s\n",
+			r.scene.c_str(), r.width, r.depth, b->second.renderTime, r.renderTime,
+			change, slower ? "  SLOWER" : "",
+			r.stats.totalRays() != b->second.stats.totalRays() ? "  (ray counts differ)" : "" );
+	}
+
+	if( previous > 0.0 )
+		printf( "total %8.3fs -> %8.3fs  %+6.1f%%\n", previous, current,
+			100.0 * (current - previous) / previous );
+
+	return regressions;
+}
+
+static long fileSize( const string& fn )
+{
+	FILE *fp = fopen( fn.c_str(), "rb" );
+	if( !fp )
+		return 0;
+	fseek( fp, 0, SEEK_END );
+	const long size = ftell( fp );
+	fclose( fp );
+	return size;
+}
+
+// Read every scene, without building its BVHs or rendering it.
+static vector<ParseResult> parseScenes( const vector<string>& dirs )
+{
+	vector<ParseResult> results;
+
+	for( size_t d = 0; d < dirs.size(); ++d ) {
+		const vector<string> scenes = listScenes( dirs[d] );
+		if( scenes.empty() )
+			fprintf( stderr, "no scenes in %s\n", dirs[d].c_str() );
+
+		for( size_t s = 0; s < scenes.size(); ++s ) {
+			ParseResult result;
+			result.scene = scenes[s];
+			result.bytes = fileSize( scenes[s] );
+			result.parseTime = 0.0;
+
+			bool loaded = true;
+			for( int n = 0; n < g_repeats && loaded; ++n ) {
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				Scene *scene = readScene( scenes[s] );
+				const double t = secondsSince( start );
+
+				loaded = scene != NULL;
+				delete scene;
+
+				if( n == 0 || t < result.parseTime )
+					result.parseTime = t;
+			}
+
+			if( !loaded ) {
+				fprintf( stderr, "%s: skipped\n", scenes[s].c_str() );
+				continue;
+			}
+
+			results.push_back( result );
+			printf( "%-36s %10ld bytes %8.4fs %8.1f MB/s\n", result.scene.c_str(),
+				result.bytes, result.parseTime, result.megabytesPerSecond() );
+			fflush( stdout );
+		}
+	}
+
+	return results;
+}
+
+int main(int argc, char **argv)
+{
+	progname = argv[0];
+
+	if ( !processArgs( argc, argv ) ) {
+		usage();
+		return 1;
+	}
+
+	vector<string> dirs;
+	for( int k = optind; k < argc; ++k )
+		dirs.push_back( argv[k] );
+	if( dirs.empty() ) {
+		dirs.push_back( "simpleSamples" );
+		dirs.push_back( "bonus" );
+	}
+
+	if( g_parseOnly ) {
+		const vector<ParseResult> results = parseScenes( dirs );
+
+		if( outName ) {
+			FILE *fp = fopen( outName, "w" );
+			if( !fp ) {
+				fprintf( stderr, "can't write %s\n", outName );
+				return 1;
+			}
+
+			const size_t len = strlen( outName );
+			writeParseResults( fp, results, len > 5 && strcmp( outName + len - 5, ".json" ) == 0 );
+			fclose( fp );
+		}
+		return 0;
+	}
+
+	vector<BenchResult> results;
+
+	for( size_t d = 0; d < dirs.size(); ++d ) {
+		const vector<string> scenes = listScenes( dirs[d] );
+		if( scenes.empty() )
+			fprintf( stderr, "no scenes in %s\n", dirs[d].c_str() );
+
+		for( size_t s = 0; s < scenes.size(); ++s ) {
+			RayTracer tracer;
+			tracer.setBuildMode( g_buildMode );
+			tracer.setAccelCache( g_accelCache );
+
+			vector<char> fn( scenes[s].begin(), scenes[s].end() );
+			fn.push_back( '\0' );
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			tracer.loadScene( &fn[0] );
+			const double loadTime = secondsSince( start );
+
+			if( !tracer.sceneLoaded() ) {
+				fprintf( stderr, "%s: skipped, %s\n", scenes[s].c_str(),
+					tracer.getLoadError().c_str() );
+				continue;
+			}
+
+			for( size_t w = 0; w < g_widths.size(); ++w ) {
+				for( size_t r = 0; r < g_depths.size(); ++r ) {
+					BenchResult result;
+					result.scene = scenes[s];
+					result.width = g_widths[w];
+					result.height = (int)(result.width / tracer.aspectRatio() + 0.5);
+					result.depth = g_depths[r];
+					result.threads = g_threads;
+					result.builder = g_buildMode == BVH_BUILD_LBVH ? "lbvh" : "sah";
+					result.loadTime = loadTime;
+					result.renderTime = 0.0;
+
+					RenderSettings settings;
+					settings.depth = result.depth;
+
+					for( int n = 0; n < g_repeats; ++n ) {
+						tracer.traceSetup( result.width, result.height, settings );
+
+						start = chrono::steady_clock::now();
+						tracer.traceTiles( g_threads );
+						const double t = secondsSince( start );
+
+						if( n == 0 || t < result.renderTime )
+							result.renderTime = t;
+					}
+
+					result.stats = tracer.getStats();
+					result.peakRSS = peakRSS();
+					result.accel = tracer.getScene()->getAccelerationStats();
+					results.push_back( result );
+
+					printf( "%-36s %4dx%-4d r=%-2d %8.3fs %12.0f rays/s  %llu/%llu/%llu rays  %ld KB",
+						result.scene.c_str(), result.width, result.height, result.depth,
+						result.renderTime, result.raysPerSecond(),
+						result.stats.primaryRays, result.stats.secondaryRays(),
+						result.stats.shadowRays, result.peakRSS );
+					if( result.stats.triangleTests )
+						printf( "  %.0f tris/s", result.trianglesPerSecond() );
+					printf( "  build %.3fs sah %.1f", result.accel.buildSeconds, result.accel.sahCost );
+					printf( "\n" );
+					fflush( stdout );
+				}
+			}
+		}
+	}
+
+	if( outName ) {
+		FILE *fp = fopen( outName, "w" );
+		if( !fp ) {
+			fprintf( stderr, "can't write %s\n", outName );
+			return 1;
+		}
+
+		const size_t len = strlen( outName );
+		if( len > 5 && strcmp( outName + len - 5, ".json" ) == 0 )
+			writeJSON( fp, results );
+		else
+			writeCSV( fp, results );
+		fclose( fp );
+	}
+
+	if( baselineName ) {
+		map<string, BenchResult> baseline;
+		if( !readBaseline( baselineName, baseline ) ) {
+			fprintf( stderr, "can't read baseline %s\n", baselineName );
+			return 1;
+		}
+
+		printf( "\ncompared to %s (tolerance %g%%):\n", baselineName, g_tolerance );
+		const int regressions = compareToBaseline( results, baseline );
+		if( regressions > 0 ) {
+			printf( "%d render(s) slower than the baseline\n", regressions );
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,814 @@
+#ifdef WIN32
+#pragma warning( disable : 4786 )
+#endif
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "compiled.h"
+#include "mappedfile.h"
+#include "parse.h"
+
+#include "../scene/light.h"
+#include "../SceneObjects/trimesh.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/CSG.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Heightfield.h"
+#include "../SceneObjects/Metaball.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/Torus.h"
+
+// Bump whenever the layout of the file changes.
+static const unsigned int COMPILED_SCENE_VERSION = 4;
+
+static const char COMPILED_SCENE_MAGIC[8] = { 'S', 'B', 'T', '-', 'R', 'A', 'Y', 'B' };
+
+// The file is a SceneHeader followed by the tables it points to, each
+// starting on an 8 byte boundary.  Everything is stored as it is in
+// memory, doubles included, so a compiled scene renders bit for bit like
+// its source.
+struct SceneHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int numMaterials;
+	unsigned int numTransforms;
+	unsigned int numMeshes;
+	unsigned int numObjects;
+	unsigned int numLights;
+	unsigned int numFields;
+	unsigned int numMetaballs;
+
+	double eye[3];
+	double rotation[9];
+	double normalizedHeight;
+	double aspectRatio;
+
+	unsigned long long materialOffset;
+	unsigned long long transformOffset;
+	unsigned long long meshOffset;
+	unsigned long long objectOffset;
+	unsigned long long lightOffset;
+	unsigned long long fieldOffset;
+	unsigned long long metaballOffset;
+};
+
+struct CompiledMaterial
+{
+	double ke[3], ka[3], ks[3], kd[3], kr[3], kt[3];
+	double shininess;
+	double index;
+};
+
+struct CompiledTransform
+{
+	double m[16];
+};
+
+// A mesh's arrays: three doubles per vertex and per normal, one material
+// index per vertex and three vertex indices per face.
+struct CompiledMesh
+{
+	unsigned int numVertices;
+	unsigned int numNormals;
+	unsigned int numMaterials;
+	unsigned int numIndices;
+	unsigned long long vertexOffset;
+	unsigned long long normalOffset;
+	unsigned long long materialOffset;
+	unsigned long long indexOffset;
+};
+
+// A height field's size and samples: width * depth floats, row by row.
+struct CompiledField
+{
+	unsigned int width;
+	unsigned int depth;
+	double sizeX, sizeZ;
+	unsigned long long heightOffset;
+};
+
+// Metaballs: four doubles (center and radius) per ball.
+struct CompiledMetaball
+{
+	unsigned int gridSize;
+	unsigned int numBalls;
+	double size;
+	unsigned long long ballOffset;
+};
+
+enum CompiledObjectType
+{
+	OBJECT_SPHERE,
+	OBJECT_BOX,
+	OBJECT_SQUARE,
+	OBJECT_CYLINDER,
+	OBJECT_CONE,
+	OBJECT_TORUS,
+	OBJECT_TRIMESH,
+	OBJECT_DIFFERENCE,
+	OBJECT_HEIGHTFIELD,
+	OBJECT_METABALL,
+	OBJECT_UNION,
+	OBJECT_INTERSECTION
+};
+
+// One object.  mesh is used by trimeshes, height fields and metaballs (as
+// an index into the table of each), a and b (object indices) by CSG
+// nodes, and params by the primitives that take numbers.  The operands of
+// a CSG node are not in the scene themselves, and come after it.
+struct CompiledObject
+{
+	int type;
+	int material;
+	int transform;
+	int inScene;
+	int mesh;
+	int a, b;
+	int capped;
+	double params[3];
+};
+
+enum CompiledLightType
+{
+	LIGHT_DIRECTIONAL,
+	LIGHT_POINT,
+	LIGHT_AMBIENT,
+	LIGHT_SPOT,
+	LIGHT_WARN
+};
+
+struct CompiledLight
+{
+	int type;
+	int shape;					// WarnLight::Type
+	double color[3];
+	double position[3];
+	double direction[3];		// the orientation or the spot/shape axis
+	double attenuation[3];		// constant, linear, quadratic
+	double coneAngle;
+};
+
+static void putVec( double *dst, const vec3f& v )
+{
+	dst[0] = v[0];
+	dst[1] = v[1];
+	dst[2] = v[2];
+}
+
+static vec3f getVec( const double *src )
+{
+	return vec3f( src[0], src[1], src[2] );
+}
+
+static void putMatrix( double *dst, const mat3f& m )
+{
+	for( int row = 0; row < 3; ++row )
+		putVec( &dst[ row * 3 ], m[row] );
+}
+
+bool isCompiledScene( const string& filename )
+{
+	ifstream ifs( filename.c_str(), ios::binary );
+	char magic[8];
+	return ifs.read( magic, sizeof( magic ) ) &&
+		memcmp( magic, COMPILED_SCENE_MAGIC, sizeof( magic ) ) == 0;
+}
+
+//
+// Writing
+//
+
+// Gathers the tables of a scene, numbering materials, transforms and
+// meshes the first time an object uses them.
+class SceneCompiler
+{
+public:
+	SceneCompiler( const Scene *scene );
+
+	vector<CompiledMaterial> materials;
+	vector<CompiledTransform> transforms;
+	vector<const TrimeshGeometry *> meshes;
+	vector<const Heightfield *> fields;
+	vector<const Metaball *> metaballs;
+	vector<CompiledObject> objects;
+	vector<CompiledLight> lights;
+
+	// The number of a material some object or mesh uses.
+	int materialId( const Material *m ) const { return materialIds.find( m )->second; }
+
+private:
+	int addObject( Geometry *g, bool inScene );
+	int materialIndex( const Material *m );
+	int transformIndex( const TransformNode *t );
+
+	vector<Geometry *> sources;		// what each of objects was made from
+	map<const Geometry *, int> objectIds;
+	map<const Material *, int> materialIds;
+	map<const TransformNode *, int> transformIds;
+	map<const TrimeshGeometry *, int> meshIds;
+};
+
+SceneCompiler::SceneCompiler( const Scene *scene )
+{
+	for( Scene::cgiter g = scene->beginObjects(); g != scene->endObjects(); ++g )
+		addObject( *g, true );
+
+	// the operands of CSG nodes, which are not in the scene; objects
+	// grows as they are found
+	for( size_t k = 0; k < objects.size(); ++k ) {
+		if( const CSGNode *node = dynamic_cast<const CSGNode *>( sources[k] ) ) {
+			const int a = addObject( node->getA(), false );
+			const int b = addObject( node->getB(), false );
+			objects[k].a = a;
+			objects[k].b = b;
+		}
+	}
+
+	for( Scene::cliter l = scene->beginLights(); l != scene->endLights(); ++l ) {
+		CompiledLight c;
+		memset( &c, 0, sizeof( c ) );
+		putVec( c.color, (*l)->getColor( vec3f() ) );
+
+		if( const DirectionalLight *d = dynamic_cast<const DirectionalLight *>( *l ) ) {
+			c.type = LIGHT_DIRECTIONAL;
+			putVec( c.direction, d->getOrientation() );
+		} else if( const WarnLight *w = dynamic_cast<const WarnLight *>( *l ) ) {
+			c.type = LIGHT_WARN;
+			c.shape = (int)w->getShape();
+			putVec( c.position, w->getPosition() );
+			putVec( c.direction, w->getAxis() );
+			w->getAttenuation( c.attenuation[0], c.attenuation[1], c.attenuation[2] );
+		} else if( const PointLight *p = dynamic_cast<const PointLight *>( *l ) ) {
+			c.type = LIGHT_POINT;
+			putVec( c.position, p->getPosition() );
+			p->getAttenuation( c.attenuation[0], c.attenuation[1], c.attenuation[2] );
+		} else if( dynamic_cast<const AmbientLight *>( *l ) ) {
+			c.type = LIGHT_AMBIENT;
+		} else if( const SpotLight *s = dynamic_cast<const SpotLight *>( *l ) ) {
+			c.type = LIGHT_SPOT;
+			putVec( c.position, s->getPosition() );
+			putVec( c.direction, s->getAxis() );
+			s->getAttenuation( c.attenuation[0], c.attenuation[1], c.attenuation[2] );
+			c.coneAngle = s->getConeAngle();
+		} else {
+			throw ParseError( "Can't compile a scene with this kind of light." );
+		}
+
+		lights.push_back( c );
+	}
+}
+
+int SceneCompiler::addObject( Geometry *g, bool inScene )
+{
+	map<const Geometry *, int>::const_iterator found = objectIds.find( g );
+	if( found != objectIds.end() )
+		return found->second;
+
+	CompiledObject c;
+	memset( &c, 0, sizeof( c ) );
+	c.material = -1;
+	c.mesh = c.a = c.b = -1;
+	c.inScene = inScene;
+	c.transform = transformIndex( g->getTransform() );
+
+	if( const CSGNode *node = dynamic_cast<CSGNode *>( g ) ) {
+		switch( node->getOperation() ) {
+		case CSG_UNION:
+			c.type = OBJECT_UNION;
+			break;
+		case CSG_INTERSECTION:
+			c.type = OBJECT_INTERSECTION;
+			break;
+		default:
+			c.type = OBJECT_DIFFERENCE;
+			break;
+		}
+	} else {
+		const SceneObject *obj = dynamic_cast<SceneObject *>( g );
+		if( !obj )
+			throw ParseError( "Can't compile a scene with this kind of object." );
+		c.material = materialIndex( &obj->getMaterial() );
+
+		if( dynamic_cast<Sphere *>( g ) ) {
+			c.type = OBJECT_SPHERE;
+		} else if( dynamic_cast<Box *>( g ) ) {
+			c.type = OBJECT_BOX;
+		} else if( dynamic_cast<Square *>( g ) ) {
+			c.type = OBJECT_SQUARE;
+		} else if( const Cylinder *cyl = dynamic_cast<Cylinder *>( g ) ) {
+			c.type = OBJECT_CYLINDER;
+			c.capped = cyl->isCapped();
+		} else if( const Cone *cone = dynamic_cast<Cone *>( g ) ) {
+			c.type = OBJECT_CONE;
+			c.params[0] = cone->getHeight();
+			c.params[1] = cone->getBottomRadius();
+			c.params[2] = cone->getTopRadius();
+			c.capped = cone->isCapped();
+		} else if( const Torus *torus = dynamic_cast<Torus *>( g ) ) {
+			c.type = OBJECT_TORUS;
+			c.params[0] = torus->getA();
+			c.params[1] = torus->getB();
+		} else if( const Trimesh *mesh = dynamic_cast<Trimesh *>( g ) ) {
+			c.type = OBJECT_TRIMESH;
+			const TrimeshGeometry *geometry = &mesh->getGeometry();
+			map<const TrimeshGeometry *, int>::const_iterator i = meshIds.find( geometry );
+			if( i == meshIds.end() ) {
+				c.mesh = meshes.size();
+				meshIds[ geometry ] = c.mesh;
+				meshes.push_back( geometry );
+				for( size_t k = 0; k < geometry->materials.size(); ++k )
+					materialIndex( geometry->materials[k] );
+			} else {
+				c.mesh = i->second;
+			}
+		} else if( const Heightfield *field = dynamic_cast<Heightfield *>( g ) ) {
+			c.type = OBJECT_HEIGHTFIELD;
+			c.mesh = fields.size();
+			fields.push_back( field );
+		} else if( const Metaball *metaball = dynamic_cast<Metaball *>( g ) ) {
+			c.type = OBJECT_METABALL;
+			c.mesh = metaballs.size();
+			metaballs.push_back( metaball );
+		} else {
+			throw ParseError( "Can't compile a scene with this kind of object." );
+		}
+	}
+
+	const int id = objects.size();
+	objectIds[ g ] = id;
+	objects.push_back( c );
+	sources.push_back( g );
+	return id;
+}
+
+int SceneCompiler::materialIndex( const Material *m )
+{
+	map<const Material *, int>::const_iterator i = materialIds.find( m );
+	if( i != materialIds.end() )
+		return i->second;
+
+	CompiledMaterial c;
+	putVec( c.ke, m->ke );
+	putVec( c.ka, m->ka );
+	putVec( c.ks, m->ks );
+	putVec( c.kd, m->kd );
+	putVec( c.kr, m->kr );
+	putVec( c.kt, m->kt );
+	c.shininess = m->shininess;
+	c.index = m->index;
+
+	const int id = materials.size();
+	materialIds[ m ] = id;
+	materials.push_back( c );
+	return id;
+}
+
+int SceneCompiler::transformIndex( const TransformNode *t )
+{
+	if( !t )
+		return -1;
+
+	map<const TransformNode *, int>::const_iterator i = transformIds.find( t );
+	if( i != transformIds.end() )
+		return i->second;
+
+	CompiledTransform c;
+	const mat4f& m = t->getMatrix();
+	for( int row = 0; row < 4; ++row ) {
+		for( int col = 0; col < 4; ++col )
+			c.m[ row * 4 + col ] = m[row][col];
+	}
+
+	const int id = transforms.size();
+	transformIds[ t ] = id;
+	transforms.push_back( c );
+	return id;
+}
+
+// Write n elements of v, which may be empty.
+template <class T>
+static void writeArray( ostream& out, const T *v, size_t n )
+{
+	if( n )
+		out.write( (const char *)v, n * sizeof( T ) );
+}
+
+static void writeVecs( ostream& out, const vector<vec3f>& v )
+{
+	for( size_t k = 0; k < v.size(); ++k ) {
+		double d[3];
+		putVec( d, v[k] );
+		out.write( (const char *)d, sizeof( d ) );
+	}
+}
+
+bool writeCompiledScene( const Scene *scene, const string& filename )
+{
+	const SceneCompiler compiler( scene );
+
+	SceneHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, COMPILED_SCENE_MAGIC, sizeof( header.magic ) );
+	header.version = COMPILED_SCENE_VERSION;
+	header.numMaterials = compiler.materials.size();
+	header.numTransforms = compiler.transforms.size();
+	header.numMeshes = compiler.meshes.size();
+	header.numObjects = compiler.objects.size();
+	header.numLights = compiler.lights.size();
+	header.numFields = compiler.fields.size();
+	header.numMetaballs = compiler.metaballs.size();
+
+	vec3f eye;
+	mat3f rotation;
+	scene->getCamera()->getView( eye, rotation, header.normalizedHeight, header.aspectRatio );
+	putVec( header.eye, eye );
+	putMatrix( header.rotation, rotation );
+
+	// Lay the tables out one after the other.  Every element is a multiple
+	// of 8 bytes except the ints that end each mesh, which are padded.
+	unsigned long long offset = sizeof( SceneHeader );
+	header.materialOffset = offset;
+	offset += header.numMaterials * sizeof( CompiledMaterial );
+	header.transformOffset = offset;
+	offset += header.numTransforms * sizeof( CompiledTransform );
+	header.objectOffset = offset;
+	offset += header.numObjects * sizeof( CompiledObject );
+	header.lightOffset = offset;
+	offset += header.numLights * sizeof( CompiledLight );
+	header.meshOffset = offset;
+	offset += header.numMeshes * sizeof( CompiledMesh );
+	header.fieldOffset = offset;
+	offset += header.numFields * sizeof( CompiledField );
+	header.metaballOffset = offset;
+	offset += header.numMetaballs * sizeof( CompiledMetaball );
+
+	vector<CompiledMesh> meshes( compiler.meshes.size() );
+	for( size_t k = 0; k < compiler.meshes.size(); ++k ) {
+		const TrimeshGeometry& g = *compiler.meshes[k];
+		CompiledMesh& m = meshes[k];
+		m.numVertices = g.vertices.size();
+		m.numNormals = g.normals.size();
+		m.numMaterials = g.materials.size();
+		m.numIndices = g.indices.size();
+
+		m.vertexOffset = offset;
+		offset += m.numVertices * 3 * sizeof( double );
+		m.normalOffset = offset;
+		offset += m.numNormals * 3 * sizeof( double );
+		m.materialOffset = offset;
+		offset += m.numMaterials * sizeof( int );
+		m.indexOffset = offset;
+		offset += m.numIndices * sizeof( int );
+		offset = (offset + 7) & ~7ull;
+	}
+
+	vector<CompiledField> fields( compiler.fields.size() );
+	for( size_t k = 0; k < compiler.fields.size(); ++k ) {
+		CompiledField& f = fields[k];
+		f.width = compiler.fields[k]->getWidth();
+		f.depth = compiler.fields[k]->getDepth();
+		f.sizeX = compiler.fields[k]->getSizeX();
+		f.sizeZ = compiler.fields[k]->getSizeZ();
+		f.heightOffset = offset;
+		offset += (unsigned long long)f.width * f.depth * sizeof( float );
+		offset = (offset + 7) & ~7ull;
+	}
+
+	vector<CompiledMetaball> metaballs( compiler.metaballs.size() );
+	for( size_t k = 0; k < compiler.metaballs.size(); ++k ) {
+		CompiledMetaball& m = metaballs[k];
+		m.gridSize = compiler.metaballs[k]->getGridSize();
+		m.numBalls = compiler.metaballs[k]->getBalls().size();
+		m.size = compiler.metaballs[k]->getSize();
+		m.ballOffset = offset;
+		offset += m.numBalls * 4 * sizeof( double );
+	}
+
+	ofstream out( filename.c_str(), ios::binary | ios::trunc );
+	if( !out )
+		return false;
+
+	out.write( (const char *)&header, sizeof( header ) );
+	writeArray( out, compiler.materials.empty() ? NULL : &compiler.materials[0], compiler.materials.size() );
+	writeArray( out, compiler.transforms.empty() ? NULL : &compiler.transforms[0], compiler.transforms.size() );
+	writeArray( out, compiler.objects.empty() ? NULL : &compiler.objects[0], compiler.objects.size() );
+	writeArray( out, compiler.lights.empty() ? NULL : &compiler.lights[0], compiler.lights.size() );
+	writeArray( out, meshes.empty() ? NULL : &meshes[0], meshes.size() );
+	writeArray( out, fields.empty() ? NULL : &fields[0], fields.size() );
+	writeArray( out, metaballs.empty() ? NULL : &metaballs[0], metaballs.size() );
+
+	static const char padding[8] = { 0 };
+
+	for( size_t k = 0; k < compiler.meshes.size(); ++k ) {
+		const TrimeshGeometry& g = *compiler.meshes[k];
+		writeVecs( out, g.vertices );
+		writeVecs( out, g.normals );
+		for( size_t j = 0; j < g.materials.size(); ++j ) {
+			const int id = compiler.materialId( g.materials[j] );
+			out.write( (const char *)&id, sizeof( id ) );
+		}
+		writeArray( out, g.indices.empty() ? NULL : &g.indices[0], g.indices.size() );
+
+		const unsigned long long end = meshes[k].indexOffset + meshes[k].numIndices * sizeof( int );
+		out.write( padding, ((end + 7) & ~7ull) - end );
+	}
+
+	for( size_t k = 0; k < compiler.fields.size(); ++k ) {
+		const vector<float>& heights = compiler.fields[k]->getHeights();
+		writeArray( out, &heights[0], heights.size() );
+
+		const unsigned long long end = fields[k].heightOffset + heights.size() * sizeof( float );
+		out.write( padding, ((end + 7) & ~7ull) - end );
+	}
+
+	for( size_t k = 0; k < compiler.metaballs.size(); ++k ) {
+		const vector<Metaball::Ball>& balls = compiler.metaballs[k]->getBalls();
+		for( size_t j = 0; j < balls.size(); ++j ) {
+			double d[4];
+			putVec( d, balls[j].center );
+			d[3] = balls[j].radius;
+			out.write( (const char *)d, sizeof( d ) );
+		}
+	}
+
+	return !!out;
+}
+
+//
+// Reading
+//
+
+// The tables of a mapped compiled scene, checked to lie inside the file.
+class CompiledScene
+{
+public:
+	CompiledScene( const string& filename );
+
+	// A table of n T's at offset, or a ParseError if it doesn't fit.
+	template <class T>
+	const T *table( unsigned long long offset, unsigned long long n ) const
+	{
+		if( offset % alignof( T ) != 0 )
+			throw ParseError( "Bad compiled scene: misaligned table." );
+		if( offset > file.size() || n > (file.size() - offset) / sizeof( T ) )
+			throw ParseError( "Bad compiled scene: truncated." );
+		return (const T *)(file.data() + offset);
+	}
+
+	const SceneHeader *header;
+
+private:
+	MappedFile file;
+};
+
+CompiledScene::CompiledScene( const string& filename )
+{
+	if( !file.open( filename.c_str() ) || file.size() < sizeof( SceneHeader ) ||
+		memcmp( file.data(), COMPILED_SCENE_MAGIC, sizeof( COMPILED_SCENE_MAGIC ) ) != 0 )
+		throw ParseError( string( "Not a compiled scene: " ) + filename );
+
+	header = (const SceneHeader *)file.data();
+	if( header->version != COMPILED_SCENE_VERSION )
+		throw ParseError( string( "Compiled scene is out of date, compile it again: " ) + filename );
+}
+
+static void checkIndex( int k, unsigned int n, const char *what )
+{
+	if( k < 0 || (unsigned int)k >= n )
+		throw ParseError( string( "Bad compiled scene: bad " ) + what + " index." );
+}
+
+static bool isCSG( const CompiledObject& c )
+{
+	return c.type == OBJECT_DIFFERENCE || c.type == OBJECT_UNION || c.type == OBJECT_INTERSECTION;
+}
+
+// Make object k, and the operands of a CSG node before it.  The objects
+// are kept in "made" so that each is only made once.
+static Geometry *makeObject( Scene *scene, int k, const CompiledObject *objects,
+	const vector<Material *>& materials, const vector<TransformNode *>& transforms,
+	const CompiledScene& file, vector<Geometry *>& made, vector<Trimesh *>& meshes, int depth )
+{
+	if( made[k] )
+		return made[k];
+	if( depth > (int)made.size() )
+		throw ParseError( "Bad compiled scene: CSG nodes form a loop." );
+
+	const CompiledObject& c = objects[k];
+	checkIndex( c.transform, transforms.size(), "transform" );
+	TransformNode *transform = transforms[ c.transform ];
+
+	Material *mat = NULL;
+	if( !isCSG( c ) ) {
+		checkIndex( c.material, materials.size(), "material" );
+		mat = materials[ c.material ];
+	}
+
+	Geometry *g = NULL;
+	switch( c.type ) {
+	case OBJECT_SPHERE:
+		g = new Sphere( scene, mat );
+		break;
+	case OBJECT_BOX:
+		g = new Box( scene, mat );
+		break;
+	case OBJECT_SQUARE:
+		g = new Square( scene, mat );
+		break;
+	case OBJECT_CYLINDER:
+		g = new Cylinder( scene, mat, c.capped != 0 );
+		break;
+	case OBJECT_CONE:
+		g = new Cone( scene, mat, c.params[0], c.params[1], c.params[2], c.capped != 0 );
+		break;
+	case OBJECT_TORUS:
+		g = new Torus( scene, mat, c.params[0], c.params[1] );
+		break;
+
+	case OBJECT_TRIMESH: {
+		checkIndex( c.mesh, meshes.size(), "mesh" );
+		if( meshes[ c.mesh ] ) {
+			g = new Trimesh( scene, mat, transform, *meshes[ c.mesh ] );
+			break;
+		}
+
+		// the first user of a mesh fills it in, straight from the file
+		Trimesh *mesh = new Trimesh( scene, mat, transform );
+		TrimeshGeometry& geometry = mesh->getGeometry();
+		const CompiledMesh& m = file.table<CompiledMesh>( file.header->meshOffset, file.header->numMeshes )[ c.mesh ];
+
+		const double *v = file.table<double>( m.vertexOffset, 3ull * m.numVertices );
+		geometry.vertices.reserve( m.numVertices );
+		for( unsigned int j = 0; j < m.numVertices; ++j )
+			geometry.vertices.push_back( getVec( &v[ 3 * j ] ) );
+
+		const double *n = file.table<double>( m.normalOffset, 3ull * m.numNormals );
+		geometry.normals.reserve( m.numNormals );
+		for( unsigned int j = 0; j < m.numNormals; ++j )
+			geometry.normals.push_back( getVec( &n[ 3 * j ] ) );
+
+		const int *mats = file.table<int>( m.materialOffset, m.numMaterials );
+		geometry.materials.reserve( m.numMaterials );
+		for( unsigned int j = 0; j < m.numMaterials; ++j ) {
+			checkIndex( mats[j], materials.size(), "material" );
+			geometry.materials.push_back( materials[ mats[j] ] );
+		}
+
+		const int *ids = file.table<int>( m.indexOffset, m.numIndices );
+		if( m.numIndices % 3 != 0 )
+			throw ParseError( "Bad compiled scene: bad face." );
+		for( unsigned int j = 0; j < m.numIndices; ++j )
+			checkIndex( ids[j], m.numVertices, "vertex" );
+		geometry.indices.assign( ids, ids + m.numIndices );
+
+		char *error;
+		if( (error = mesh->doubleCheck()) )
+			throw ParseError( error );
+
+		meshes[ c.mesh ] = mesh;
+		g = mesh;
+		break;
+	}
+
+	case OBJECT_HEIGHTFIELD: {
+		checkIndex( c.mesh, file.header->numFields, "height field" );
+		const CompiledField& f = file.table<CompiledField>( file.header->fieldOffset, file.header->numFields )[ c.mesh ];
+		if( f.width < 2 || f.depth < 2 )
+			throw ParseError( "Bad compiled scene: bad height field." );
+		const float *h = file.table<float>( f.heightOffset, (unsigned long long)f.width * f.depth );
+		vector<float> heights( h, h + (size_t)f.width * f.depth );
+		g = new Heightfield( scene, mat, f.width, f.depth, heights, f.sizeX, f.sizeZ );
+		break;
+	}
+
+	case OBJECT_METABALL: {
+		checkIndex( c.mesh, file.header->numMetaballs, "metaball" );
+		const CompiledMetaball& m = file.table<CompiledMetaball>( file.header->metaballOffset, file.header->numMetaballs )[ c.mesh ];
+		if( m.gridSize < 1 || m.gridSize > 256 || m.numBalls == 0 )
+			throw ParseError( "Bad compiled scene: bad metaball." );
+		const double *d = file.table<double>( m.ballOffset, 4ull * m.numBalls );
+		vector<Metaball::Ball> balls( m.numBalls );
+		for( unsigned int j = 0; j < m.numBalls; ++j ) {
+			balls[j].center = getVec( &d[ 4 * j ] );
+			balls[j].radius = d[ 4 * j + 3 ];
+			if( !(balls[j].radius > 0) )
+				throw ParseError( "Bad compiled scene: bad metaball." );
+		}
+		g = new Metaball( scene, mat, balls, m.gridSize, m.size );
+		break;
+	}
+
+	case OBJECT_DIFFERENCE:
+	case OBJECT_UNION:
+	case OBJECT_INTERSECTION: {
+		// a node owns its operands, so they can be neither in the scene
+		// nor part of another node
+		SceneObject *operands[2];
+		const int ids[2] = { c.a, c.b };
+		for( int n = 0; n < 2; ++n ) {
+			checkIndex( ids[n], made.size(), "object" );
+			if( made[ ids[n] ] || objects[ ids[n] ].inScene )
+				throw ParseError( "Bad compiled scene: a CSG operand is used twice." );
+			operands[n] = dynamic_cast<SceneObject *>( makeObject( scene, ids[n], objects, materials,
+				transforms, file, made, meshes, depth + 1 ) );
+		}
+
+		const CSGOperation op = c.type == OBJECT_UNION ? CSG_UNION :
+			c.type == OBJECT_INTERSECTION ? CSG_INTERSECTION : CSG_DIFFERENCE;
+		g = new CSGNode( scene, op, operands[0], operands[1] );
+		break;
+	}
+
+	default:
+		throw ParseError( "Bad compiled scene: unknown object." );
+	}
+
+	g->setTransform( transform );
+	made[k] = g;
+	return g;
+}
+
+Scene *readCompiledScene( const string& filename )
+{
+	const CompiledScene file( filename );
+	const SceneHeader& h = *file.header;
+
+	const CompiledMaterial *cmats = file.table<CompiledMaterial>( h.materialOffset, h.numMaterials );
+	const CompiledTransform *ctrans = file.table<CompiledTransform>( h.transformOffset, h.numTransforms );
+	const CompiledObject *cobjs = file.table<CompiledObject>( h.objectOffset, h.numObjects );
+	const CompiledLight *clights = file.table<CompiledLight>( h.lightOffset, h.numLights );
+
+	Scene *scene = new Scene;
+	try {
+		scene->getCamera()->setView( getVec( h.eye ),
+			mat3f( getVec( &h.rotation[0] ), getVec( &h.rotation[3] ), getVec( &h.rotation[6] ) ),
+			h.normalizedHeight, h.aspectRatio );
+
+		vector<Material *> materials( h.numMaterials );
+		for( unsigned int k = 0; k < h.numMaterials; ++k ) {
+			const CompiledMaterial& c = cmats[k];
+			materials[k] = new Material( getVec( c.ke ), getVec( c.ka ), getVec( c.ks ),
+				getVec( c.kd ), getVec( c.kr ), getVec( c.kt ), c.shininess, c.index );
+		}
+
+		vector<TransformNode *> transforms( h.numTransforms );
+		for( unsigned int k = 0; k < h.numTransforms; ++k ) {
+			const double *m = ctrans[k].m;
+			transforms[k] = scene->transformRoot.createChild( mat4f(
+				vec4f( m[0], m[1], m[2], m[3] ), vec4f( m[4], m[5], m[6], m[7] ),
+				vec4f( m[8], m[9], m[10], m[11] ), vec4f( m[12], m[13], m[14], m[15] ) ) );
+		}
+
+		// Make everything, then add what the scene had in the order it had
+		// it, so that every object is complete when it is added.
+		vector<Geometry *> made( h.numObjects, (Geometry *)NULL );
+		vector<Trimesh *> meshes( h.numMeshes, (Trimesh *)NULL );
+		for( unsigned int k = 0; k < h.numObjects; ++k )
+			makeObject( scene, k, cobjs, materials, transforms, file, made, meshes, 0 );
+		for( unsigned int k = 0; k < h.numObjects; ++k ) {
+			if( cobjs[k].inScene )
+				scene->add( made[k] );
+		}
+
+		for( unsigned int k = 0; k < h.numLights; ++k ) {
+			const CompiledLight& c = clights[k];
+			const vec3f color = getVec( c.color );
+			const vec3f pos = getVec( c.position );
+			const vec3f dir = getVec( c.direction );
+			const double *att = c.attenuation;
+
+			switch( c.type ) {
+			case LIGHT_DIRECTIONAL:
+				scene->add( new DirectionalLight( scene, dir, color ) );
+				break;
+			case LIGHT_POINT:
+				scene->add( new PointLight( scene, pos, color, att[0], att[1], att[2] ) );
+				break;
+			case LIGHT_AMBIENT:
+				scene->add( new AmbientLight( scene, color ) );
+				break;
+			case LIGHT_SPOT:
+				scene->add( new SpotLight( scene, color, dir, pos, vec3f( c.coneAngle, 0, 0 ),
+					att[0], att[1], att[2] ) );
+				break;
+			case LIGHT_WARN:
+				scene->add( new WarnLight( scene, pos, dir, color, vec3f( c.shape, 0, 0 ),
+					att[0], att[1], att[2] ) );
+				break;
+			default:
+				throw ParseError( "Bad compiled scene: unknown light." );
+			}
+		}
+	} catch( ParseError& ) {
+		delete scene;
+		throw;
+	}
+
+	return scene;
+}
@@ -0,0 +1,37 @@
+//
+// compiled.h
+//
+// Compiled scenes: a loaded scene written out in binary, as a material
+// table, a transform table, flat vertex/normal/index arrays for every mesh,
+// the samples of every height field, the balls of every metaball and one
+// fixed-size record per object and light.  Loading one maps the file
+// into memory and creates the objects straight from the records, with one
+// allocation per array rather than per number, and gives exactly the
+// scene the .ray file it was compiled from does.
+//
+//   ray -s scene.rayb scene.ray    (compile)
+//   ray scene.rayb out.bmp         (render it like any other scene)
+//
+// readScene() recognizes compiled scenes by their first bytes, so they
+// can be used wherever a .ray file can.
+//
+
+#ifndef __COMPILED_H__
+#define __COMPILED_H__
+
+#include <string>
+
+#include "../scene/scene.h"
+
+// Does filename hold a compiled scene?
+bool isCompiledScene( const string& filename );
+
+// Load a compiled scene.  Throws a ParseError if the file is not one, or
+// was written by a different version.
+Scene *readCompiledScene( const string& filename );
+
+// Write scene out compiled.  Throws a ParseError if it holds an object
+// that can't be compiled, and returns false if the file can't be written.
+bool writeCompiledScene( const Scene *scene, const string& filename );
+
+#endif // __COMPILED_H__
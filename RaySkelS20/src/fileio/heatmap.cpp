@@ -0,0 +1,69 @@
+//
+// heatmap.cpp
+//
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "heatmap.h"
+#include "bitmap.h"
+
+// The colour ramp, from the cheapest pixels to the most expensive.
+static const float RAMP[][3] = {
+	{ 0.0f, 0.0f, 0.5f },
+	{ 0.0f, 0.0f, 1.0f },
+	{ 0.0f, 1.0f, 1.0f },
+	{ 0.0f, 1.0f, 0.0f },
+	{ 1.0f, 1.0f, 0.0f },
+	{ 1.0f, 0.0f, 0.0f }
+};
+static const int RAMP_STOPS = sizeof( RAMP ) / sizeof( RAMP[0] );
+
+// Values are scaled so that this fraction of the pixels falls below full
+// red.  Scaling to the maximum instead would let a single pixel that was
+// descheduled or took a page fault wash out the rest of the map.
+static const double SCALE_PERCENTILE = 0.99;
+
+void writeHeatmap( char *fname, int width, int height, const float *values, int stride )
+{
+	const int count = width * height;
+	if( count <= 0 )
+		return;
+
+	std::vector<float> sorted( count );
+	for( int k = 0; k < count; ++k )
+		sorted[k] = values[ k * stride ];
+	std::nth_element( sorted.begin(), sorted.begin() + (int)( SCALE_PERCENTILE * (count - 1) ), sorted.end() );
+	float scale = sorted[ (int)( SCALE_PERCENTILE * (count - 1) ) ];
+	if( scale <= 0.0f )
+		scale = *std::max_element( sorted.begin(), sorted.end() );
+	if( scale <= 0.0f )
+		scale = 1.0f;
+
+	std::vector<unsigned char> image( count * 3 );
+	for( int k = 0; k < count; ++k ) {
+		float t = values[ k * stride ] / scale;
+		if( t < 0.0f ) t = 0.0f;
+		if( t > 1.0f ) t = 1.0f;
+
+		const float pos = t * (RAMP_STOPS - 1);
+		const int lo = std::min( (int)pos, RAMP_STOPS - 2 );
+		const float f = pos - lo;
+		for( int c = 0; c < 3; ++c )
+			image[ k * 3 + c ] = (unsigned char)( 255.0f * ( RAMP[lo][c] + f * ( RAMP[lo + 1][c] - RAMP[lo][c] ) ) + 0.5f );
+	}
+
+	writeBMP( fname, width, height, &image[0] );
+}
+
+bool writeFloats( const char *fname, const float *values, size_t count )
+{
+	FILE *file = fopen( fname, "wb" );
+	if( !file )
+		return false;
+
+	const bool ok = fwrite( values, sizeof( float ), count, file ) == count;
+	fclose( file );
+	return ok;
+}
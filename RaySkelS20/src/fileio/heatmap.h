@@ -0,0 +1,22 @@
+//
+// heatmap.h
+//
+// Output for the per-pixel cost buffers recorded by the ray tracer (see
+// RayTracer::getCostBuffer): false-colour images and raw float dumps.
+//
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stddef.h>
+
+// Write one channel of an interleaved float buffer (every stride'th value,
+// starting at values[0]) as a false-colour BMP, blue for cheap pixels
+// through green and yellow to red for the most expensive ones.
+extern void writeHeatmap( char *fname, int width, int height, const float *values, int stride );
+
+// Dump count floats to fname as they are in memory.  Returns false if the
+// file can't be written.
+extern bool writeFloats( const char *fname, const float *values, size_t count );
+
+#endif
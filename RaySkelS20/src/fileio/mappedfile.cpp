@@ -0,0 +1,115 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mappedfile.h"
+
+MappedFile::MappedFile()
+	: base( NULL ), length( 0 )
+#ifdef _WIN32
+	, file( INVALID_HANDLE_VALUE ), mapping( NULL )
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open( const char *path )
+{
+	close();
+
+	file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size ) || size.QuadPart == 0 ) {
+		close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( mapping == NULL ) {
+		close();
+		return false;
+	}
+
+	base = (const char *)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if( base == NULL ) {
+		close();
+		return false;
+	}
+
+	length = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if( base )
+		UnmapViewOfFile( base );
+	if( mapping )
+		CloseHandle( mapping );
+	if( file != INVALID_HANDLE_VALUE )
+		CloseHandle( file );
+
+	base = NULL;
+	length = 0;
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open( const char *path )
+{
+	close();
+
+	const int fd = ::open( path, O_RDONLY );
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+		::close( fd );
+		return false;
+	}
+
+	// The mapping stays valid once the descriptor is closed.  Everything
+	// that maps a file reads all of it, so fault it all in up front where
+	// that can be asked for.
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	void *p = mmap( NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0 );
+	::close( fd );
+	if( p == MAP_FAILED )
+		return false;
+
+	base = (const char *)p;
+	length = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if( base )
+		munmap( (void *)base, length );
+
+	base = NULL;
+	length = 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+//
+// mappedfile.h
+//
+// A file mapped read-only into memory, so that large binary files can be
+// used in place instead of being read into buffers of their own.
+//
+
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+#include <cstddef>
+
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map the whole of the file at path, closing whatever was open before.
+	// Returns false if it can't be opened or is empty.
+	bool open( const char *path );
+	void close();
+
+	bool isOpen() const { return base != NULL; }
+
+	// The contents, which start on a page boundary.
+	const char *data() const { return base; }
+	size_t size() const { return length; }
+
+private:
+	MappedFile( const MappedFile& );
+	MappedFile& operator=( const MappedFile& );
+
+	const char *base;
+	size_t length;
+
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#endif
+};
+
+#endif // __MAPPEDFILE_H__
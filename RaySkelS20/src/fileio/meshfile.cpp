@@ -0,0 +1,605 @@
+#ifdef WIN32
+#pragma warning( disable : 4786 )
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+#include "meshfile.h"
+#include "mappedfile.h"
+#include "parse.h"
+
+static ParseError meshError( const string& path, const string& msg )
+{
+	return ParseError( path + ": " + msg );
+}
+
+static ParseError meshError( const string& path, int line, const string& msg )
+{
+	ostringstream oss;
+	oss << path << ", line " << line << ": " << msg;
+	return ParseError( oss.str() );
+}
+
+static inline bool isSpace( char c )
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// The next whitespace separated word on the line at p, or an empty one at
+// the end of the line.
+static void nextWord( const char *& p, const char *end, const char *& begin, const char *& wordEnd )
+{
+	while( p < end && isSpace( *p ) ) {
+		++p;
+	}
+	begin = p;
+	while( p < end && !isSpace( *p ) && *p != '\n' ) {
+		++p;
+	}
+	wordEnd = p;
+}
+
+static bool isWord( const char *begin, const char *end, const char *word )
+{
+	const size_t length = strlen( word );
+	return (size_t)(end - begin) == length && memcmp( begin, word, length ) == 0;
+}
+
+//
+// OBJ
+//
+
+// Faces name vertices and normals by their position in the file, from 1,
+// or counting back from the last one read if negative.  Returns -1 for a
+// missing index, and throws for a bad one.
+static int objIndex( const char *& p, const char *end, int count,
+	const string& path, int line )
+{
+	if( p == end || *p == '/' ) {
+		return -1;
+	}
+
+	const bool negative = *p == '-';
+	if( negative ) {
+		++p;
+	}
+	long long index = 0;
+	const char *digits = p;
+	for( ; p < end && *p >= '0' && *p <= '9'; ++p ) {
+		if( index <= count ) {
+			index = index * 10 + (*p - '0');
+		}
+	}
+	if( p == digits || (p < end && *p != '/') ) {
+		throw meshError( path, line, "bad face" );
+	}
+
+	index = negative ? count - index : index - 1;
+	if( index < 0 || index >= count ) {
+		throw meshError( path, line, "face refers to a missing vertex or normal" );
+	}
+	return (int)index;
+}
+
+static void readOBJ( const char *p, const char *end, const string& path, TrimeshGeometry& g )
+{
+	// OBJ gives normals per face corner, and a mesh per vertex.  Vertex v
+	// takes the normal the first face that uses it gives it; a face that
+	// gives it another one gets a copy of v instead.  Copies are made at
+	// the end, since the vertices must keep their positions in the file
+	// until then, and are referred to until then by -1 - their number.
+	vector<vec3f> normals;
+	vector<int> normalOf;
+	vector< pair<int,int> > copies;
+	map< pair<int,int>, int > copyOf;
+	bool withNormals = false;
+	bool withoutNormals = false;
+
+	vector<int> face;
+	int line = 1;
+
+	while( p < end ) {
+		const char *word, *wordEnd;
+		nextWord( p, end, word, wordEnd );
+
+		if( isWord( word, wordEnd, "v" ) || isWord( word, wordEnd, "vn" ) ) {
+			double v[3];
+			for( int k = 0; k < 3; ++k ) {
+				const char *number, *numberEnd;
+				nextWord( p, end, number, numberEnd );
+				if( number == numberEnd ) {
+					throw meshError( path, line, "expected three numbers" );
+				}
+				v[k] = parseScalar( number, numberEnd );
+			}
+			if( wordEnd - word == 1 ) {
+				g.vertices.push_back( vec3f( v[0], v[1], v[2] ) );
+			} else {
+				normals.push_back( vec3f( v[0], v[1], v[2] ) );
+			}
+		} else if( isWord( word, wordEnd, "f" ) ) {
+			face.clear();
+			while( true ) {
+				const char *corner, *cornerEnd;
+				nextWord( p, end, corner, cornerEnd );
+				if( corner == cornerEnd ) {
+					break;
+				}
+
+				// v, v/vt, v//vn or v/vt/vn
+				const char *q = corner;
+				int v = objIndex( q, cornerEnd, g.vertices.size(), path, line );
+				int n = -1;
+				if( v < 0 ) {
+					throw meshError( path, line, "bad face" );
+				}
+				if( q < cornerEnd ) {
+					++q;
+					while( q < cornerEnd && *q != '/' ) {
+						++q;
+					}
+					if( q < cornerEnd ) {
+						++q;
+						n = objIndex( q, cornerEnd, normals.size(), path, line );
+					}
+				}
+
+				if( n < 0 ) {
+					withoutNormals = true;
+				} else {
+					withNormals = true;
+					if( normalOf.size() < g.vertices.size() ) {
+						normalOf.resize( g.vertices.size(), -1 );
+					}
+					if( normalOf[v] < 0 ) {
+						normalOf[v] = n;
+					} else if( normalOf[v] != n ) {
+						const pair<int,int> key( v, n );
+						map< pair<int,int>, int >::const_iterator i = copyOf.find( key );
+						if( i == copyOf.end() ) {
+							i = copyOf.insert( make_pair( key, -1 - (int)copies.size() ) ).first;
+							copies.push_back( key );
+						}
+						v = i->second;
+					}
+				}
+				face.push_back( v );
+			}
+
+			if( face.size() < 3 ) {
+				throw meshError( path, line, "faces must have at least 3 vertices" );
+			}
+			for( size_t k = 2; k < face.size(); ++k ) {
+				g.indices.push_back( face[0] );
+				g.indices.push_back( face[k-1] );
+				g.indices.push_back( face[k] );
+			}
+		}
+
+		// everything else (comments, groups, texture coordinates,
+		// materials) is skipped
+		const char *nl = (const char *)memchr( p, '\n', end - p );
+		p = nl ? nl + 1 : end;
+		++line;
+	}
+
+	const int numVertices = g.vertices.size();
+	for( size_t k = 0; k < copies.size(); ++k ) {
+		const vec3f v = g.vertices[ copies[k].first ];
+		g.vertices.push_back( v );
+	}
+	for( size_t k = 0; k < g.indices.size(); ++k ) {
+		if( g.indices[k] < 0 ) {
+			g.indices[k] = numVertices - 1 - g.indices[k];
+		}
+	}
+
+	// Normals only if every face gave them: a mesh has them for all of
+	// its vertices or none.
+	if( withNormals && !withoutNormals ) {
+		normalOf.resize( numVertices, -1 );
+		g.normals.resize( g.vertices.size() );
+		for( int v = 0; v < numVertices; ++v ) {
+			if( normalOf[v] >= 0 ) {
+				g.normals[v] = normals[ normalOf[v] ];
+			}
+		}
+		for( size_t k = 0; k < copies.size(); ++k ) {
+			g.normals[ numVertices + k ] = normals[ copies[k].second ];
+		}
+	}
+}
+
+//
+// PLY
+//
+
+enum PlyType
+{
+	PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+	PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+enum PlyFormat
+{
+	PLY_ASCII, PLY_LITTLE_ENDIAN, PLY_BIG_ENDIAN
+};
+
+struct PlyProperty
+{
+	string name;
+	PlyType type;
+	bool isList;
+	PlyType countType;			// of a list
+};
+
+struct PlyElement
+{
+	string name;
+	long long count;
+	vector<PlyProperty> properties;
+};
+
+static bool plyType( const string& name, PlyType& type )
+{
+	static const struct { const char *name; PlyType type; } types[] = {
+		{ "char", PLY_INT8 }, { "int8", PLY_INT8 },
+		{ "uchar", PLY_UINT8 }, { "uint8", PLY_UINT8 },
+		{ "short", PLY_INT16 }, { "int16", PLY_INT16 },
+		{ "ushort", PLY_UINT16 }, { "uint16", PLY_UINT16 },
+		{ "int", PLY_INT32 }, { "int32", PLY_INT32 },
+		{ "uint", PLY_UINT32 }, { "uint32", PLY_UINT32 },
+		{ "float", PLY_FLOAT32 }, { "float32", PLY_FLOAT32 },
+		{ "double", PLY_FLOAT64 }, { "float64", PLY_FLOAT64 }
+	};
+
+	for( size_t k = 0; k < sizeof( types ) / sizeof( types[0] ); ++k ) {
+		if( name == types[k].name ) {
+			type = types[k].type;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int plyTypeSize( PlyType type )
+{
+	static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[ type ];
+}
+
+// Reads the values of the body one at a time, in whichever format it is.
+class PlyReader
+{
+public:
+	PlyReader( const char *begin, const char *end, PlyFormat format, const string& path )
+		: cur( begin ), end( end ), format( format ), path( path )
+	{
+		const unsigned int one = 1;
+		const bool littleEndian = *(const unsigned char *)&one == 1;
+		swap = format == (littleEndian ? PLY_BIG_ENDIAN : PLY_LITTLE_ENDIAN);
+	}
+
+	double value( PlyType type )
+	{
+		if( format == PLY_ASCII ) {
+			while( cur < end && (isSpace( *cur ) || *cur == '\n') ) {
+				++cur;
+			}
+			const char *begin = cur;
+			while( cur < end && !isSpace( *cur ) && *cur != '\n' ) {
+				++cur;
+			}
+			if( begin == cur ) {
+				throw meshError( path, "file ends early" );
+			}
+			return parseScalar( begin, cur );
+		}
+
+		const int size = plyTypeSize( type );
+		if( end - cur < size ) {
+			throw meshError( path, "file ends early" );
+		}
+		unsigned char b[8];
+		memcpy( b, cur, size );
+		cur += size;
+		if( swap ) {
+			reverse( b, b + size );
+		}
+
+		switch( type ) {
+		case PLY_INT8:		{ signed char v;		memcpy( &v, b, 1 ); return v; }
+		case PLY_UINT8:		{ unsigned char v;		memcpy( &v, b, 1 ); return v; }
+		case PLY_INT16:		{ short v;				memcpy( &v, b, 2 ); return v; }
+		case PLY_UINT16:	{ unsigned short v;		memcpy( &v, b, 2 ); return v; }
+		case PLY_INT32:		{ int v;				memcpy( &v, b, 4 ); return v; }
+		case PLY_UINT32:	{ unsigned int v;		memcpy( &v, b, 4 ); return v; }
+		case PLY_FLOAT32:	{ float v;				memcpy( &v, b, 4 ); return v; }
+		default:			{ double v;				memcpy( &v, b, 8 ); return v; }
+		}
+	}
+
+	// The number of items in a list, which is checked against what is left
+	// of the file so that a bad one can't run away.
+	long long listCount( PlyType type )
+	{
+		const double count = value( type );
+		if( count < 0 || count > (double)(end - cur) ) {
+			throw meshError( path, "bad list length" );
+		}
+		return (long long)count;
+	}
+
+	// Bytes left in the file.
+	long long remaining() const { return end - cur; }
+
+	void skip( const PlyProperty& property )
+	{
+		if( !property.isList ) {
+			value( property.type );
+			return;
+		}
+		const long long count = listCount( property.countType );
+		for( long long k = 0; k < count; ++k ) {
+			value( property.type );
+		}
+	}
+
+private:
+	const char *cur;
+	const char *end;
+	PlyFormat format;
+	bool swap;
+	const string& path;
+};
+
+// The fewest bytes an item of element can take up in the file: one
+// character per value in ASCII, and in binary the size of each value or,
+// for a list, of its count.
+static long long plyMinimumSize( const PlyElement& element, PlyFormat format )
+{
+	const vector<PlyProperty>& properties = element.properties;
+	if( format == PLY_ASCII ) {
+		return properties.size();
+	}
+
+	long long size = 0;
+	for( size_t k = 0; k < properties.size(); ++k ) {
+		size += plyTypeSize( properties[k].isList ? properties[k].countType : properties[k].type );
+	}
+	return size;
+}
+
+// Read the header, leaving p at the start of the body.
+static PlyFormat readPLYHeader( const char *& p, const char *end, const string& path,
+	vector<PlyElement>& elements )
+{
+	PlyFormat format = PLY_ASCII;
+	bool haveFormat = false;
+	int line = 1;
+
+	while( true ) {
+		if( p == end ) {
+			throw meshError( path, "no end_header" );
+		}
+		const char *nl = (const char *)memchr( p, '\n', end - p );
+		const char *lineEnd = nl ? nl : end;
+
+		// the words of the line
+		vector<string> words;
+		const char *q = p;
+		while( true ) {
+			const char *word, *wordEnd;
+			nextWord( q, lineEnd, word, wordEnd );
+			if( word == wordEnd ) {
+				break;
+			}
+			words.push_back( string( word, wordEnd ) );
+		}
+		p = nl ? nl + 1 : end;
+
+		if( line == 1 ) {
+			if( words.size() != 1 || words[0] != "ply" ) {
+				throw meshError( path, "not a PLY file" );
+			}
+		} else if( words.empty() || words[0] == "comment" || words[0] == "obj_info" ) {
+			// nothing
+		} else if( words[0] == "format" && words.size() >= 2 ) {
+			if( words[1] == "ascii" ) {
+				format = PLY_ASCII;
+			} else if( words[1] == "binary_little_endian" ) {
+				format = PLY_LITTLE_ENDIAN;
+			} else if( words[1] == "binary_big_endian" ) {
+				format = PLY_BIG_ENDIAN;
+			} else {
+				throw meshError( path, line, "unknown format " + words[1] );
+			}
+			haveFormat = true;
+		} else if( words[0] == "element" && words.size() == 3 ) {
+			PlyElement element;
+			element.name = words[1];
+			element.count = atoll( words[2].c_str() );
+			if( element.count < 0 ) {
+				throw meshError( path, line, "bad element count" );
+			}
+			elements.push_back( element );
+		} else if( words[0] == "property" && !elements.empty() ) {
+			PlyProperty property;
+			property.isList = words.size() == 5 && words[1] == "list";
+			if( property.isList ) {
+				if( !plyType( words[2], property.countType ) ||
+						!plyType( words[3], property.type ) ) {
+					throw meshError( path, line, "unknown property type" );
+				}
+				property.name = words[4];
+			} else if( words.size() == 3 ) {
+				if( !plyType( words[1], property.type ) ) {
+					throw meshError( path, line, "unknown property type " + words[1] );
+				}
+				property.name = words[2];
+			} else {
+				throw meshError( path, line, "bad property" );
+			}
+			elements.back().properties.push_back( property );
+		} else if( words[0] == "end_header" ) {
+			break;
+		} else {
+			throw meshError( path, line, "unexpected " + words[0] );
+		}
+		++line;
+	}
+
+	if( !haveFormat ) {
+		throw meshError( path, "no format" );
+	}
+	return format;
+}
+
+static int findProperty( const PlyElement& element, const char *name )
+{
+	for( size_t k = 0; k < element.properties.size(); ++k ) {
+		if( element.properties[k].name == name ) {
+			return (int)k;
+		}
+	}
+	return -1;
+}
+
+static void readPLY( const char *p, const char *end, const string& path, TrimeshGeometry& g )
+{
+	vector<PlyElement> elements;
+	const PlyFormat format = readPLYHeader( p, end, path, elements );
+	PlyReader reader( p, end, format, path );
+
+	long long numVertices = -1;
+	for( size_t e = 0; e < elements.size(); ++e ) {
+		if( elements[e].name == "vertex" ) {
+			numVertices = elements[e].count;
+		}
+	}
+	if( numVertices < 0 ) {
+		throw meshError( path, "no vertices" );
+	}
+
+	vector<double> values;
+	vector<int> face;
+
+	for( size_t e = 0; e < elements.size(); ++e ) {
+		const PlyElement& element = elements[e];
+		const vector<PlyProperty>& properties = element.properties;
+
+		// Check the count against what is left of the file before any room
+		// is made for it, so that a bad header can't ask for too much.
+		const long long size = plyMinimumSize( element, format );
+		if( size > 0 && element.count > reader.remaining() / size ) {
+			throw meshError( path, "more " + element.name + " elements than the file holds" );
+		}
+
+		if( element.name == "vertex" ) {
+			// where x, y, z, nx, ny and nz are among the properties
+			static const char *names[6] = { "x", "y", "z", "nx", "ny", "nz" };
+			int slot[6];
+			for( int k = 0; k < 6; ++k ) {
+				slot[k] = findProperty( element, names[k] );
+				if( slot[k] >= 0 && properties[ slot[k] ].isList ) {
+					slot[k] = -1;
+				}
+			}
+			if( slot[0] < 0 || slot[1] < 0 || slot[2] < 0 ) {
+				throw meshError( path, "vertices have no position" );
+			}
+			const bool withNormals = slot[3] >= 0 && slot[4] >= 0 && slot[5] >= 0;
+
+			g.vertices.reserve( g.vertices.size() + element.count );
+			if( withNormals ) {
+				g.normals.reserve( g.normals.size() + element.count );
+			}
+			values.resize( properties.size() );
+			for( long long n = 0; n < element.count; ++n ) {
+				for( size_t k = 0; k < properties.size(); ++k ) {
+					if( properties[k].isList ) {
+						reader.skip( properties[k] );
+					} else {
+						values[k] = reader.value( properties[k].type );
+					}
+				}
+				g.vertices.push_back( vec3f( values[ slot[0] ], values[ slot[1] ], values[ slot[2] ] ) );
+				if( withNormals ) {
+					g.normals.push_back( vec3f( values[ slot[3] ], values[ slot[4] ], values[ slot[5] ] ) );
+				}
+			}
+		} else if( element.name == "face" ) {
+			int indices = findProperty( element, "vertex_indices" );
+			if( indices < 0 ) {
+				indices = findProperty( element, "vertex_index" );
+			}
+			if( indices < 0 || !properties[ indices ].isList ) {
+				throw meshError( path, "faces have no vertex_indices" );
+			}
+
+			g.indices.reserve( g.indices.size() + element.count * 3 );
+			for( long long n = 0; n < element.count; ++n ) {
+				for( size_t k = 0; k < properties.size(); ++k ) {
+					if( (int)k != indices ) {
+						reader.skip( properties[k] );
+						continue;
+					}
+
+					const long long count = reader.listCount( properties[k].countType );
+					face.clear();
+					for( long long c = 0; c < count; ++c ) {
+						const double v = reader.value( properties[k].type );
+						if( v < 0 || v >= numVertices ) {
+							throw meshError( path, "face refers to a missing vertex" );
+						}
+						face.push_back( (int)v );
+					}
+					if( face.size() < 3 ) {
+						throw meshError( path, "faces must have at least 3 vertices" );
+					}
+					for( size_t c = 2; c < face.size(); ++c ) {
+						g.indices.push_back( face[0] );
+						g.indices.push_back( face[c-1] );
+						g.indices.push_back( face[c] );
+					}
+				}
+			}
+		} else if( !properties.empty() ) {
+			for( long long n = 0; n < element.count; ++n ) {
+				for( size_t k = 0; k < properties.size(); ++k ) {
+					reader.skip( properties[k] );
+				}
+			}
+		}
+	}
+}
+
+void readMeshFile( const string& path, TrimeshGeometry& geometry )
+{
+	MappedFile file;
+	if( !file.open( path.c_str() ) ) {
+		throw meshError( path, "couldn't read mesh file" );
+	}
+
+	const char *begin = file.data();
+	const char *end = begin + file.size();
+
+	if( file.size() >= 4 && memcmp( begin, "ply", 3 ) == 0 &&
+			(begin[3] == '\n' || begin[3] == '\r') ) {
+		readPLY( begin, end, path, geometry );
+		return;
+	}
+
+	string extension = path.size() > 4 ? path.substr( path.size() - 4 ) : "";
+	transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+	if( extension == ".obj" ) {
+		readOBJ( begin, end, path, geometry );
+		return;
+	}
+
+	throw meshError( path, "not an OBJ or PLY file" );
+}
@@ -0,0 +1,30 @@
+//
+// meshfile.h
+//
+// Triangle meshes read from OBJ and PLY files, for the mesh_file scene
+// node:
+//
+//   mesh_file { path = "bunny.ply"; material = { ... }; }
+//
+// The file is mapped into memory and read in one pass, with the vertices,
+// normals and faces going straight into the mesh's arrays rather than
+// through the parser's objects.  PLY may be ASCII or binary of either byte
+// order; of its vertices only the position and normal are used.  Of an
+// OBJ file only the v, vn and f lines are used, and a vertex that faces
+// give different normals is split into one copy per normal.  Faces with
+// more than three vertices are made into fans, as trimesh does.
+//
+
+#ifndef __MESHFILE_H__
+#define __MESHFILE_H__
+
+#include <string>
+
+#include "../SceneObjects/trimesh.h"
+
+// Read the mesh in the file at path into geometry, which must be empty.
+// Which format it is in is told from the first line ("ply") or else the
+// ".obj" extension.  Throws a ParseError if it can't be read.
+void readMeshFile( const string& path, TrimeshGeometry& geometry );
+
+#endif // __MESHFILE_H__
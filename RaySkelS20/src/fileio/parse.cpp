@@ -4,98 +4,197 @@
 #pragma warning( disable : 4786 )
 #endif
 
+#include <cstdlib>
 #include <cstring>
 
 #include "parse.h"
 
-static string readID( istream& is );
-static Obj *readString( istream& is );
-static Obj *readScalar( istream& is );
-static Obj *readTuple( istream& is );
-static Obj *readDict( istream& is );
-static Obj *readObject( istream& is );
-static Obj *readName( istream& is );
-static void eatWS( istream& is );
-static void eatNL( istream& is );
-
-Obj *readFile( istream& is )
+// The parser reads straight out of the buffer.  Past its end, peek() and
+// get() return -1, as they do for an istream.
+static inline int peek( const ParseBuffer& is )
+{
+	return is.cur < is.end ? (unsigned char)*is.cur : -1;
+}
+
+static inline int get( ParseBuffer& is )
+{
+	return is.cur < is.end ? (unsigned char)*is.cur++ : -1;
+}
+
+static inline bool isScalarChar( int ch )
+{
+	return (ch >= '0' && ch <= '9') || ch == '-' || ch == '.' || ch == 'e' || ch == 'E';
+}
+
+static string readID( ParseBuffer& is );
+static Obj *readString( ParseBuffer& is );
+static Obj *readScalar( ParseBuffer& is );
+static Obj *readTuple( ParseBuffer& is );
+static Obj *readDict( ParseBuffer& is );
+static Obj *readObject( ParseBuffer& is );
+static Obj *readName( ParseBuffer& is );
+static void eatWS( ParseBuffer& is );
+static void eatNL( ParseBuffer& is );
+
+Obj *readFile( ParseBuffer& is )
 {
 	return readObject( is );
 }
 
-static void eatWS( istream& is )
+// Exact powers of ten.  Up to 1e22 they are all doubles.
+static const double powersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parse the number at begin, if it is one that can be done exactly without
+// atof(): the numbers in scene files are short, so nearly all of them have
+// a mantissa that fits in a double and a small exponent.  Those take one
+// multiply or divide by an exact power of ten, which rounds the same way
+// atof() does.  Sets next to the first character after the number.
+static bool parseSimpleScalar( const char *begin, const char *end,
+	const char *& next, double& v )
 {
-	int ch = is.peek();
-	while( ch == ' ' || ch == '\t' || ch == '\n' || ch == 0x0D || ch == 0x0A) {
-		is.get();
-		if( !is ) {
-			return;
+	const char *p = begin;
+	const bool negative = p < end && *p == '-';
+	if( negative ) {
+		++p;
+	}
+
+	unsigned long long mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	bool exact = true;
+
+	for( ; p < end && *p >= '0' && *p <= '9'; ++p, ++digits ) {
+		if( mantissa >= 100000000000000000ull ) {
+			exact = false;
 		}
-		ch = is.peek();
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	if( p < end && *p == '.' ) {
+		for( ++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits ) {
+			if( mantissa >= 100000000000000000ull ) {
+				exact = false;
+			}
+			mantissa = mantissa * 10 + (*p - '0');
+			--exponent;
+		}
+	}
+	if( p < end && (*p == 'e' || *p == 'E') ) {
+		++p;
+		const bool negativeExponent = p < end && *p == '-';
+		if( negativeExponent ) {
+			++p;
+		}
+		int e = 0;
+		if( p == end || *p < '0' || *p > '9' ) {
+			exact = false;
+		}
+		for( ; p < end && *p >= '0' && *p <= '9'; ++p ) {
+			if( e < 1000 ) {
+				e = e * 10 + (*p - '0');
+			}
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	next = p;
+	if( !exact || digits == 0 || mantissa > (1ull << 53) ||
+			exponent < -22 || exponent > 22 ) {
+		return false;
+	}
+
+	v = (double)mantissa;
+	if( exponent < 0 ) {
+		v /= powersOfTen[ -exponent ];
+	} else {
+		v *= powersOfTen[ exponent ];
 	}
+	if( negative ) {
+		v = -v;
+	}
+	return true;
 }
 
-static void eatNL( istream& is )
+static double atofRange( const char *begin, const char *end )
 {
-	int ch = is.peek();
-	while( ch != '\n' ) {
-		is.get();
-		if( !is ) {
+	char buf[ 64 ];
+	const size_t length = end - begin;
+	if( length < sizeof( buf ) ) {
+		memcpy( buf, begin, length );
+		buf[ length ] = '\0';
+		return atof( buf );
+	}
+	return atof( string( begin, end ).c_str() );
+}
+
+double parseScalar( const char *begin, const char *end )
+{
+	const char *next;
+	double v;
+	if( parseSimpleScalar( begin, end, next, v ) && next == end ) {
+		return v;
+	}
+	return atofRange( begin, end );
+}
+
+static void eatWS( ParseBuffer& is )
+{
+	while( is.cur < is.end ) {
+		const char ch = *is.cur;
+		if( ch != ' ' && ch != '\t' && ch != '\n' && ch != 0x0D ) {
 			return;
 		}
-		ch = is.peek();
+		++is.cur;
 	}
 }
 
-static bool eat( istream& is ) 
+static void eatNL( ParseBuffer& is )
+{
+	const char *nl = (const char *)memchr( is.cur, '\n', is.end - is.cur );
+	is.cur = nl ? nl : is.end;
+}
+
+// Skip whitespace and comments.  Returns false at the end of the input.
+static bool eat( ParseBuffer& is )
 {
-	while( is ) {
+	while( true ) {
 		eatWS( is );
-		if( is ) {
-			int ch = is.peek();
-			if( ch == '/' ) {
-				is.get();
-				int ch = is.peek();
-				if( ch == '/' ) {
-					eatNL( is );
-				} else if( ch == '*' ) {
-					while( true ) {
-						is.get();
-						ch = is.peek();
-						if( ch == '*' ) {
-							is.get();
-							ch = is.peek();
-							if( ch == '/' ) {
-								is.get();
-								break;
-							} else if( ch == -1 ) {	
-								is.get();
-								throw ParseError( 
-									"Parse Error: unterminated comment" );
-							}
-						} else if( ch == -1 ) {
-							is.get();
-							throw ParseError( 
-								"Parse Error: unterminated comment" );
-						}
-					}
-				} else {
-					return true;
+		int ch = peek( is );
+		if( ch == -1 ) {
+			return false;
+		} else if( ch != '/' ) {
+			return true;
+		}
+
+		// A lone slash is dropped, as it always has been.
+		get( is );
+		ch = peek( is );
+		if( ch == '/' ) {
+			eatNL( is );
+		} else if( ch == '*' ) {
+			++is.cur;
+			while( true ) {
+				const char *star = (const char *)memchr( is.cur, '*', is.end - is.cur );
+				if( star == NULL || star + 1 == is.end ) {
+					is.cur = is.end;
+					throw ParseError(
+						"Parse Error: unterminated comment" );
+				}
+				is.cur = star + 1;
+				if( *is.cur == '/' ) {
+					++is.cur;
+					break;
 				}
-			} else if( ch == -1 ) {
-				is.get();
-				return false;
-			} else {
-				return true;
 			}
 		} else {
-			return false;
+			return true;
 		}
 	}
-	return false;
 }
 
-static Obj *readName( istream& is )
+static Obj *readName( ParseBuffer& is )
 {
 	string s = readID( is );
 
@@ -108,8 +207,8 @@ static Obj *readName( istream& is )
 			return new IdObj( s );
 		}
 
-		int ch = is.peek();
-		if( strchr( "}),;", ch ) != NULL ) {
+		int ch = peek( is );
+		if( ch == '}' || ch == ')' || ch == ',' || ch == ';' ) {
 			return new IdObj( s );
 		} else {
 			return new NamedObj( s, readObject( is ) );
@@ -117,126 +216,214 @@ static Obj *readName( istream& is )
 	}
 }
 
-static string readID( istream& is )
+static string readID( ParseBuffer& is )
 {
-	int ch;
-	string ret( "" );
+	const char *begin = is.cur;
 
-	ret += char( is.get() );
-
-	while( is ) {
-		ch = is.peek();
-		if( strchr( " \t\n={}();,/", ch ) != NULL ) {
-			break;
-		} else {
-			ret += char( ch );
-			is.get();
-		}
+	// the first character is taken whatever it is
+	if( is.cur < is.end ) {
+		++is.cur;
+	}
+	while( is.cur < is.end && strchr( " \t\n\r={}();,/", *is.cur ) == NULL ) {
+		++is.cur;
 	}
 
-	return ret;
+	return string( begin, is.cur );
 }
 
-static Obj *readString( istream& is ) 
+static Obj *readString( ParseBuffer& is )
 {
-	int ch;
-	string ret( "" );
+	get( is );
+
+	const char *begin = is.cur;
+	const char *quote = (const char *)memchr( is.cur, '"', is.end - is.cur );
+	if( quote == NULL ) {
+		is.cur = is.end;
+		throw ParseError( "Parse error: unterminated string." );
+	}
 
-	is.get();
+	is.cur = quote + 1;
+	return new StringObj( string( begin, quote ) );
+}
 
-	while( true ) {
-		ch = is.peek();
-		if( ch == '"' ) {
-			is.get();
-			return new StringObj( ret );
-		} else {
-			ret += char( ch );
-		}
-		is.get();
+// A number is the longest run of the characters numbers are made of,
+// read with atof(), so that "1-2" is 1 and "3e" is 3.
+static double readNumber( ParseBuffer& is )
+{
+	const char *next;
+	double v;
+	if( parseSimpleScalar( is.cur, is.end, next, v ) &&
+			(next == is.end || !isScalarChar( (unsigned char)*next )) ) {
+		is.cur = next;
+		return v;
 	}
+
+	const char *begin = is.cur;
+	while( is.cur < is.end && isScalarChar( (unsigned char)*is.cur ) ) {
+		++is.cur;
+	}
+
+	return atofRange( begin, is.cur );
+}
+
+static Obj *readScalar( ParseBuffer& is )
+{
+	return new ScalarObj( readNumber( is ) );
 }
 
-static Obj *readScalar( istream& is )
+// Read a tuple of nothing but numbers onto the end of scalars.  Returns
+// false, leaving is and scalars as they were, if it holds anything else.
+static bool readScalars( ParseBuffer& is, vector<double>& scalars )
 {
-	int ch;
-	string ret( "" );
+	const char *start = is.cur;
+	const size_t size = scalars.size();
+
+	get( is );
 
 	while( true ) {
-		ch = is.peek();
-		if( (ch == '-') || (ch == '.') || (ch == 'e') || (ch == 'E')
-				|| (ch >= '0' && ch <= '9') ) {
-			ret += char( ch );
-			is.get();
-		} else {
+		eat( is );
+		int ch = peek( is );
+		if( (ch != '-') && !(ch >= '0' && ch <= '9') ) {
+			break;
+		}
+		scalars.push_back( readNumber( is ) );
+		eat( is );
+		ch = get( is );
+		if( ch == ')' ) {
+			return true;
+		} else if( ch != ',' ) {
 			break;
 		}
 	}
 
-	return new ScalarObj( atof( ret.c_str() ) );
+	is.cur = start;
+	scalars.resize( size );
+	return false;
 }
 
-static Obj *readTuple( istream& is )
+// Read a tuple of tuples of numbers, all of the same length, into scalars
+// one after the other.  Returns false, leaving is as it was, if it is
+// anything else.
+static bool readScalarRows( ParseBuffer& is, vector<double>& scalars, size_t& width )
 {
-	vector<Obj*> ret;
+	const char *start = is.cur;
+	width = 0;
 
-	is.get();
+	get( is );
 
 	while( true ) {
 		eat( is );
-		ret.push_back( readObject( is ) );	
+		const size_t size = scalars.size();
+		if( peek( is ) != '(' || !readScalars( is, scalars ) ) {
+			break;
+		}
+		if( width == 0 ) {
+			width = scalars.size() - size;
+		} else if( scalars.size() - size != width ) {
+			break;
+		}
 		eat( is );
-		int ch = is.get();
+		int ch = get( is );
 		if( ch == ')' ) {
-			return new TupleObj( ret );
-		} else if( ch == ',' ) {
-			continue;
-		} else {
-			throw ParseError( "Parse error: expected comma." );
+			return true;
+		} else if( ch != ',' ) {
+			break;
 		}
 	}
 
-	throw ParseError( "Parse error: internal error." );
+	is.cur = start;
+	scalars.clear();
+	return false;
+}
+
+static Obj *readTuple( ParseBuffer& is )
+{
+	// Tuples of numbers (points, colors) and tuples of those (the points
+	// and faces of a mesh) are by far the most common thing in a scene
+	// file, so they are read straight into an array of numbers.
+	vector<double> scalars;
+	size_t width;
+	if( readScalars( is, scalars ) ) {
+		return new ScalarTupleObj( scalars );
+	}
+	if( readScalarRows( is, scalars, width ) ) {
+		return new ScalarTupleObj( scalars, width );
+	}
+
+	vector<Obj*> ret;
+
+	get( is );
+
+	try {
+		while( true ) {
+			eat( is );
+			ret.push_back( readObject( is ) );	
+			eat( is );
+			int ch = get( is );
+			if( ch == ')' ) {
+				return new TupleObj( ret );
+			} else if( ch == ',' ) {
+				continue;
+			} else {
+				throw ParseError( "Parse error: expected comma." );
+			}
+		}
+	} catch( ... ) {
+		for( mytuple::iterator i = ret.begin(); i != ret.end(); ++i ) {
+			delete (*i);
+		}
+		throw;
+	}
 }
 
-static Obj *readDict( istream& is )
+static Obj *readDict( ParseBuffer& is )
 {
 	string lhs;
 	Obj *rhs;
 
 	map<string,Obj*> ret;
 
-	is.get();
+	get( is );
 
-	while( true ) {
-		eat( is );
-		if( is.peek() == '}' ) {
-			is.get();
-			return new DictObj( ret );
-		}
-		lhs = readID( is );
-		eat( is );
-		if( is.get() != '=' ) {
-			throw ParseError( "Parse error: expected equals." );
+	try {
+		while( true ) {
+			eat( is );
+			if( peek( is ) == '}' ) {
+				get( is );
+				return new DictObj( ret );
+			}
+			lhs = readID( is );
+			eat( is );
+			if( get( is ) != '=' ) {
+				throw ParseError( "Parse error: expected equals." );
+			}
+			rhs = readObject( is );
+			Obj*& field = ret[ lhs ];
+			delete field;
+			field = rhs;
+			eat( is );
+			int ch = peek( is );
+			if( ch == ';' ) {
+				get( is );
+			} else if( ch != '}' ) {
+				throw ParseError( "Parse error: expected semicolon or brace." );
+			}
 		}
-		rhs = readObject( is );
-		ret[ lhs ] = rhs;
-		eat( is );
-		int ch = is.peek();
-		if( ch == ';' ) {
-			is.get();
-		} else if( ch != '}' ) {
-			throw ParseError( "Parse error: expected semicolon or brace." );
+	} catch( ... ) {
+		for( dict::iterator i = ret.begin(); i != ret.end(); ++i ) {
+			delete (*i).second;
 		}
+		throw;
 	}
 }
 
-static Obj *readObject( istream& is )
+static Obj *readObject( ParseBuffer& is )
 {
 	if( !eat( is ) ) {
 		return NULL;
 	}
 
-	int ch = is.peek();
+	int ch = peek( is );
 
 	if( (ch == '-') || (ch >= '0' && ch <= '9') ) {
 		return readScalar( is );
@@ -250,13 +437,3 @@ static Obj *readObject( istream& is )
 		return readName( is );
 	}
 }
-
-/*
-int main( void )
-{
-	Obj *o = readFile( cin );
-	o->printOn( cout );
-	delete o;
-	return 0;
-}
-*/
@@ -70,6 +70,12 @@ public:
 	{ throw ObjTypeMismatch( string( "string" ), getTypeName() ); }
 	virtual const mytuple& getTuple() const 
 	{ throw ObjTypeMismatch( string( "tuple" ), getTypeName() ); }
+	// The numbers of a tuple that holds nothing but numbers, or NULL if
+	// this isn't one.  Cheaper than going through getTuple().
+	virtual const vector<double> *getScalars() const { return NULL; }
+	// The same for a tuple of tuples of numbers that are all width long,
+	// with the numbers of all of them one after the other.
+	virtual const vector<double> *getScalarRows( size_t& width ) const { return NULL; }
 	virtual const dict&  getDict() const 
 	{ throw ObjTypeMismatch( string( "dict" ), getTypeName() ); }
 
@@ -194,6 +200,76 @@ private:
 	mytuple val;
 };
 
+// A tuple of numbers only, like a point or a face, or a tuple of such
+// tuples that are all the same length, like the points or faces of a mesh.
+// The parser makes these instead of TupleObjs of ScalarObjs, which saves an
+// allocation per number in big meshes; the numbers are kept in one array,
+// a row of width numbers per inner tuple.  The objects getTuple() returns
+// are only made if it is called.
+class ScalarTupleObj
+	: public Obj
+{
+public:
+	// Takes the numbers out of v, which is left empty.
+	ScalarTupleObj( vector<double>& v, size_t w = 0 )
+		: Obj()
+		, width( w )
+	{
+		val.swap( v );
+	}
+	virtual ~ScalarTupleObj()
+	{
+		for( mytuple::iterator i = tuple.begin(); i != tuple.end(); ++i ) {
+			delete (*i);
+		}
+	}
+
+	virtual string getTypeName() const { return string( "tuple" ); }
+	virtual void printOn( ostream& os ) const 
+	{ 
+		const mytuple& t = getTuple();
+		os << '(';
+		for( size_t idx = 0; idx < t.size(); ++idx ) {
+			if( idx > 0 ) {
+				os << ", ";
+			}
+			t[ idx ]->printOn( os );
+		}
+		os << ')';
+	}
+
+	virtual const mytuple& getTuple() const
+	{
+		if( tuple.empty() ) {
+			if( width == 0 ) {
+				for( size_t idx = 0; idx < val.size(); ++idx ) {
+					tuple.push_back( new ScalarObj( val[ idx ] ) );
+				}
+			} else {
+				for( size_t idx = 0; idx < val.size(); idx += width ) {
+					vector<double> row( val.begin() + idx, val.begin() + idx + width );
+					tuple.push_back( new ScalarTupleObj( row ) );
+				}
+			}
+		}
+		return tuple;
+	}
+	virtual const vector<double> *getScalars() const
+	{
+		return width == 0 ? &val : NULL;
+	}
+	virtual const vector<double> *getScalarRows( size_t& w ) const
+	{
+		w = width;
+		return width > 0 ? &val : NULL;
+	}
+
+private:
+	vector<double> val;
+	size_t width;
+	mutable mytuple tuple;
+};
+
 class DictObj
 	: public Obj
 {
@@ -261,6 +337,22 @@ private:
 	Obj *child;
 };
 
-Obj *readFile( istream& is );
+// The text being parsed, held in memory: usually a mapped scene file.
+// The parser walks it with a pointer rather than through a stream.
+struct ParseBuffer
+{
+	ParseBuffer( const char *b, const char *e )
+		: cur( b ), end( e )
+	{}
+
+	const char *cur;
+	const char *end;
+};
+
+// Read the next object out of buf, or return NULL at the end of it.
+Obj *readFile( ParseBuffer& buf );
+
+// Parse the number in [begin, end), giving exactly what atof() would.
+double parseScalar( const char *begin, const char *end );
 
 #endif // __PARSE_H__
@@ -2,105 +2,157 @@
 #pragma warning( disable : 4786 )
 #endif
 
+#include <cctype>
 #include <cmath>
 #include <cstring>
-#include <fstream>
-#include <strstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
 
 #include <vector>
 
 #include "read.h"
+#include "bitmap.h"
 #include "parse.h"
+#include "compiled.h"
+#include "mappedfile.h"
+#include "meshfile.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
 #include "../SceneObjects/Box.h"
+#include "../SceneObjects/CSG.h"
 #include "../SceneObjects/Cone.h"
 #include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Heightfield.h"
+#include "../SceneObjects/Metaball.h"
 #include "../SceneObjects/Sphere.h"
 #include "../SceneObjects/Square.h"
 #include "../SceneObjects/Torus.h"
 #include "../scene/light.h"
-#include "../ui/TraceUI.h"
-
-extern TraceUI *traceUI;
 
 typedef map<string,Material*> mmap;
+typedef map<string,Trimesh*> tmap;
 
-static Geometry* processObject( Obj *obj, Scene *scene, mmap& materials, const bool addToScene );
+static Geometry* processObject( Obj *obj, Scene *scene, mmap& materials, tmap& meshes,
+	const string& directory, const bool addToScene );
 static Obj *getColorField( Obj *obj );
 static Obj *getField( Obj *obj, const string& name );
 static bool hasField( Obj *obj, const string& name );
 static vec3f tupleToVec( Obj *obj );
 static Geometry *processGeometry( string name, Obj *child, Scene *scene,
-	mmap& materials, TransformNode *transform, const bool addToScene );
-static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform );
+	mmap& materials, tmap& meshes, const string& directory, TransformNode *transform,
+	const bool addToScene );
+static Trimesh *processTrimesh( string name, Obj *child, Scene *scene,
+                                     const mmap& materials, tmap& meshes, TransformNode *transform, bool addToScene );
+static Trimesh *processMeshFile( Obj *child, Scene *scene, const mmap& materials,
+	tmap& meshes, const string& directory, TransformNode *transform, bool addToScene );
+static Geometry *processCSG( string name, Obj *child, Scene *scene, mmap& materials,
+	tmap& meshes, const string& directory, TransformNode *transform, bool addToScene );
+static Heightfield *processHeightField( Obj *child, Scene *scene, Material *mat,
+	const string& directory );
+static Metaball *processMetaball( Obj *child, Scene *scene, Material *mat );
 static void processCamera( Obj *child, Scene *scene );
 static Material *getMaterial( Obj *child, const mmap& bindings );
 static Material *processMaterial( Obj *child, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
+static void verifyTuple( size_t tupSize, size_t size );
+static Scene *readScene( ParseBuffer& buf, const string& directory );
 
-Scene *readScene( const string& filename )
+// Report a scene that couldn't be read, through error if it was given
+// and on os otherwise.
+static void reportReadError( const string& msg, string *error, ostream& os = cout )
 {
-	ifstream ifs( filename.c_str() );
-	if( !ifs ) {
-		cerr << "Error: couldn't read scene file " << filename << endl;
+	if( error )
+		*error = msg;
+	else
+		os << msg << endl;
+}
+
+Scene *readScene( const string& filename, string *error )
+{
+	if( isCompiledScene( filename ) ) {
+		try {
+			return readCompiledScene( filename );
+		} catch( ParseError& pe ) {
+			reportReadError( "Parse error: " + pe.getMsg(), error );
+			return NULL;
+		}
+	}
+
+	MappedFile file;
+	if( !file.open( filename.c_str() ) ) {
+		reportReadError( "Error: couldn't read scene file " + filename, error, cerr );
 		return NULL;
 	}
 
+	// the files the scene names are found relative to its directory
+	const size_t slash = filename.find_last_of( "/\\" );
+	const string directory = slash == string::npos ? "" : filename.substr( 0, slash + 1 );
+
 	try {
-		return readScene( ifs );
+		ParseBuffer buf( file.data(), file.data() + file.size() );
+		return readScene( buf, directory );
 	} catch( ParseError& pe ) {
-		cout << "Parse error: " << pe << endl;
+		reportReadError( "Parse error: " + pe.getMsg(), error );
 		return NULL;
 	}
 }
 
 Scene *readScene( istream& is )
+{
+	// The parser works on text in memory, so read it all in first.
+	string text( (istreambuf_iterator<char>( is )), istreambuf_iterator<char>() );
+	ParseBuffer buf( text.data(), text.data() + text.size() );
+	return readScene( buf, "" );
+}
+
+// directory is where the files the scene names are found, ending in a
+// slash, or empty for the current directory.
+static Scene *readScene( ParseBuffer& buf, const string& directory )
 {
 	Scene *ret = new Scene;
 	
 	// Extract the file header
 	static const int MAXNAME = 80;
-	char buf[ MAXNAME ];
-	int ct = 0;
+	const char *name = buf.cur;
 
-	while( ct < MAXNAME - 1 ) {
-		char c;
-		is.get( c );
-		if( c == ' ' || c == '\t' || c == '\n' ) {
-			break;
-		}
-		buf[ ct++ ] = c;
+	while( buf.cur < buf.end && buf.cur - name < MAXNAME - 1 &&
+			*buf.cur != ' ' && *buf.cur != '\t' && *buf.cur != '\n' ) {
+		++buf.cur;
 	}
 
-	buf[ ct ] = '\0';
-
-	if( strcmp( buf, "SBT-raytracer" ) ) {
+	if( string( name, buf.cur ) != "SBT-raytracer" ) {
 		throw ParseError( string( "Input is not an SBT input file." ) );
 	}
 
-	float version;
-	is >> version;
+	while( buf.cur < buf.end && isspace( (unsigned char)*buf.cur ) ) {
+		++buf.cur;
+	}
+	const char *number = buf.cur;
+	while( buf.cur < buf.end && strchr( "+-.eE0123456789", *buf.cur ) != NULL ) {
+		++buf.cur;
+	}
+	float version = (float)parseScalar( number, buf.cur );
 
 	if( version != 1.0 ) {
-		ostrstream oss;
-		oss << "Input is version " << version << ", need version 1.0" << ends;
+		ostringstream oss;
+		oss << "Input is version " << version << ", need version 1.0";
 
-		throw ParseError( string( oss.str() ) );
+		throw ParseError( oss.str() );
 	}
 
 	// vector<Obj*> result;
 	mmap materials;
+	tmap meshes;
 
 	while( true ) {
-		Obj *cur = readFile( is );
+		Obj *cur = readFile( buf );
 		if( !cur ) {
 			break;
 		}
 
-		processObject( cur, ret, materials, true);
+		processObject( cur, ret, materials, meshes, directory, true );
 		delete cur;
 	}
 
@@ -161,13 +213,19 @@ static bool hasField( Obj *obj, const string& name )
 // Turn a parsed tuple into a 3D point.
 static vec3f tupleToVec( Obj *obj )
 {
+	const vector<double> *v = obj->getScalars();
+	if( v != NULL ) {
+		verifyTuple( v->size(), 3 );
+		return vec3f( (*v)[0], (*v)[1], (*v)[2] );
+	}
+
 	const mytuple& t = obj->getTuple();
 	verifyTuple( t, 3 );
 	return vec3f( t[0]->getScalar(), t[1]->getScalar(), t[2]->getScalar() );
 }
 
-static Geometry *processGeometry( Obj *obj, Scene *scene,
-	mmap& materials, TransformNode *transform, bool addToScene = true)
+static Geometry *processGeometry( Obj *obj, Scene *scene, mmap& materials, tmap& meshes,
+	const string& directory, TransformNode *transform, bool addToScene = true)
 {
 	string name;
 	Obj *child; 
@@ -179,14 +237,14 @@ static Geometry *processGeometry( Obj *obj, Scene *scene,
 		name = obj->getName();
 		child = obj->getChild();
 	} else {
-		ostrstream oss;
+		ostringstream oss;
 		oss << "Unknown input object ";
 		obj->printOn( oss );
 
-		throw ParseError( string( oss.str() ) );
+		throw ParseError( oss.str() );
 	}
 
-	return processGeometry( name, child, scene, materials, transform, addToScene);
+	return processGeometry( name, child, scene, materials, meshes, directory, transform, addToScene);
 }
 
 // Extract the named scalar field into ret, if it exists.
@@ -216,16 +274,22 @@ static bool maybeExtractField( Obj *child, const string& name, bool& ret )
 // Check that a tuple has the expected size.
 static void verifyTuple( const mytuple& tup, size_t size )
 {
-	if( tup.size() != size ) {
-		ostrstream oss;
-		oss << "Bad tuple size " << tup.size() << ", expected " << size;
+	verifyTuple( tup.size(), size );
+}
+
+static void verifyTuple( size_t tupSize, size_t size )
+{
+	if( tupSize != size ) {
+		ostringstream oss;
+		oss << "Bad tuple size " << tupSize << ", expected " << size;
 
-		throw ParseError( string( oss.str() ) );
+		throw ParseError( oss.str() );
 	}
 }
 
 static Geometry *processGeometry( string name, Obj *child, Scene *scene,
-	mmap& materials, TransformNode *transform, const bool addToScene = true)
+	mmap& materials, tmap& meshes, const string& directory, TransformNode *transform,
+	const bool addToScene = true)
 {
 	if( name == "translate" ) {
 		const mytuple& tup = child->getTuple();
@@ -233,35 +297,47 @@ static Geometry *processGeometry( string name, Obj *child, Scene *scene,
         return processGeometry( tup[3],
                          scene,
                          materials,
+                         meshes,
+                         directory,
                          transform->createChild(mat4f::translate( vec3f(tup[0]->getScalar(), 
                                                                         tup[1]->getScalar(), 
-                                                                        tup[2]->getScalar() ) ) ) );
+                                                                        tup[2]->getScalar() ) ) ),
+                         addToScene );
 	} else if( name == "rotate" ) {
 		const mytuple& tup = child->getTuple();
 		verifyTuple( tup, 5 );
 		return processGeometry( tup[4],
                          scene,
                          materials,
+                         meshes,
+                         directory,
                          transform->createChild(mat4f::rotate( vec3f(tup[0]->getScalar(),
                                                                      tup[1]->getScalar(),
                                                                      tup[2]->getScalar() ),
-                                                               tup[3]->getScalar() ) ) );
+                                                               tup[3]->getScalar() ) ),
+                         addToScene );
 	} else if( name == "scale" ) {
 		const mytuple& tup = child->getTuple();
 		if( tup.size() == 2 ) {
 			double sc = tup[0]->getScalar();
-			processGeometry( tup[1],
+			return processGeometry( tup[1],
                              scene,
                              materials,
-                             transform->createChild(mat4f::scale( vec3f( sc, sc, sc ) ) ) );
+                             meshes,
+                             directory,
+                             transform->createChild(mat4f::scale( vec3f( sc, sc, sc ) ) ),
+                             addToScene );
 		} else {
 			verifyTuple( tup, 4 );
-			processGeometry( tup[3],
+			return processGeometry( tup[3],
                              scene,
                              materials,
+                             meshes,
+                             directory,
                              transform->createChild(mat4f::scale( vec3f(tup[0]->getScalar(),
                                                                         tup[1]->getScalar(),
-                                                                        tup[2]->getScalar() ) ) ) );
+                                                                        tup[2]->getScalar() ) ) ),
+                             addToScene );
 		}
 	} else if( name == "transform" ) {
 		const mytuple& tup = child->getTuple();
@@ -276,9 +352,11 @@ static Geometry *processGeometry( string name, Obj *child, Scene *scene,
 		verifyTuple( l3, 4 );
 		verifyTuple( l4, 4 );
 
-		processGeometry( tup[4],
+		return processGeometry( tup[4],
 			             scene,
                          materials,
+                         meshes,
+                         directory,
                          transform->createChild(mat4f(vec4f( l1[0]->getScalar(),
                                                              l1[1]->getScalar(),
                                                              l1[2]->getScalar(),
@@ -294,21 +372,14 @@ static Geometry *processGeometry( string name, Obj *child, Scene *scene,
                                                       vec4f( l4[0]->getScalar(),
                                                              l4[1]->getScalar(),
                                                              l4[2]->getScalar(),
-                                                             l4[3]->getScalar() ) ) ) );
-	} else if (name == "subtraction") {
-		const mytuple &tup = child->getTuple();
-		verifyTuple(tup, 2);
-
-		SubtractNode *node = new SubtractNode(scene, 
-											  dynamic_cast<SceneObject *>(processObject(tup[0], scene, materials, false)),
-											  dynamic_cast<SceneObject *>(processObject(tup[1], scene, materials, false)));
-		node->setTransform(transform);
-
-		if (addToScene) scene->add(node);
-
-		return node;
+                                                             l4[3]->getScalar() ) ) ),
+                         addToScene );
+	} else if( name == "subtraction" || name == "union" || name == "intersection" ) {
+		return processCSG( name, child, scene, materials, meshes, directory, transform, addToScene );
 	} else if (name == "trimesh" || name == "polymesh") { // 'polymesh' is for backwards compatibility
-        processTrimesh( name, child, scene, materials, transform);
+        return processTrimesh( name, child, scene, materials, meshes, transform, addToScene );
+    } else if( name == "mesh_file" ) {
+		return processMeshFile( child, scene, materials, meshes, directory, transform, addToScene );
     } else {
 		SceneObject *obj = NULL;
        	Material *mat;
@@ -348,10 +419,16 @@ static Geometry *processGeometry( string name, Obj *child, Scene *scene,
 			maybeExtractField(child, "B", B);
 
 			obj = new Torus(scene, mat, A, B);
+		} else if( name == "height_field" ) {
+			obj = processHeightField( child, scene, mat, directory );
+		} else if( name == "metaball" ) {
+			obj = processMetaball( child, scene, mat );
+		} else {
+			throw ParseError( string( "Unrecognized object: " ) + name );
 		}
 
         obj->setTransform(transform);
-		scene->add(obj);
+		if (addToScene) scene->add(obj);
 
 		return obj;
 	}
@@ -359,9 +436,119 @@ static Geometry *processGeometry( string name, Obj *child, Scene *scene,
 	return nullptr;
 }
 
-static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform )
+// Turn a parsed tuple of 3-tuples into points.  The points and normals
+// of a mesh usually come as one array of numbers, read without an Obj per
+// point.
+static void tupleToVecs( Obj *obj, vector<vec3f>& vecs )
 {
+	size_t width;
+	const vector<double> *rows = obj->getScalarRows( width );
+	if( rows != NULL ) {
+		verifyTuple( width, 3 );
+		vecs.reserve( rows->size() / 3 );
+		for( size_t k = 0; k < rows->size(); k += 3 ) {
+			vecs.push_back( vec3f( (*rows)[k], (*rows)[k+1], (*rows)[k+2] ) );
+		}
+		return;
+	}
+
+	const mytuple& t = obj->getTuple();
+	vecs.reserve( t.size() );
+	for( mytuple::const_iterator i = t.begin(); i != t.end(); ++i ) {
+		vecs.push_back( tupleToVec( *i ) );
+	}
+}
+
+// Add a face of count vertices to tmesh.  We triangulate here and now,
+// assuming the poly is concave and we can triangulate using an arbitrary
+// fan.
+static void addFace( Trimesh *tmesh, const double *ids, size_t count )
+{
+	if( count < 3 ) {
+		throw ParseError( "Faces must have at least 3 vertices." );
+	}
+
+	int a = (int)ids[0];
+	int b = (int)ids[1];
+	for( size_t i = 2; i < count; ++i ) {
+		int c = (int)ids[i];
+		if( !tmesh->addFace( a, b, c ) ) {
+			throw ParseError( "Bad face in trimesh." );
+		}
+		b = c;
+	}
+}
+
+// Add the faces in a parsed tuple of vertex index tuples to tmesh.
+static void addFaces( Trimesh *tmesh, Obj *faces )
+{
+	size_t width;
+	const vector<double> *rows = faces->getScalarRows( width );
+	if( rows != NULL ) {
+		for( size_t k = 0; k < rows->size(); k += width ) {
+			addFace( tmesh, &(*rows)[k], width );
+		}
+		return;
+	}
+
+	// faces of different sizes, or with something other than numbers in
+	// them (which getScalar() will complain about)
+	const mytuple& t = faces->getTuple();
+	vector<double> ids;
+	for( mytuple::const_iterator fi = t.begin(); fi != t.end(); ++fi ) {
+		const vector<double> *scalars = (*fi)->getScalars();
+		if( scalars == NULL ) {
+			const mytuple& pointids = (*fi)->getTuple();
+			ids.clear();
+			for( mytuple::const_iterator i = pointids.begin(); i != pointids.end(); ++i ) {
+				ids.push_back( (*i)->getScalar() );
+			}
+			scalars = &ids;
+		}
+		addFace( tmesh, scalars->empty() ? NULL : &(*scalars)[0], scalars->size() );
+	}
+}
+
+// A trimesh with a "name" field and points binds its geometry to the
+// name; one with only a name places another copy of that geometry, so
+//
+//   trimesh { name = "tree"; points = ...; faces = ...; material = ...; }
+//   translate( 5,0,0, trimesh { name = "tree"; } )
+//
+// gives two trees that share one set of vertices, faces and face
+// hierarchy.  A copy uses its own material if it has one and the
+// original's otherwise.
+static Trimesh *processTrimesh( string name, Obj *child, Scene *scene,
+                                     const mmap& materials, tmap& meshes, TransformNode *transform, bool addToScene )
+{
+    string meshName;
+    if( hasField( child, "name" ) )
+    {
+        Obj *field = getField( child, "name" );
+        if( field->getTypeName() == "id" )
+            meshName = field->getID();
+        else
+            meshName = field->getString();
+    }
+
+    if( !meshName.empty() && !hasField( child, "points" ) )
+    {
+        tmap::const_iterator i = meshes.find( meshName );
+        if( i == meshes.end() )
+            throw ParseError( string( "Unknown trimesh: " ) + meshName );
+
+        Material *mat;
+        if( hasField( child, "material" ) )
+            mat = getMaterial( getField( child, "material" ), materials );
+        else
+            mat = new Material( i->second->getMaterial() );
+
+        Trimesh *copy = new Trimesh( scene, mat, transform, *i->second );
+        if( addToScene )
+            scene->add( copy );
+        return copy;
+    }
+
     Material *mat;
     
     if( hasField( child, "material" ) )
@@ -371,31 +558,12 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     
     Trimesh *tmesh = new Trimesh( scene, mat, transform);
 
-    const mytuple &points = getField( child, "points" )->getTuple();
-    for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
-        tmesh->addVertex( tupleToVec( *pi ) );
-                
-    const mytuple &faces = getField( child, "faces" )->getTuple();
-    for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
-    {
-        const mytuple &pointids = (*fi)->getTuple();
-
-        // triangulate here and now.  assume the poly is
-        // concave and we can triangulate using an arbitrary fan
-        if( pointids.size() < 3 )
-            throw ParseError( "Faces must have at least 3 vertices." );
-
-        mytuple::const_iterator i = pointids.begin();
-        int a = (int) (*i++)->getScalar();
-        int b = (int) (*i++)->getScalar();
-        while( i != pointids.end() )
-        {
-            int c = (int) (*i++)->getScalar();
-            if( !tmesh->addFace(a,b,c) )
-                throw ParseError( "Bad face in trimesh." );
-            b = c;
-        }
-    }
+    vector<vec3f> points;
+    tupleToVecs( getField( child, "points" ), points );
+    for( size_t k = 0; k < points.size(); ++k )
+        tmesh->addVertex( points[k] );
+
+    addFaces( tmesh, getField( child, "faces" ) );
 
     bool generateNormals = false;
     maybeExtractField( child, "gennormals", generateNormals );
@@ -410,16 +578,233 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     }
     if( hasField( child, "normals" ) )
     {
-        const mytuple &norms = getField( child, "normals" )->getTuple();
-        for( mytuple::const_iterator ni = norms.begin(); ni != norms.end(); ++ni )
-            tmesh->addNormal( tupleToVec( *ni ) );
+        vector<vec3f> norms;
+        tupleToVecs( getField( child, "normals" ), norms );
+        for( size_t k = 0; k < norms.size(); ++k )
+            tmesh->addNormal( norms[k] );
     }
 
     char *error;
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
-    scene->add(tmesh);
+    if( addToScene )
+        scene->add(tmesh);
+    if( !meshName.empty() )
+        meshes[ meshName ] = tmesh;
+    return tmesh;
+}
+
+// A path given in the scene file: a relative one is taken from directory,
+// the scene file's.
+static string scenePath( const string& directory, const string& path )
+{
+	const bool absolute = !path.empty() &&
+		(path[0] == '/' || path[0] == '\\' || path.find( ':' ) != string::npos);
+	return absolute ? path : directory + path;
+}
+
+// A mesh read from an OBJ or PLY file (see meshfile.h):
+//
+//   mesh_file { path = "bunny.ply"; material = { ... }; gennormals = true; }
+//
+// The path is taken from the directory of the scene file unless it is
+// absolute.  The file's own normals are used unless gennormals is given.
+// Like a trimesh it may have a name, and trimeshes with only that name
+// place copies of it.
+static Trimesh *processMeshFile( Obj *child, Scene *scene, const mmap& materials,
+	tmap& meshes, const string& directory, TransformNode *transform, bool addToScene )
+{
+	const string path = scenePath( directory, getField( child, "path" )->getString() );
+
+	Material *mat;
+	if( hasField( child, "material" ) ) {
+		mat = getMaterial( getField( child, "material" ), materials );
+	} else {
+		mat = new Material();
+	}
+
+	// held here until it is read, so that a bad file doesn't leak it
+	unique_ptr<Trimesh> reading( new Trimesh( scene, mat, transform ) );
+	readMeshFile( path, reading->getGeometry() );
+
+	bool generateNormals = false;
+	maybeExtractField( child, "gennormals", generateNormals );
+	if( generateNormals ) {
+		reading->getGeometry().normals.clear();
+		reading->generateNormals();
+	}
+
+	Trimesh *tmesh = reading.release();
+	if( addToScene ) {
+		scene->add( tmesh );
+	}
+
+	if( hasField( child, "name" ) ) {
+		Obj *field = getField( child, "name" );
+		if( field->getTypeName() == "id" ) {
+			meshes[ field->getID() ] = tmesh;
+		} else {
+			meshes[ field->getString() ] = tmesh;
+		}
+	}
+	return tmesh;
+}
+
+// Constructive solid geometry (see CSG.h) of two or more objects, which
+// may be transformed or be CSG themselves, more than two being combined
+// as a balanced tree:
+//
+//   union( a, b, ... )
+//   intersection( a, b, ... )
+//   subtraction( a, b, ... )    a less all the others
+//
+// The objects are only part of the result, not in the scene themselves.
+static Geometry *processCSG( string name, Obj *child, Scene *scene, mmap& materials,
+	tmap& meshes, const string& directory, TransformNode *transform, bool addToScene )
+{
+	const mytuple& tup = child->getTuple();
+	if( tup.size() < 2 ) {
+		throw ParseError( name + " needs at least two objects." );
+	}
+
+	// Nested CSG of the same kind is taken apart and built again as one
+	// tree, so that a long chain like ((a - b) - c) - ... is no deeper than
+	// a - (b + c + ...) would be.
+	const CSGOperation op = name == "union" ? CSG_UNION :
+		name == "intersection" ? CSG_INTERSECTION : CSG_DIFFERENCE;
+	vector<SceneObject *> objs;
+	for( size_t k = 0; k < tup.size(); ++k ) {
+		SceneObject *obj = dynamic_cast<SceneObject *>(
+			processGeometry( tup[k], scene, materials, meshes, directory, transform, false ) );
+		if( !obj ) {
+			throw ParseError( string( "Only objects can be combined by " ) + name + "." );
+		}
+
+		if( op != CSG_DIFFERENCE ) {
+			CSGNode::split( obj, op, objs );
+		} else if( k == 0 ) {
+			CSGNode::split( obj, CSG_DIFFERENCE, objs );
+		} else {
+			objs.push_back( obj );
+		}
+	}
+
+	SceneObject *node;
+	if( op == CSG_DIFFERENCE ) {
+		vector<SceneObject *> rest;
+		for( size_t k = 1; k < objs.size(); ++k ) {
+			CSGNode::split( objs[k], CSG_UNION, rest );
+		}
+		CSGNode *difference = new CSGNode( scene, CSG_DIFFERENCE, objs[0],
+			CSGNode::join( scene, CSG_UNION, rest, transform ) );
+		difference->setTransform( transform );
+		node = difference;
+	} else {
+		node = CSGNode::join( scene, op, objs, transform );
+	}
+
+	if( addToScene ) {
+		scene->add( node );
+	}
+	return node;
+}
+
+// A height field from the red value of every pixel of a 24 bit BMP (see
+// Heightfield.h):
+//
+//   height_field { path = "hf_512_grey_.bmp"; size = (4, 4); material = { ... }; }
+//
+// Black is height 0 and full red height 1, and the field covers size in
+// x and z, the unit square if it is not given.  The path is taken from
+// the directory of the scene file unless it is absolute.
+static Heightfield *processHeightField( Obj *child, Scene *scene, Material *mat,
+	const string& directory )
+{
+	const string path = scenePath( directory, getField( child, "path" )->getString() );
+
+	int width, depth;
+	vector<char> name( path.begin(), path.end() );
+	name.push_back( '\0' );
+	unsigned char *image = readBMP( &name[0], width, depth );
+	if( !image ) {
+		throw ParseError( string( "Can't read height field image: " ) + path );
+	}
+	if( width < 2 || depth < 2 ) {
+		delete [] image;
+		throw ParseError( string( "Height field image is smaller than 2x2: " ) + path );
+	}
+
+	vector<float> heights( width * depth );
+	for( size_t k = 0; k < heights.size(); ++k ) {
+		heights[k] = image[ k * 3 ] / 255.f;
+	}
+	delete [] image;
+
+	double sizeX = 1.0;
+	double sizeZ = 1.0;
+	if( hasField( child, "size" ) ) {
+		const mytuple& size = getField( child, "size" )->getTuple();
+		verifyTuple( size, 2 );
+		sizeX = size[0]->getScalar();
+		sizeZ = size[1]->getScalar();
+	}
+
+	return new Heightfield( scene, mat, width, depth, heights, sizeX, sizeZ );
+}
+
+// Metaballs (see Metaball.h):
+//
+//   metaball { gridSize = 30; size = 3.0; ball = ((0,0,0,1), (1.5,-1.5,1.5,1)); material = { ... }; }
+//
+// Each ball is its center and radius.  gridSize is the number of cells
+// along each side of the grid the balls are sorted into, 16 if it is not
+// given, and size, if given, cuts the surface off at the cube from -size
+// to size.
+static Metaball *processMetaball( Obj *child, Scene *scene, Material *mat )
+{
+	double gridSize = 16;
+	double size = 0;
+	maybeExtractField( child, "gridSize", gridSize );
+	maybeExtractField( child, "size", size );
+	if( gridSize < 1 || gridSize > 256 ) {
+		throw ParseError( "Metaball gridSize must be from 1 to 256." );
+	}
+
+	// one ball is a 4-tuple, more are a tuple of them
+	Obj *field = getField( child, "ball" );
+	vector<double> values;
+	size_t width;
+	if( const vector<double> *rows = field->getScalarRows( width ) ) {
+		verifyTuple( width, 4 );
+		values = *rows;
+	} else if( const vector<double> *one = field->getScalars() ) {
+		verifyTuple( one->size(), 4 );
+		values = *one;
+	} else {
+		const mytuple& tup = field->getTuple();
+		for( mytuple::const_iterator i = tup.begin(); i != tup.end(); ++i ) {
+			const mytuple& ball = (*i)->getTuple();
+			verifyTuple( ball, 4 );
+			for( size_t k = 0; k < 4; ++k ) {
+				values.push_back( ball[k]->getScalar() );
+			}
+		}
+	}
+
+	vector<Metaball::Ball> balls( values.size() / 4 );
+	if( balls.empty() ) {
+		throw ParseError( "Metaball has no balls." );
+	}
+	for( size_t k = 0; k < balls.size(); ++k ) {
+		balls[k].center = vec3f( values[ 4 * k ], values[ 4 * k + 1 ], values[ 4 * k + 2 ] );
+		balls[k].radius = values[ 4 * k + 3 ];
+		if( balls[k].radius <= 0 ) {
+			throw ParseError( "Metaball radius must be positive." );
+		}
+	}
+
+	return new Metaball( scene, mat, balls, (int)gridSize, size );
 }
 
 static Material *getMaterial( Obj *child, const mmap& bindings )
@@ -526,7 +911,8 @@ processCamera( Obj *child, Scene *scene )
     }
 }
 
-static Geometry *processObject( Obj *obj, Scene *scene, mmap& materials, const bool addToScene = true )
+static Geometry *processObject( Obj *obj, Scene *scene, mmap& materials, tmap& meshes,
+	const string& directory, const bool addToScene = true )
 {
 	// Assume the object is named.
 	string name;
@@ -539,11 +925,11 @@ static Geometry *processObject( Obj *obj, Scene *scene, mmap& materials, const b
 		name = obj->getName();
 		child = obj->getChild();
 	} else {
-		ostrstream oss;
+		ostringstream oss;
 		oss << "Unknown input object ";
 		obj->printOn( oss );
 
-		throw ParseError( string( oss.str() ) );
+		throw ParseError( oss.str() );
 	}
 
 	if( name == "directional_light" ) {
@@ -628,8 +1014,14 @@ static Geometry *processObject( Obj *obj, Scene *scene, mmap& materials, const b
 				name == "transform" ||
                 name == "trimesh" ||
                 name == "polymesh" ||
-				name == "torus") { // polymesh is for backwards compatibility.
-		return processGeometry( name, child, scene, materials, &scene->transformRoot, addToScene);
+				name == "mesh_file" ||
+				name == "torus" ||
+				name == "height_field" ||
+				name == "metaball" ||
+				name == "subtraction" ||
+				name == "union" ||
+				name == "intersection") { // polymesh is for backwards compatibility.
+		return processGeometry( name, child, scene, materials, meshes, directory, &scene->transformRoot, addToScene);
 		//scene->add( geo );
 	} else if( name == "material" ) {
 		processMaterial( child, &materials );
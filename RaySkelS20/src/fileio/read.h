@@ -6,7 +6,10 @@
 
 #include "../scene/scene.h"
 
-Scene *readScene( const string& filename );
+// Read a scene from a .ray file or a compiled scene.  Returns NULL if it
+// can't be read, putting the reason in error, or printing it if error is
+// NULL.
+Scene *readScene( const string& filename, string *error = NULL );
 Scene *readScene( istream& is );
 
 #endif // __READ_H__
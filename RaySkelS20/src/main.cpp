@@ -13,7 +13,7 @@
 //  |
 //  +- RayTracer::traceSetup
 //  |
-//  +- RayTracer::traceLines
+//  +- RayTracer::traceLines (or RayTracer::traceTiles with -j)
 //        |
 //        +- RayTracer::tracePixel
 //              |
@@ -55,7 +55,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <chrono>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -67,6 +69,10 @@
 #include "RayTracer.h"
 
 #include "fileio/bitmap.h"
+#include "fileio/heatmap.h"
+#include "fileio/read.h"
+#include "fileio/parse.h"
+#include "fileio/compiled.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -86,31 +92,50 @@ TraceUI* traceUI;
 int recursion_depth = 0;
 int g_height;
 int g_width = 150;
+int g_threads = 1;
 bool bReport = false;
-char *progname, *rayName, *imgName;
+bool bCostMap = false;
+bool bAccelCache = true;
+BVHBuildMode g_buildMode = BVH_BUILD_SAH;
+char *progname, *rayName, *imgName, *compiledName;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -j <#> -a sah|lbvh -t -c -C] [input.ray output.bmp]\n"
+		"       %s -s output.rayb input.ray\n", progname, progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
+	fprintf( stderr, "       %s -s output.rayb input.ray\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
-	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -j <#>      number of render threads (default %d)\n", g_threads );
+	fprintf( stderr, "  -a sah|lbvh build the BVH with binned SAH (default) or as a linear BVH\n" );
+	fprintf( stderr, "  -t			report time and ray statistics\n" );
+	fprintf( stderr, "  -c			also write per-pixel cost maps next to the output\n" );
+	fprintf( stderr, "  -C			don't read or write the BVH cache (input.ray.accel)\n" );
+	fprintf( stderr, "  -s <file>   compile the input to a binary scene, which loads much faster\n" );
 #endif
 }
 
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tcCr:w:h:j:a:s:" )) != EOF )
 	{
 		switch ( i )
 		{
 			case 't':
 			bReport = true;
 			break;
+
+			case 'c':
+			bCostMap = true;
+			break;
+
+			case 'C':
+			bAccelCache = false;
+			break;
 	    
 			case 'r':
 			recursion_depth = atoi( optarg );
@@ -124,11 +149,36 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'j':
+			g_threads = atoi( optarg );
+			if ( g_threads < 1 )
+				return false;
+			break;
+
+			case 'a':
+			if ( strcmp( optarg, "sah" ) == 0 )
+				g_buildMode = BVH_BUILD_SAH;
+			else if ( strcmp( optarg, "lbvh" ) == 0 )
+				g_buildMode = BVH_BUILD_LBVH;
+			else
+				return false;
+			break;
+
+			case 's':
+			compiledName = optarg;
+			break;
+
 			default:
 			return false;
 		}
     }
 
+	if ( compiledName && optind < argc )
+	{
+		rayName = argv[optind];
+		return true;
+	}
+
     if ( optind >= argc-1 )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
@@ -141,6 +191,50 @@ bool processArgs(int argc, char **argv) {
 	return true;
 }
 
+// Write the per-pixel costs of a render next to the output image: one
+// false-colour map per cost (out_rays.bmp, out_tests.bmp, out_time.bmp
+// for out.bmp) and all of them as raw floats in out_cost.raw, three per
+// pixel (rays, intersection tests, nanoseconds) in the image's row order.
+void writeCostMaps(const float *cost, int width, int height)
+{
+	if (!cost)
+		return;
+
+	string base = imgName;
+	if (base.size() > 4 && base.compare(base.size() - 4, 4, ".bmp") == 0)
+		base.erase(base.size() - 4);
+
+	static const char *names[NUM_PIXEL_COSTS] = { "_rays.bmp", "_tests.bmp", "_time.bmp" };
+	for (int k = 0; k < NUM_PIXEL_COSTS; ++k) {
+		string fn = base + names[k];
+		writeHeatmap(&fn[0], width, height, cost + k, NUM_PIXEL_COSTS);
+	}
+
+	string raw = base + "_cost.raw";
+	if (!writeFloats(raw.c_str(), cost, (size_t)width * height * NUM_PIXEL_COSTS))
+		fprintf( stderr, "can't write %s\n", raw.c_str() );
+}
+
+// Load rayName and write it out as the compiled scene compiledName.
+int compileScene()
+{
+	Scene *scene = readScene( rayName );
+	if( !scene )
+		return 1;
+
+	try {
+		if( !writeCompiledScene( scene, compiledName ) ) {
+			fprintf( stderr, "can't write %s\n", compiledName );
+			return 1;
+		}
+	} catch( ParseError& pe ) {
+		fprintf( stderr, "%s\n", pe.getMsg().c_str() );
+		return 1;
+	}
+
+	return 0;
+}
+
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
@@ -158,21 +252,40 @@ int main(int argc, char **argv) {
 			usage();
 			exit(1);
 		}
+
+		if (compiledName)
+			return compileScene();
 		
 		theRayTracer=new RayTracer();
-		theRayTracer->loadScene(rayName);
+		theRayTracer->setBuildMode(g_buildMode);
+		theRayTracer->setAccelCache(bAccelCache);
+		if (!theRayTracer->loadScene(rayName) && !theRayTracer->getLoadError().empty()) {
+#ifdef WIN32
+			fl_alert( "%s\n", theRayTracer->getLoadError().c_str() );
+#else
+			fprintf( stderr, "%s\n", theRayTracer->getLoadError().c_str() );
+#endif
+		}
 	
 		if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
-			theRayTracer->traceSetup(g_width, g_height);
+			RenderSettings settings;
+			settings.depth = recursion_depth;
+			settings.costMap = bCostMap;
+
+			theRayTracer->traceSetup(g_width, g_height, settings);
 		
-			clock_t start, end;
-			start=clock();
+			// wall clock time, since clock() adds up the time of every thread
+			chrono::steady_clock::time_point start, end;
+			start=chrono::steady_clock::now();
 
-			theRayTracer->traceLines(0, g_height);
+			if (g_threads > 1)
+				theRayTracer->traceTiles(g_threads);
+			else
+				theRayTracer->traceLines(0, g_height);
 		
-			end=clock();
+			end=chrono::steady_clock::now();
 
 			// save image
 			unsigned char* buf;
@@ -181,12 +294,19 @@ int main(int argc, char **argv) {
 			if (buf)
 				writeBMP(imgName, g_width, g_height, buf); 
 
+			if (bCostMap)
+				writeCostMaps(theRayTracer->getCostBuffer(), g_width, g_height);
+
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
+				double t=chrono::duration<double>(end-start).count();
+				string stats=theRayTracer->getStats().report();
+				const AccelerationStats& accel=theRayTracer->getScene()->getAccelerationStats();
 #ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
+				fl_message( "total time = %.3f seconds\nbvh build time = %.3f seconds (%d built, %d cached)\nbvh SAH cost = %.2f\n%s",
+					t, accel.buildSeconds, accel.built, accel.loaded, accel.sahCost, stats.c_str()); 
 #else
-				fprintf( stderr, "total time = %.3f seconds\n", t); 
+				fprintf( stderr, "total time = %.3f seconds\nbvh build time = %.3f seconds (%d built, %d cached)\nbvh SAH cost = %.2f\n%s",
+					t, accel.buildSeconds, accel.built, accel.loaded, accel.sahCost, stats.c_str()); 
 #endif
 			}
 		}
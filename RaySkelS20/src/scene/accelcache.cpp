@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "accelcache.h"
+#include "bvh.h"
+#include "../fileio/mappedfile.h"
+
+// Bump whenever the file layout, or the way the trees are built, changes.
+static const unsigned int ACCEL_CACHE_VERSION = 1;
+
+static const char ACCEL_CACHE_MAGIC[8] = { 'R', 'A', 'Y', 'A', 'C', 'C', 'E', 'L' };
+
+// The file starts with a FileHeader, followed by numRecords Records and
+// then the data they point to.  Everything is stored as it is in memory,
+// and the node arrays start on 64 byte boundaries so that they can be
+// used right out of the mapping.
+struct FileHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int nodeSize;		// sizeof( BVH::Node ), which the build may change
+	unsigned long long sceneHash;
+	unsigned int numRecords;
+	unsigned int reserved;
+};
+
+struct AccelCache::Record
+{
+	unsigned long long key;
+	unsigned int numBoxes;
+	unsigned int numNodes;
+	double rootArea;
+	unsigned long long nodeOffset;
+	unsigned long long itemOffset;
+};
+
+static const unsigned long long FNV_OFFSET = 14695981039346656037ull;
+static const unsigned long long FNV_PRIME = 1099511628211ull;
+
+static unsigned long long hashBytes( const char *p, size_t n )
+{
+	unsigned long long h = FNV_OFFSET;
+	for( size_t k = 0; k < n; ++k )
+		h = (h ^ (unsigned char)p[k]) * FNV_PRIME;
+	return h;
+}
+
+static unsigned long long alignUp( unsigned long long offset, unsigned long long alignment )
+{
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+AccelCache::AccelCache( const string& sceneFile )
+	: path( sceneFile + ".accel" ), sceneHash( 0 ), dirty( false )
+{
+	{
+		MappedFile scene;
+		if( scene.open( sceneFile.c_str() ) )
+			sceneHash = hashBytes( scene.data(), scene.size() );
+	}
+
+	shared_ptr<MappedFile> cached( new MappedFile );
+	if( !cached->open( path.c_str() ) || cached->size() < sizeof( FileHeader ) )
+		return;
+
+	const FileHeader *header = (const FileHeader *)cached->data();
+	if( memcmp( header->magic, ACCEL_CACHE_MAGIC, sizeof( header->magic ) ) != 0 ||
+		header->version != ACCEL_CACHE_VERSION ||
+		header->nodeSize != sizeof( BVH::Node ) ||
+		header->sceneHash != sceneHash )
+		return;
+
+	const unsigned long long size = cached->size();
+	if( sizeof( FileHeader ) + (unsigned long long)header->numRecords * sizeof( Record ) > size )
+		return;
+
+	const Record *table = (const Record *)(cached->data() + sizeof( FileHeader ));
+	for( unsigned int k = 0; k < header->numRecords; ++k ) {
+		const Record& r = table[k];
+		if( r.nodeOffset % 64 != 0 || r.itemOffset % sizeof( int ) != 0 ||
+			r.nodeOffset + (unsigned long long)r.numNodes * sizeof( BVH::Node ) > size ||
+			r.itemOffset + (unsigned long long)r.numBoxes * sizeof( int ) > size )
+			return;
+		records[ r.key ] = &r;
+	}
+
+	file = cached;
+}
+
+AccelCache::~AccelCache()
+{
+}
+
+unsigned long long AccelCache::key( const vector<BoundingBox>& boxes, BVHBuildMode mode )
+{
+	unsigned long long h = FNV_OFFSET;
+	h = (h ^ (unsigned long long)mode) * FNV_PRIME;
+	h = (h ^ (unsigned long long)boxes.size()) * FNV_PRIME;
+
+	// a word at a time: the boxes are many, and the hash only needs to tell
+	// them apart
+	for( size_t k = 0; k < boxes.size(); ++k ) {
+		for( int axis = 0; axis < 3; ++axis ) {
+			const double v[2] = { boxes[k].min[axis], boxes[k].max[axis] };
+			unsigned long long bits[2];
+			memcpy( bits, v, sizeof( bits ) );
+			h = (h ^ bits[0]) * FNV_PRIME;
+			h = (h ^ bits[1]) * FNV_PRIME;
+		}
+	}
+	return h;
+}
+
+BVH *AccelCache::find( unsigned long long key, int numBoxes )
+{
+	map<unsigned long long, const Record *>::const_iterator i = records.find( key );
+	if( i == records.end() || i->second->numBoxes != (unsigned int)numBoxes )
+		return NULL;
+
+	const Record& r = *i->second;
+	const BVH::Node *nodes = (const BVH::Node *)(file->data() + r.nodeOffset);
+	const int *items = (const int *)(file->data() + r.itemOffset);
+
+	// The traversal trusts the tree, so check that it is one: children
+	// come after their parents, leaves stay inside the items, and it is
+	// no deeper than the stacks allow.
+	if( r.numNodes == 0 )
+		return NULL;
+	vector<int> depth( r.numNodes, 0 );
+	for( unsigned int n = 0; n < r.numNodes; ++n ) {
+		for( int k = 0; k < BVH::WIDTH; ++k ) {
+			const int child = nodes[n].child[k];
+			const int count = nodes[n].count[k];
+			if( child < 0 )
+				continue;
+			if( count > 0 ) {
+				if( (unsigned int)child + count > r.numBoxes )
+					return NULL;
+			} else if( count < 0 || child <= (int)n || child >= (int)r.numNodes ||
+				depth[n] + 1 >= BVH::MAX_DEPTH ) {
+				return NULL;
+			} else {
+				depth[child] = depth[n] + 1;
+			}
+		}
+	}
+	for( unsigned int k = 0; k < r.numBoxes; ++k ) {
+		if( items[k] < 0 || items[k] >= numBoxes )
+			return NULL;
+	}
+
+	BVH *bvh = new BVH;
+	bvh->nodes = nodes;
+	bvh->numNodes = r.numNodes;
+	bvh->items = items;
+	bvh->numItems = r.numBoxes;
+	bvh->rootArea = r.rootArea;
+	bvh->file = file;
+
+	used.push_back( make_pair( key, (const BVH *)bvh ) );
+	return bvh;
+}
+
+void AccelCache::insert( unsigned long long key, const BVH *bvh )
+{
+	used.push_back( make_pair( key, bvh ) );
+	dirty = true;
+}
+
+bool AccelCache::save()
+{
+	if( !dirty )
+		return true;
+
+	// one record per key: meshes that are the same build the same tree
+	vector< pair<unsigned long long, const BVH *> > unique;
+	map<unsigned long long, bool> seen;
+	for( size_t k = 0; k < used.size(); ++k ) {
+		if( used[k].second->numNodes > 0 && !seen[ used[k].first ] ) {
+			seen[ used[k].first ] = true;
+			unique.push_back( used[k] );
+		}
+	}
+
+	FileHeader header;
+	memcpy( header.magic, ACCEL_CACHE_MAGIC, sizeof( header.magic ) );
+	header.version = ACCEL_CACHE_VERSION;
+	header.nodeSize = sizeof( BVH::Node );
+	header.sceneHash = sceneHash;
+	header.numRecords = unique.size();
+	header.reserved = 0;
+
+	vector<Record> table( unique.size() );
+	unsigned long long offset = sizeof( FileHeader ) + table.size() * sizeof( Record );
+	for( size_t k = 0; k < unique.size(); ++k ) {
+		const BVH& bvh = *unique[k].second;
+		Record& r = table[k];
+		r.key = unique[k].first;
+		r.numBoxes = bvh.numItems;
+		r.numNodes = bvh.numNodes;
+		r.rootArea = bvh.rootArea;
+		r.nodeOffset = offset = alignUp( offset, 64 );
+		offset += r.numNodes * sizeof( BVH::Node );
+		r.itemOffset = offset;
+		offset += r.numBoxes * sizeof( int );
+	}
+
+	// Write to the side and swap it in, so that a run that is stopped
+	// half way never leaves a truncated cache behind.
+	const string temp = path + ".tmp";
+	{
+		ofstream out( temp.c_str(), ios::binary | ios::trunc );
+		if( !out )
+			return false;
+
+		out.write( (const char *)&header, sizeof( header ) );
+		if( !table.empty() )
+			out.write( (const char *)&table[0], table.size() * sizeof( Record ) );
+
+		unsigned long long written = sizeof( FileHeader ) + table.size() * sizeof( Record );
+		static const char padding[64] = { 0 };
+		for( size_t k = 0; k < unique.size(); ++k ) {
+			const BVH& bvh = *unique[k].second;
+			out.write( padding, table[k].nodeOffset - written );
+			out.write( (const char *)bvh.nodes, bvh.numNodes * sizeof( BVH::Node ) );
+			out.write( (const char *)bvh.items, bvh.numItems * sizeof( int ) );
+			written = table[k].itemOffset + bvh.numItems * sizeof( int );
+		}
+
+		if( !out )
+			return false;
+	}
+
+	remove( path.c_str() );
+	if( rename( temp.c_str(), path.c_str() ) != 0 ) {
+		remove( temp.c_str() );
+		return false;
+	}
+
+	dirty = false;
+	return true;
+}
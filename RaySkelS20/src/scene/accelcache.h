@@ -0,0 +1,66 @@
+//
+// accelcache.h
+//
+// Built hierarchies kept on disk between runs.  The cache for a scene file
+// lives next to it, in the file name with ".accel" added, and holds every
+// BVH the scene built: the scene's own and those of its meshes.  A later
+// run over the same scene maps the file into memory and uses the nodes in
+// place, so none of them has to be built again.
+//
+// The file is only used if its format version, its node layout and the
+// hash of the scene file it was made from all match; otherwise it is
+// rebuilt from scratch.  Each hierarchy in it is further keyed by a hash of
+// the boxes it was built over and the build mode, which also catches
+// inputs the scene file only names (such as a height map image).
+//
+
+#ifndef __ACCELCACHE_H__
+#define __ACCELCACHE_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+
+class BVH;
+class MappedFile;
+
+class AccelCache
+{
+public:
+	// Open the cache of the scene in sceneFile, if it has a usable one.
+	AccelCache( const string& sceneFile );
+	~AccelCache();
+
+	// The key a hierarchy over boxes, built in the given mode, is kept by.
+	static unsigned long long key( const vector<BoundingBox>& boxes, BVHBuildMode mode );
+
+	// The cached hierarchy for key, or NULL if there isn't one.
+	BVH *find( unsigned long long key, int numBoxes );
+
+	// Note a hierarchy built for key that the cache didn't have.
+	void insert( unsigned long long key, const BVH *bvh );
+
+	// Write the file again if insert() was called, with every hierarchy
+	// found or inserted since it was opened; they must all still exist.
+	// Returns false if the file couldn't be written.
+	bool save();
+
+	const string& getPath() const { return path; }
+
+private:
+	struct Record;
+
+	string path;
+	unsigned long long sceneHash;
+	shared_ptr<MappedFile> file;
+	map<unsigned long long, const Record *> records;
+
+	// everything this run has used, in the order it was asked for
+	vector< pair<unsigned long long, const BVH *> > used;
+	bool dirty;
+};
+
+#endif // __ACCELCACHE_H__
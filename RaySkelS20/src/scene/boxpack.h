@@ -0,0 +1,135 @@
+//
+// boxpack.h
+//
+// A small group of boxes stored structure-of-arrays, and a slab test of
+// one ray against all of them at once.  Which version of the test gets
+// compiled is decided at build time:
+//
+//   __AVX__ (/arch:AVX or /arch:AVX2)     four boxes per instruction
+//   __SSE2__ (any x64 build)              two boxes per instruction
+//   otherwise, or with RAY_NO_SIMD        a plain loop
+//
+// All three work in double precision and do the same operations as
+// BoundingBox::intersect, so they give exactly the same answers; the
+// choice only changes the speed.
+//
+
+#ifndef __BOXPACK_H__
+#define __BOXPACK_H__
+
+#include "ray.h"
+
+#if !defined( RAY_NO_SIMD ) && defined( __AVX__ )
+#define RAY_SIMD_AVX
+#include <immintrin.h>
+#elif !defined( RAY_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || \
+	( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+#define RAY_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define RAY_ALIGN( n ) __declspec( align( n ) )
+#else
+#define RAY_ALIGN( n ) __attribute__(( aligned( n ) ))
+#endif
+
+// N boxes, N a multiple of 4.  bounds[0] holds the minimum corners and
+// bounds[1] the maximum ones, so for an axis the ray runs backwards along
+// (ray::getSign) the near side is bounds[1] and the far side bounds[0].
+// A slot without a box should be set with clear(), which makes it
+// impossible to hit.
+template <int N>
+struct RAY_ALIGN( 32 ) BoxPack
+{
+	double bounds[2][3][N];
+
+	void clear( int k )
+	{
+		for( int axis = 0; axis < 3; ++axis ) {
+			bounds[0][axis][k] = 1.0e308;
+			bounds[1][axis][k] = -1.0e308;
+		}
+	}
+
+	void set( int k, const vec3f& min, const vec3f& max )
+	{
+		for( int axis = 0; axis < 3; ++axis ) {
+			bounds[0][axis][k] = min[axis];
+			bounds[1][axis][k] = max[axis];
+		}
+	}
+
+	// Test r against every box.  Bit k of the result is set if r hits box
+	// k somewhere in [0, tLimit]; tNear[k] is then where it enters it
+	// (negative if r starts inside), and is garbage otherwise.
+	int intersect( const ray& r, double tLimit, double tNear[N] ) const;
+};
+
+template <int N>
+inline int BoxPack<N>::intersect( const ray& r, double tLimit, double tNear[N] ) const
+{
+	const vec3f p = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
+	int mask = 0;
+
+#if defined( RAY_SIMD_AVX )
+	for( int k = 0; k < N; k += 4 ) {
+		__m256d tMin = _mm256_set1_pd( -1.0e308 );
+		__m256d tMax = _mm256_set1_pd( tLimit );
+		for( int axis = 0; axis < 3; ++axis ) {
+			const int s = r.getSign( axis );
+			const __m256d o = _mm256_set1_pd( p[axis] );
+			const __m256d i = _mm256_set1_pd( inv[axis] );
+			const __m256d t1 = _mm256_mul_pd( _mm256_sub_pd( _mm256_load_pd( &bounds[s][axis][k] ), o ), i );
+			const __m256d t2 = _mm256_mul_pd( _mm256_sub_pd( _mm256_load_pd( &bounds[1 - s][axis][k] ), o ), i );
+			// with the running value second, a NaN slab leaves it alone
+			tMin = _mm256_max_pd( t1, tMin );
+			tMax = _mm256_min_pd( t2, tMax );
+		}
+		_mm256_storeu_pd( &tNear[k], tMin );
+		const __m256d hit = _mm256_and_pd(
+			_mm256_cmp_pd( tMin, tMax, _CMP_LE_OQ ),
+			_mm256_cmp_pd( tMax, _mm256_setzero_pd(), _CMP_GE_OQ ) );
+		mask |= _mm256_movemask_pd( hit ) << k;
+	}
+#elif defined( RAY_SIMD_SSE2 )
+	for( int k = 0; k < N; k += 2 ) {
+		__m128d tMin = _mm_set1_pd( -1.0e308 );
+		__m128d tMax = _mm_set1_pd( tLimit );
+		for( int axis = 0; axis < 3; ++axis ) {
+			const int s = r.getSign( axis );
+			const __m128d o = _mm_set1_pd( p[axis] );
+			const __m128d i = _mm_set1_pd( inv[axis] );
+			const __m128d t1 = _mm_mul_pd( _mm_sub_pd( _mm_load_pd( &bounds[s][axis][k] ), o ), i );
+			const __m128d t2 = _mm_mul_pd( _mm_sub_pd( _mm_load_pd( &bounds[1 - s][axis][k] ), o ), i );
+			// with the running value second, a NaN slab leaves it alone
+			tMin = _mm_max_pd( t1, tMin );
+			tMax = _mm_min_pd( t2, tMax );
+		}
+		_mm_storeu_pd( &tNear[k], tMin );
+		const __m128d hit = _mm_and_pd( _mm_cmple_pd( tMin, tMax ),
+			_mm_cmpge_pd( tMax, _mm_setzero_pd() ) );
+		mask |= _mm_movemask_pd( hit ) << k;
+	}
+#else
+	for( int k = 0; k < N; ++k ) {
+		double tMin = -1.0e308;
+		double tMax = tLimit;
+		for( int axis = 0; axis < 3; ++axis ) {
+			const int s = r.getSign( axis );
+			const double t1 = (bounds[s][axis][k] - p[axis]) * inv[axis];
+			const double t2 = (bounds[1 - s][axis][k] - p[axis]) * inv[axis];
+			tMin = t1 > tMin ? t1 : tMin;
+			tMax = t2 < tMax ? t2 : tMax;
+		}
+		tNear[k] = tMin;
+		if( tMin <= tMax && tMax >= 0.0 )
+			mask |= 1 << k;
+	}
+#endif
+
+	return mask;
+}
+
+#endif // __BOXPACK_H__
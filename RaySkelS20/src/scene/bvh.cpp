@@ -0,0 +1,463 @@
+#include <cfloat>
+#include <cstdint>
+#include <thread>
+
+#include "bvh.h"
+#include "accelcache.h"
+
+// Relative costs of visiting a node and of intersecting one object, used
+// by the surface area heuristic.
+static const double TRAVERSAL_COST = 1.0;
+static const double INTERSECT_COST = 1.0;
+
+// Leaves are allowed to hold this many objects if it is cheaper than
+// splitting them further.
+static const int MAX_LEAF_SIZE = 4;
+
+// The number of buckets the binned SAH builder sorts centroids into along
+// each axis.  More find slightly better splits, for a slower build.
+static const int SAH_BINS = 16;
+
+// Subtrees over fewer boxes than this are built on the thread that gets
+// to them; bigger ones hand one child to a new thread.
+static const int PARALLEL_BUILD_SIZE = 4096;
+
+static double surfaceArea( const BoundingBox& b )
+{
+	const vec3f d = b.max - b.min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static void enclose( BoundingBox& b, const BoundingBox& other )
+{
+	b.min = minimum( b.min, other.min );
+	b.max = maximum( b.max, other.max );
+}
+
+// Spread the low 10 bits of v out so that there are two zero bits between
+// each of them.
+static unsigned int expandBits( unsigned int v )
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// The 30 bit Morton code of a point in the unit cube.
+static unsigned int mortonCode( const vec3f& p )
+{
+	unsigned int code = 0;
+	for( int axis = 0; axis < 3; ++axis ) {
+		double x = p[axis] * 1024.0;
+		x = x < 0.0 ? 0.0 : (x > 1023.0 ? 1023.0 : x);
+		code |= expandBits( (unsigned int)x ) << (2 - axis);
+	}
+	return code;
+}
+
+template <class T>
+static bool codeLess( const T& a, const T& b )
+{
+	if( a.code != b.code )
+		return a.code < b.code;
+	return a.index < b.index;
+}
+
+// Sort the entries by Morton code, in "threads" pieces that are then
+// merged pairwise.
+template <class T>
+static void parallelSort( vector<T>& entries, int threads )
+{
+	const int pieces = max( 1, min( threads, (int)(entries.size() / PARALLEL_BUILD_SIZE) ) );
+	vector<size_t> bounds( pieces + 1 );
+	for( int k = 0; k <= pieces; ++k )
+		bounds[k] = entries.size() * k / pieces;
+
+	vector<thread> workers;
+	for( int k = 1; k < pieces; ++k )
+		workers.push_back( thread( [&entries, &bounds, k]() {
+			sort( entries.begin() + bounds[k], entries.begin() + bounds[k + 1], codeLess<T> );
+		} ) );
+	sort( entries.begin() + bounds[0], entries.begin() + bounds[1], codeLess<T> );
+	for( size_t k = 0; k < workers.size(); ++k )
+		workers[k].join();
+
+	for( int width = 1; width < pieces; width *= 2 ) {
+		for( int k = 0; k + width < pieces; k += 2 * width )
+			inplace_merge( entries.begin() + bounds[k], entries.begin() + bounds[k + width],
+				entries.begin() + bounds[min( k + 2 * width, pieces )], codeLess<T> );
+	}
+}
+
+BVH::BVH( const vector<BoundingBox>& boxes, BVHBuildMode mode, int threads )
+	: nodes( NULL ), numNodes( 0 ), items( NULL ), numItems( 0 ), rootArea( 0.0 )
+{
+	if( threads <= 0 )
+		threads = max( 1, (int)thread::hardware_concurrency() );
+
+	vector<BuildEntry> entries( boxes.size() );
+	BoundingBox centroids;
+
+	for( size_t k = 0; k < boxes.size(); ++k ) {
+		BuildEntry& e = entries[k];
+		e.bounds = boxes[k];
+
+		// Pad every box slightly so that hits lying exactly on an object's
+		// bounds are not lost to round-off in the slab test.
+		e.bounds.min -= vec3f( RAY_EPSILON, RAY_EPSILON, RAY_EPSILON );
+		e.bounds.max += vec3f( RAY_EPSILON, RAY_EPSILON, RAY_EPSILON );
+		e.centroid = (e.bounds.min + e.bounds.max) * 0.5;
+		e.index = k;
+
+		if( k == 0 )
+			centroids.min = centroids.max = e.centroid;
+		centroids.min = minimum( centroids.min, e.centroid );
+		centroids.max = maximum( centroids.max, e.centroid );
+	}
+
+	if( entries.empty() )
+		return;
+
+	if( mode == BVH_BUILD_LBVH ) {
+		vec3f extent = centroids.max - centroids.min;
+		for( int axis = 0; axis < 3; ++axis ) {
+			if( extent[axis] <= 0.0 )
+				extent[axis] = 1.0;
+		}
+
+		for( size_t k = 0; k < entries.size(); ++k ) {
+			const vec3f c = entries[k].centroid - centroids.min;
+			entries[k].code = mortonCode( vec3f( c[0] / extent[0], c[1] / extent[1], c[2] / extent[2] ) );
+		}
+		parallelSort( entries, threads );
+	}
+
+	vector<BuildNode> tree;
+	tree.reserve( 2 * entries.size() );
+	build( entries, tree, 0, entries.size(), 0, mode, threads );
+	rootArea = surfaceArea( tree[0].bounds );
+
+	itemStorage.resize( entries.size() );
+	for( size_t k = 0; k < entries.size(); ++k )
+		itemStorage[k] = entries[k].index;
+	items = &itemStorage[0];
+	numItems = itemStorage.size();
+
+	vector<BuildSlot> slots;
+	collapse( tree, 0, slots );
+
+	numNodes = slots.size() / WIDTH;
+	nodeStorage.resize( numNodes * sizeof( Node ) + 63 );
+	Node *built = (Node *)(((uintptr_t)&nodeStorage[0] + 63) & ~(uintptr_t)63);
+	nodes = built;
+
+	for( int n = 0; n < numNodes; ++n ) {
+		for( int k = 0; k < WIDTH; ++k ) {
+			const BuildSlot& slot = slots[ n * WIDTH + k ];
+			if( slot.child < 0 )
+				built[n].bounds.clear( k );
+			else
+				built[n].bounds.set( k, slot.bounds.min, slot.bounds.max );
+			built[n].child[k] = slot.child;
+			built[n].count[k] = slot.count;
+		}
+	}
+}
+
+BVH *BVHBuilder::build( const vector<BoundingBox>& boxes )
+{
+	unsigned long long key = 0;
+	if( cache && !boxes.empty() ) {
+		key = AccelCache::key( boxes, mode );
+		if( BVH *bvh = cache->find( key, boxes.size() ) ) {
+			++loaded;
+			return bvh;
+		}
+	}
+
+	BVH *bvh = new BVH( boxes, mode, threads );
+	++built;
+	if( cache && !boxes.empty() )
+		cache->insert( key, bvh );
+	return bvh;
+}
+
+double BVH::sahCost() const
+{
+	return sahCost( vector<double>() );
+}
+
+double BVH::sahCost( const vector<double>& costs ) const
+{
+	if( numNodes == 0 )
+		return 0.0;
+
+	// every ray that gets here visits the root
+	double cost = TRAVERSAL_COST;
+	const double scale = rootArea > 0.0 ? 1.0 / rootArea : 0.0;
+
+	for( int n = 0; n < numNodes; ++n ) {
+		for( int k = 0; k < WIDTH; ++k ) {
+			if( nodes[n].child[k] < 0 )
+				continue;
+
+			BoundingBox b;
+			for( int axis = 0; axis < 3; ++axis ) {
+				b.min[axis] = nodes[n].bounds.bounds[0][axis][k];
+				b.max[axis] = nodes[n].bounds.bounds[1][axis][k];
+			}
+			const double p = rootArea > 0.0 ? surfaceArea( b ) * scale : 1.0;
+
+			if( nodes[n].count[k] == 0 ) {
+				cost += p * TRAVERSAL_COST;
+			} else {
+				for( int j = nodes[n].child[k]; j < nodes[n].child[k] + nodes[n].count[k]; ++j )
+					cost += p * INTERSECT_COST * (costs.empty() ? 1.0 : costs[ items[j] ]);
+			}
+		}
+	}
+
+	return cost;
+}
+
+// Recursively build the subtree over entries[begin, end) and return the
+// index of its root node.  The entries are reordered in place so that every
+// leaf refers to a contiguous range.  With more than one thread to spare,
+// a big subtree builds its right child on a new thread, into nodes of its
+// own that are appended once it is done, so the tree comes out the same
+// as a single threaded build.
+int BVH::build( vector<BuildEntry>& entries, vector<BuildNode>& nodes,
+	int begin, int end, int depth, BVHBuildMode mode, int threads )
+{
+	const int nodeIndex = nodes.size();
+	nodes.push_back( BuildNode() );
+
+	BoundingBox bounds = entries[begin].bounds;
+	for( int k = begin + 1; k < end; ++k )
+		enclose( bounds, entries[k].bounds );
+	nodes[nodeIndex].bounds = bounds;
+
+	const int count = end - begin;
+	int mid = -1;
+	if( count > 1 && depth < MAX_DEPTH - 1 ) {
+		if( mode == BVH_BUILD_LBVH )
+			mid = splitLinear( entries, begin, end );
+		else
+			mid = splitBinned( entries, begin, end, bounds );
+	}
+
+	if( mid < 0 ) {
+		nodes[nodeIndex].start = begin;
+		nodes[nodeIndex].count = count;
+		return nodeIndex;
+	}
+
+	int right;
+	if( threads > 1 && count >= PARALLEL_BUILD_SIZE ) {
+		const int rightThreads = threads / 2;
+		vector<BuildNode> rightNodes;
+		thread worker( [&]() {
+			build( entries, rightNodes, mid, end, depth + 1, mode, rightThreads );
+		} );
+		build( entries, nodes, begin, mid, depth + 1, mode, threads - rightThreads );
+		worker.join();
+
+		right = nodes.size();
+		for( size_t k = 0; k < rightNodes.size(); ++k ) {
+			if( rightNodes[k].count == 0 )
+				rightNodes[k].start += right;
+			nodes.push_back( rightNodes[k] );
+		}
+	} else {
+		build( entries, nodes, begin, mid, depth + 1, mode, 1 );
+		right = build( entries, nodes, mid, end, depth + 1, mode, 1 );
+	}
+
+	nodes[nodeIndex].start = right;
+	nodes[nodeIndex].count = 0;
+	return nodeIndex;
+}
+
+// Pick the split of entries[begin, end) with the lowest SAH cost among the
+// boundaries of SAH_BINS equal buckets of centroids along each axis, and
+// partition the entries around it.  Returns the first entry of the right
+// half, or -1 if the entries should stay together in a leaf.
+int BVH::splitBinned( vector<BuildEntry>& entries, int begin, int end,
+	const BoundingBox& bounds )
+{
+	const int count = end - begin;
+
+	BoundingBox centroids;
+	centroids.min = centroids.max = entries[begin].centroid;
+	for( int k = begin + 1; k < end; ++k ) {
+		centroids.min = minimum( centroids.min, entries[k].centroid );
+		centroids.max = maximum( centroids.max, entries[k].centroid );
+	}
+
+	const double parentArea = surfaceArea( bounds );
+	double bestCost = DBL_MAX;
+	int bestAxis = -1;
+	int bestBin = -1;
+
+	for( int axis = 0; axis < 3; ++axis ) {
+		const double extent = centroids.max[axis] - centroids.min[axis];
+		if( extent <= 0.0 )
+			continue;
+		const double scale = SAH_BINS * (1.0 - 1.0e-9) / extent;
+
+		BoundingBox binBounds[ SAH_BINS ];
+		int binCount[ SAH_BINS ] = { 0 };
+		for( int k = begin; k < end; ++k ) {
+			const int bin = (int)((entries[k].centroid[axis] - centroids.min[axis]) * scale);
+			if( binCount[bin]++ == 0 )
+				binBounds[bin] = entries[k].bounds;
+			else
+				enclose( binBounds[bin], entries[k].bounds );
+		}
+
+		// rightArea[b] and rightCount[b] are for the bins from b up
+		double rightArea[ SAH_BINS ];
+		int rightCount[ SAH_BINS ];
+		BoundingBox acc;
+		int n = 0;
+		for( int b = SAH_BINS - 1; b > 0; --b ) {
+			if( binCount[b] ) {
+				if( n == 0 )
+					acc = binBounds[b];
+				else
+					enclose( acc, binBounds[b] );
+				n += binCount[b];
+			}
+			rightArea[b] = n ? surfaceArea( acc ) : 0.0;
+			rightCount[b] = n;
+		}
+
+		n = 0;
+		for( int b = 1; b < SAH_BINS; ++b ) {
+			if( binCount[b - 1] ) {
+				if( n == 0 )
+					acc = binBounds[b - 1];
+				else
+					enclose( acc, binBounds[b - 1] );
+				n += binCount[b - 1];
+			}
+			if( n == 0 || rightCount[b] == 0 )
+				continue;
+
+			const double cost = TRAVERSAL_COST + INTERSECT_COST *
+				(surfaceArea( acc ) * n + rightArea[b] * rightCount[b]) /
+				(parentArea > 0.0 ? parentArea : 1.0);
+			if( cost < bestCost ) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	if( count <= MAX_LEAF_SIZE && (bestAxis < 0 || INTERSECT_COST * count <= bestCost) )
+		return -1;
+
+	// All the centroids coincide: no split is better than another.
+	if( bestAxis < 0 )
+		return begin + count / 2;
+
+	const double extent = centroids.max[bestAxis] - centroids.min[bestAxis];
+	const double scale = SAH_BINS * (1.0 - 1.0e-9) / extent;
+	const double lo = centroids.min[bestAxis];
+	vector<BuildEntry>::iterator mid = partition( entries.begin() + begin, entries.begin() + end,
+		[=]( const BuildEntry& e ) { return (int)((e.centroid[bestAxis] - lo) * scale) < bestBin; } );
+	return mid - entries.begin();
+}
+
+// Split sorted entries[begin, end) where the highest bit in which their
+// Morton codes differ changes from 0 to 1.  Returns -1 for a single entry.
+int BVH::splitLinear( const vector<BuildEntry>& entries, int begin, int end )
+{
+	if( end - begin == 1 )
+		return -1;
+
+	const unsigned int first = entries[begin].code;
+	const unsigned int last = entries[end - 1].code;
+	if( first == last )
+		return begin + (end - begin) / 2;
+
+	unsigned int bit = 1u << 31;
+	while( !((first ^ last) & bit) )
+		bit >>= 1;
+
+	// the first entry with the bit set
+	int lo = begin, hi = end - 1;
+	while( lo < hi ) {
+		const int m = (lo + hi) / 2;
+		if( entries[m].code & bit )
+			hi = m;
+		else
+			lo = m + 1;
+	}
+	return lo;
+}
+
+// Turn the binary subtree at root into a node of the wide tree, appending
+// its WIDTH slots (and those of every node under it) to slots, and return
+// its index.  The root's children are opened up by repeatedly replacing
+// the interior one with the largest surface area by its two children,
+// until there are WIDTH of them or only leaves are left.
+int BVH::collapse( const vector<BuildNode>& tree, int root, vector<BuildSlot>& slots )
+{
+	int gathered[ WIDTH ];
+	int count = 0;
+
+	if( tree[root].count > 0 ) {
+		gathered[count++] = root;
+	} else {
+		gathered[count++] = root + 1;
+		gathered[count++] = tree[root].start;
+	}
+
+	while( count < WIDTH ) {
+		int best = -1;
+		double bestArea = -1.0;
+		for( int k = 0; k < count; ++k ) {
+			const BuildNode& n = tree[ gathered[k] ];
+			if( n.count == 0 && surfaceArea( n.bounds ) > bestArea ) {
+				best = k;
+				bestArea = surfaceArea( n.bounds );
+			}
+		}
+		if( best < 0 )
+			break;
+
+		const int opened = gathered[best];
+		gathered[best] = opened + 1;
+		gathered[count++] = tree[opened].start;
+	}
+
+	const int index = slots.size() / WIDTH;
+	slots.resize( slots.size() + WIDTH );
+
+	for( int k = 0; k < WIDTH; ++k ) {
+		BuildSlot slot;
+		if( k >= count ) {
+			slot.child = -1;
+			slot.count = 0;
+		} else {
+			const BuildNode& n = tree[ gathered[k] ];
+			slot.bounds = n.bounds;
+			if( n.count > 0 ) {
+				slot.child = n.start;
+				slot.count = n.count;
+			} else {
+				slot.child = collapse( tree, gathered[k], slots );
+				slot.count = 0;
+			}
+		}
+
+		// the recursion may have moved slots
+		slots[ index * WIDTH + k ] = slot;
+	}
+
+	return index;
+}
@@ -0,0 +1,259 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over a set of boxes.  The hierarchy only
+// knows the boxes by their index; what is inside them is up to the user,
+// who walks the tree with a query object (see closestHit and anyHit).  The
+// scene builds one over its bounded objects in Scene::initScene, and every
+// Trimesh builds one over its triangles.  Both go through a BVHBuilder,
+// which can take a hierarchy from the on-disk cache (see accelcache.h)
+// instead of building it.
+//
+// There are two builders (see BVHBuildMode in scene.h): binned SAH, which
+// splits every node where the surface area heuristic says it is cheapest,
+// and a linear BVH, which sorts the boxes along a Morton curve and splits
+// where the codes first differ.  Both build large subtrees on threads of
+// their own, and give the same tree whatever the number of threads.
+//
+// The tree is built binary and then collapsed so that every node has up
+// to WIDTH children, whose boxes it keeps side by side in a BoxPack.  A
+// ray visiting a node tests all of them with one call, and the nodes are
+// aligned to cache lines, so a ray touches far fewer nodes and much less
+// memory than it would walking the binary tree.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <memory>
+#include <vector>
+
+#include "scene.h"
+#include "boxpack.h"
+#include "raystats.h"
+
+class AccelCache;
+class MappedFile;
+
+class BVH
+{
+public:
+	// threads is the most threads the build may use, 0 for all the cores.
+	BVH( const vector<BoundingBox>& boxes, BVHBuildMode mode = BVH_BUILD_SAH,
+		int threads = 0 );
+
+	bool empty() const { return numNodes == 0; }
+
+	// The expected cost of a ray that hits the root box, by the surface
+	// area heuristic: the nodes it visits plus the boxes it tests, each
+	// box counting costs[k] (1 if there are no costs).
+	double sahCost() const;
+	double sahCost( const vector<double>& costs ) const;
+
+	// Walk the tree front to back for a closest-hit query.  For every leaf
+	// the ray reaches, query.test( k ) is called with the index k of each
+	// box in it.  query.limit() is the distance of the closest hit found so
+	// far (anything huge if there is none yet), and subtrees whose boxes
+	// start beyond it are skipped, so most rays only touch a handful of
+	// nodes.
+	template <class Query>
+	void closestHit( const ray& r, Query& query ) const;
+
+	// Walk the tree in whatever order the children come for an any-hit
+	// query, skipping boxes that start beyond tMax.  Stops and returns
+	// true as soon as query.test( k ) does.
+	template <class Query>
+	bool anyHit( const ray& r, double tMax, Query& query ) const;
+
+private:
+	// nodes and items point into the tree's own storage or a mapped file,
+	// so a copy could outlive what they point to
+	BVH( const BVH& );
+	BVH& operator=( const BVH& );
+
+	// 4 fills one AVX register per coordinate; 8 works too.
+	enum { WIDTH = 4 };
+
+	// The binary tree is capped at this depth: anything still unsplit
+	// becomes one (possibly large) leaf.  The collapsed tree is no
+	// deeper, which bounds the traversal stacks.
+	enum { MAX_DEPTH = 64, STACK_SIZE = MAX_DEPTH * (WIDTH - 1) + 1 };
+
+	// Each of the WIDTH slots of a node is empty (child -1), a leaf with
+	// the boxes items[child .. child+count), or another node (count 0).
+	// Nodes are numbered depth first from the root at 0.
+	struct RAY_ALIGN( 64 ) Node
+	{
+		BoxPack<WIDTH> bounds;
+		int child[ WIDTH ];
+		int count[ WIDTH ];
+	};
+
+	// A slot on the traversal stack, with the distance at which the ray
+	// enters its box.
+	struct StackEntry
+	{
+		int child;
+		int count;
+		double t;
+	};
+
+	// The binary tree, only kept while building.  Nodes are stored depth
+	// first: the left child of an interior node immediately follows it,
+	// and the right child is at index "start".  For a leaf, the boxes are
+	// items[start .. start+count).
+	struct BuildNode
+	{
+		BoundingBox bounds;
+		int start;
+		int count;				// 0 for interior nodes
+	};
+
+	struct BuildEntry
+	{
+		BoundingBox bounds;
+		vec3f centroid;
+		unsigned int code;		// Morton code of the centroid, for the LBVH
+		int index;				// position in the boxes passed in
+	};
+
+	struct BuildSlot
+	{
+		BoundingBox bounds;
+		int child;
+		int count;
+	};
+
+	int build( vector<BuildEntry>& entries, vector<BuildNode>& tree,
+		int begin, int end, int depth, BVHBuildMode mode, int threads );
+	int splitBinned( vector<BuildEntry>& entries, int begin, int end,
+		const BoundingBox& bounds );
+	int splitLinear( const vector<BuildEntry>& entries, int begin, int end );
+	int collapse( const vector<BuildNode>& tree, int root, vector<BuildSlot>& slots );
+
+	// A hierarchy read back by AccelCache, which fills in the members.
+	BVH() : nodes( NULL ), numNodes( 0 ), items( NULL ), numItems( 0 ), rootArea( 0.0 ) {}
+	friend class AccelCache;
+
+	// The nodes and items live in nodeStorage and itemStorage for a tree
+	// built here, or in a cache file that "file" keeps mapped.
+	const Node *nodes;			// aligned to 64 bytes
+	int numNodes;
+	const int *items;			// box indices, in leaf order
+	int numItems;
+	double rootArea;
+
+	vector<char> nodeStorage;
+	vector<int> itemStorage;
+	shared_ptr<MappedFile> file;
+};
+
+// Makes the hierarchies of a scene, all with the same mode and number of
+// threads.  With a cache, a hierarchy it already has for the same boxes
+// is taken from it instead of being built, and anything built is added to
+// it.
+class BVHBuilder
+{
+public:
+	BVHBuilder( BVHBuildMode mode = BVH_BUILD_SAH, int threads = 0, AccelCache *cache = NULL )
+		: mode( mode ), threads( threads ), cache( cache ), built( 0 ), loaded( 0 ) {}
+
+	BVH *build( const vector<BoundingBox>& boxes );
+
+	BVHBuildMode mode;
+	int threads;				// 0 for all the cores
+	AccelCache *cache;
+
+	int built;					// hierarchies built so far
+	int loaded;					// and taken from the cache
+};
+
+template <class Query>
+void BVH::closestHit( const ray& r, Query& query ) const
+{
+	if( numNodes == 0 )
+		return;
+
+	StackEntry stack[ STACK_SIZE ];
+	int sp = 0;
+	stack[sp].child = 0;
+	stack[sp].count = 0;
+	stack[sp].t = -1.0e308;
+	++sp;
+
+	while( sp > 0 ) {
+		const StackEntry entry = stack[--sp];
+		if( entry.t > query.limit() )
+			continue;
+
+		if( entry.count > 0 ) {
+			for( int k = entry.child; k < entry.child + entry.count; ++k )
+				query.test( items[k] );
+			continue;
+		}
+
+		COUNT_RAY_STAT( slabTests );
+		const Node& n = nodes[ entry.child ];
+		double tNear[ WIDTH ];
+		int mask = n.bounds.intersect( r, query.limit(), tNear );
+
+		// Push the children that were hit far to near, so that the nearest
+		// one is visited next.
+		int order[ WIDTH ];
+		int hits = 0;
+		for( ; mask; mask &= mask - 1 ) {
+			int k = 0;
+			while( !(mask & (1 << k)) )
+				++k;
+
+			int j = hits++;
+			for( ; j > 0 && tNear[ order[j - 1] ] < tNear[k]; --j )
+				order[j] = order[j - 1];
+			order[j] = k;
+		}
+
+		for( int j = 0; j < hits; ++j ) {
+			const int k = order[j];
+			stack[sp].child = n.child[k];
+			stack[sp].count = n.count[k];
+			stack[sp].t = tNear[k];
+			++sp;
+		}
+	}
+}
+
+template <class Query>
+bool BVH::anyHit( const ray& r, double tMax, Query& query ) const
+{
+	if( numNodes == 0 )
+		return false;
+
+	int stack[ STACK_SIZE ];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while( sp > 0 ) {
+		COUNT_RAY_STAT( slabTests );
+		const Node& n = nodes[ stack[--sp] ];
+		double tNear[ WIDTH ];
+		int mask = n.bounds.intersect( r, tMax, tNear );
+
+		for( int k = 0; k < WIDTH; ++k ) {
+			if( !(mask & (1 << k)) )
+				continue;
+
+			if( n.count[k] > 0 ) {
+				for( int j = n.child[k]; j < n.child[k] + n.count[k]; ++j ) {
+					if( query.test( items[j] ) )
+						return true;
+				}
+			} else {
+				stack[sp++] = n.child[k];
+			}
+		}
+	}
+
+	return false;
+}
+
+#endif // __BVH_H__
@@ -15,12 +15,10 @@ Camera::Camera()
 }
 
 void
-Camera::rayThrough( double x, double y, ray &r )
+Camera::rayThrough( double x, double y, ray &r ) const
 // Ray through normalized window point x,y.  In normalized coordinates
 // the camera's x and y vary both vary from 0 to 1.
 {
-    camera_x = x;
-    camera_y = y;
     x -= 0.5;
     y -= 0.5;
     vec3f dir = look + x * u + y * v;
@@ -85,6 +83,25 @@ Camera::setAspectRatio( double ar )
     update();
 }
 
+void
+Camera::getView( vec3f &eye, mat3f &rotation, double &normalizedHeight, double &aspectRatio ) const
+{
+    eye = this->eye;
+    rotation = m;
+    normalizedHeight = this->normalizedHeight;
+    aspectRatio = this->aspectRatio;
+}
+
+void
+Camera::setView( const vec3f &eye, const mat3f &rotation, double normalizedHeight, double aspectRatio )
+{
+    this->eye = eye;
+    m = rotation;
+    this->normalizedHeight = normalizedHeight;
+    this->aspectRatio = aspectRatio;
+    update();
+}
+
 void
 Camera::update()
 {
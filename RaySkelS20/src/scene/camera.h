@@ -7,7 +7,7 @@ class Camera
 {
 public:
     Camera();
-    void rayThrough( double x, double y, ray &r );
+    void rayThrough( double x, double y, ray &r ) const;
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
@@ -16,7 +16,11 @@ public:
 
     double getAspectRatio() { return aspectRatio; }
 
-    double camera_x, camera_y;
+    // Everything the calls above set up, so that a camera can be saved
+    // and put back exactly (see fileio/compiled.h).
+    void getView( vec3f &eye, mat3f &rotation, double &normalizedHeight, double &aspectRatio ) const;
+    void setView( const vec3f &eye, const mat3f &rotation, double normalizedHeight, double aspectRatio );
+
 private:
     mat3f m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
@@ -1,12 +1,9 @@
 #include <cmath>
 
 #include "light.h"
-#include "../ui/TraceUI.h"
 
 #define PI 3.14159265
 
-extern TraceUI *traceUI;
-
 double DirectionalLight::distanceAttenuation( const vec3f& P ) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -110,6 +107,13 @@ vec3f PointLight::shadowAttenuation(const vec3f& P) const
 	const vec3f dir = this->getDirection(P);	// Direction from intersection to light source
 	vec3f p			= P + dir * RAY_EPSILON;	// Offset the point a little bit to prevent intersection with itself
 
+	// Only walk the hits in order when there is something transparent in the way
+	bool transmissive;
+	if (this->scene->occluded(ray(p, dir), (position - p).length(), transmissive))
+		return vec3f(0.0f, 0.0f, 0.0f);
+	if (!transmissive)
+		return result;
+
 	// Check will the light ray hit the intersection point
 	while (result[0] > NORMAL_EPSILON || result[1] > NORMAL_EPSILON || result[2] > NORMAL_EPSILON) {
 		isect i;
@@ -166,6 +170,13 @@ vec3f SpotLight::shadowAttenuation(const vec3f &P) const {
 	const vec3f dir = this->getDirection(P);	// Direction from intersection to light source
 	vec3f p = P + dir * RAY_EPSILON;	// Offset the point a little bit to prevent intersection with itself
 
+	// Only walk the hits in order when there is something transparent in the way
+	bool transmissive;
+	if (this->scene->occluded(ray(p, dir), (position - p).length(), transmissive))
+		return vec3f(0.0f, 0.0f, 0.0f);
+	if (!transmissive)
+		return result;
+
 	// Check will the light ray hit the intersection point
 	while (result[0] >= NORMAL_EPSILON && result[1] >= NORMAL_EPSILON && result[2] >= NORMAL_EPSILON) {
 		isect i;
@@ -30,6 +30,8 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
 
+	const vec3f& getOrientation() const { return orientation; }
+
 protected:
 	vec3f 		orientation;
 };
@@ -46,6 +48,10 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
 
+	const vec3f& getPosition() const { return position; }
+	void getAttenuation( double& c, double& l, double& q ) const
+	{ c = const_coeff; l = linear_coeff; q = quad_coeff; }
+
 protected:
 	vec3f position;
 	double const_coeff, linear_coeff, quad_coeff;
@@ -74,6 +80,10 @@ public:
 	virtual vec3f getDirection(const vec3f &P) const;
 
 	double getConeAngle() const;
+	const vec3f& getPosition() const { return position; }
+	const vec3f& getAxis() const { return direction; }
+	void getAttenuation( double& c, double& l, double& q ) const
+	{ c = const_coeff; l = linear_coeff; q = quad_coeff; }
 private:
 	vec3f position;
 	vec3f direction;
@@ -98,6 +108,9 @@ public:
 	
 	double distanceAttenuation(const vec3f &p) const override;
 
+	const vec3f& getAxis() const { return direction; }
+	Type getShape() const { return type; }
+
 private:
 
 	void setUpMatrix(const vec3f& dir, const vec3f& pos);
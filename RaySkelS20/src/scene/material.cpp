@@ -27,53 +27,45 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
 	// Result intensity
 	vec3f result = this->ke;
 
-	// Add up the ambient component
-	vec3f ambientLights;
-	for (list<Light *>::const_iterator it = scene->beginLights(); it != scene->endLights(); ++it) {
-		if (AmbientLight *ambLight = dynamic_cast<AmbientLight *>(*it)) {
-			ambientLights += ambLight->getColor(point);
-		}
-	}
+	// Add up the ambient component (summed over all ambient lights by Scene::initScene)
+	const vec3f& ambientLights = scene->getAmbientLight();
 	result += prod(prod(this->ka, ambientLights), vec3f(1.0, 1.0, 1.0) - kt);
 
 	// Add the diffusion and specular component
-	for (list<Light *>::const_iterator it = scene->beginLights(); it != scene->endLights(); ++it) {
-		if (AmbientLight * ambLignt = dynamic_cast<AmbientLight *>(*it)) {
-			// Do nothing
-		} else {
-			Light *light = *it;
-
-			// Diffusion component
-			const vec3f		N	= i.N;	// Normal of intersection point					
-			const vec3f		L	= light->getDirection(point);	// Direction to the light source
-			const double	NL	= N.dot(L);
-
-			// Bonus 3 : Spot Light
-			if (SpotLight *spotLight = dynamic_cast<SpotLight *>(*it)) {
-				// Handle the case that spot light can't reach the point
-				if (acos(NL) * 180 / PI > spotLight->getConeAngle()) {
-					continue;
-				}
+	const vector<Scene::ShadingLight>& lights = scene->getShadingLights();
+	for (size_t k = 0; k < lights.size(); ++k) {
+		const Light *light = lights[k].light;
+
+		// Diffusion component
+		const vec3f		N	= i.N;	// Normal of intersection point					
+		const vec3f		L	= light->getDirection(point);	// Direction to the light source
+		const double	NL	= N.dot(L);
+
+		// Bonus 3 : Spot Light
+		if (lights[k].isSpot) {
+			// Handle the case that spot light can't reach the point
+			if (acos(NL) * 180 / PI > lights[k].coneAngle) {
+				continue;
 			}
+		}
 
-			vec3f diffuse = prod(this->kd * NL, vec3f(1.0f, 1.0f, 1.0f) - this->kt);
-			if (NL <= 0.0) continue;
+		vec3f diffuse = prod(this->kd * NL, vec3f(1.0f, 1.0f, 1.0f) - this->kt);
+		if (NL <= 0.0) continue;
 
-			// Specular component
-			const vec3f		R	= (2.0 * NL * N - L).normalize();	// Direction of reflection
-			const vec3f		V	= -r.getDirection();				// Direction from intersection to camera
-			const double	VR = max<double>(R.dot(V), 0.0);
+		// Specular component
+		const vec3f		R	= (2.0 * NL * N - L).normalize();	// Direction of reflection
+		const vec3f		V	= -r.getDirection();				// Direction from intersection to camera
+		const double	VR = max<double>(R.dot(V), 0.0);
 
-			vec3f specular	= this->ks * pow(VR, this->shininess * 128);
+		vec3f specular	= this->ks * pow(VR, this->shininess * 128);
 
-			// Combine diffusion and specular component
-			vec3f intensity = diffuse + specular;
+		// Combine diffusion and specular component
+		vec3f intensity = diffuse + specular;
 
-			const vec3f atten	= light->shadowAttenuation(point) * light->distanceAttenuation(point);
-			const vec3f color	= light->getColor(point);
+		const vec3f atten	= light->shadowAttenuation(point) * light->distanceAttenuation(point);
+		const vec3f color	= light->getColor(point);
 
-			result += prod(prod(atten, color), intensity);
-		}
+		result += prod(prod(atten, color), intensity);
 	}
 
 	return result;
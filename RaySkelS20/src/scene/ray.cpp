@@ -5,7 +5,7 @@
 const Material &
 isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+    return hasMaterial ? material : obj->getMaterial();
 }
 
 
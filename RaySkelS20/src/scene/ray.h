@@ -7,26 +7,74 @@
 #ifndef __RAY_H__
 #define __RAY_H__
 
-#include <stack>
 #include "../vecmath/vecmath.h"
 #include "material.h"
 
 class SceneObject;
 
+// The deepest recursion RayTracer::traceRay is allowed to go.  Larger
+// depths asked for by the UI or the command line are clamped to this.
+const int MAX_TRACE_DEPTH = 32;
+
+// The materials a ray is currently travelling inside, innermost on top,
+// used to find the indices of refraction on either side of a surface.
+// Every bounce pushes at most one entry, so a fixed array sized by the
+// maximum trace depth is always big enough and no ray ever allocates.
+class MediumStack {
+public:
+	MediumStack() : count( 0 ) {}
+	MediumStack( const MediumStack& other ) : count( other.count )
+	{
+		for( int k = 0; k < count; ++k )
+			entries[k] = other.entries[k];
+	}
+
+	MediumStack& operator =( const MediumStack& other )
+	{
+		count = other.count;
+		for( int k = 0; k < count; ++k )
+			entries[k] = other.entries[k];
+		return *this;
+	}
+
+	bool empty() const { return count == 0; }
+	const Material *top() const { return entries[count - 1]; }
+	void pop() { --count; }
+	void push( const Material *m )
+	{
+		if( count < MAX_TRACE_DEPTH + 1 )
+			entries[count++] = m;
+	}
+
+private:
+	const Material *entries[ MAX_TRACE_DEPTH + 1 ];
+	int count;
+};
+
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
+//
+// The ray also keeps the reciprocal of each direction component and
+// whether it is negative, which is all a slab test against a box needs
+// (see BoundingBox::intersect and boxpack.h).  A zero component gives an
+// infinite reciprocal, which the slab tests handle.
 
 class ray {
 public:
 	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ){}
+		: p( pp ), d( dd ) { setInverse(); }
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), invD( other.invD )
+	{
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+	}
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
     {
-        p = other.p; d = other.d; return *this;
+        p = other.p; d = other.d; invD = other.invD;
+        sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+        return *this;
     }
 
 	vec3f at( double t ) const
@@ -35,12 +83,25 @@ public:
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
 
-    stack<const Material *> prevMaterial;
+	const vec3f& getInverseDirection() const { return invD; }
+	// 1 if the direction is negative along the axis, else 0
+	int getSign( int axis ) const { return sign[axis]; }
+
+    MediumStack prevMaterial;
 
 protected:
+	void setInverse()
+	{
+		for( int k = 0; k < 3; ++k ) {
+			invD[k] = 1.0 / d[k];
+			sign[k] = invD[k] < 0.0;
+		}
+	}
+
 	vec3f p;
 	vec3f d;
-    
+	vec3f invD;
+	int sign[3];
 };
 
 // The description of an intersection point.
@@ -49,18 +110,23 @@ class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), bary(), face( -1 ), hasMaterial( false ) {}
 
-    ~isect()
+    isect( const isect& other )
+        : obj( other.obj ), t( other.t ), N( other.N ), bary( other.bary ),
+          face( other.face ), hasMaterial( other.hasMaterial )
     {
-        delete material;
+        if( hasMaterial )
+            material = other.material;
     }
-    
+
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
+    void setMaterial( const Material& m ) { material = m; hasMaterial = true; }
         
+    // The material slot is only copied when it is in use, so passing
+    // candidate hits around stays cheap.
     isect& operator =( const isect& other )
     {
         if( this != &other )
@@ -68,18 +134,11 @@ public:
             obj = other.obj;
             t = other.t;
             N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
+            bary = other.bary;
+            face = other.face;
+            hasMaterial = other.hasMaterial;
+            if( hasMaterial )
+                material = other.material;
         }
         return *this;
     }
@@ -88,9 +147,14 @@ public:
     const SceneObject 	*obj;
     double t;
     vec3f N;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    vec3f bary;                 // barycentric coordinates of the hit, for
+                                // objects made of triangles
+    int face;                   // and the index of the triangle that was hit
+    Material material;          // if this intersection has its own material
+    bool hasMaterial;           // (as opposed to one in its associated object)
+                                // as in the case where the material was interpolated.
+                                // Filled in by SceneObject::resolveMaterial
+                                // once the closest hit is known.
 
     const Material &getMaterial() const;
     // Other info here.
@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "raystats.h"
+
+#ifdef RAY_STATS
+static const char *PRIMITIVE_NAMES[ NUM_PRIMITIVE_TYPES ] = {
+	"Sphere", "Box", "Cylinder", "Cone", "Square", "Torus", "TrimeshFace", "CSGNode",
+	"HeightfieldCell", "Metaball"
+};
+#endif
+
+void RayStats::clear()
+{
+	primaryRays = 0;
+	reflectedRays = 0;
+	refractedRays = 0;
+	shadowRays = 0;
+	intersectTests = 0;
+	triangleTests = 0;
+
+	slabTests = 0;
+	for( int k = 0; k < NUM_PRIMITIVE_TYPES; ++k )
+		intersectLocalCalls[k] = 0;
+	hits = 0;
+	thresholdCutoffs = 0;
+}
+
+RayStats& RayStats::operator +=( const RayStats& other )
+{
+	primaryRays += other.primaryRays;
+	reflectedRays += other.reflectedRays;
+	refractedRays += other.refractedRays;
+	shadowRays += other.shadowRays;
+	intersectTests += other.intersectTests;
+	triangleTests += other.triangleTests;
+
+	slabTests += other.slabTests;
+	for( int k = 0; k < NUM_PRIMITIVE_TYPES; ++k )
+		intersectLocalCalls[k] += other.intersectLocalCalls[k];
+	hits += other.hits;
+	thresholdCutoffs += other.thresholdCutoffs;
+	return *this;
+}
+
+static void addLine( std::string& s, const std::string& label, unsigned long long value )
+{
+	char line[128];
+	sprintf( line, "%-18s = %llu\n", label.c_str(), value );
+	s += line;
+}
+
+std::string RayStats::report() const
+{
+	std::string s;
+
+	addLine( s, "primary rays", primaryRays );
+	addLine( s, "reflected rays", reflectedRays );
+	addLine( s, "refracted rays", refractedRays );
+	addLine( s, "shadow rays", shadowRays );
+	addLine( s, "intersect tests", intersectTests );
+	addLine( s, "triangle tests", triangleTests );
+
+#ifdef RAY_STATS
+	addLine( s, "slab tests", slabTests );
+	for( int k = 0; k < NUM_PRIMITIVE_TYPES; ++k ) {
+		if( intersectLocalCalls[k] )
+			addLine( s, std::string( PRIMITIVE_NAMES[k] ) + " tests", intersectLocalCalls[k] );
+	}
+	addLine( s, "hits", hits );
+	addLine( s, "threshold cutoffs", thresholdCutoffs );
+#endif
+
+	return s;
+}
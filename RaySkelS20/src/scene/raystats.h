@@ -0,0 +1,88 @@
+//
+// raystats.h
+//
+// Counts of the rays traced during a render, and of the work done for
+// them.  Every thread counts into its own RayStats (see threadRayStats()),
+// and RayTracer adds them up when the thread is done with its part of the
+// image, so no counter is ever shared between threads while tracing.
+//
+// The ray counts and the total of intersection tests are always kept; they
+// cost one increment each, and the benchmark runner and the cost map need
+// them.  The finer counters sit on the innermost loops (every slab test,
+// every intersectLocal call by type), so they are only compiled in when
+// RAY_STATS is defined.  Debug builds define it.
+//
+
+#ifndef __RAYSTATS_H__
+#define __RAYSTATS_H__
+
+#include <string>
+
+#if defined( _DEBUG ) && !defined( RAY_STATS )
+#define RAY_STATS
+#endif
+
+#ifdef RAY_STATS
+#define COUNT_RAY_STAT( field ) (++threadRayStats().field)
+#else
+#define COUNT_RAY_STAT( field ) ((void)0)
+#endif
+
+// The primitives whose intersectLocal calls are counted separately.
+enum PrimitiveType
+{
+	PRIM_SPHERE,
+	PRIM_BOX,
+	PRIM_CYLINDER,
+	PRIM_CONE,
+	PRIM_SQUARE,
+	PRIM_TORUS,
+	PRIM_TRIMESH_FACE,
+	PRIM_CSG,
+	PRIM_HEIGHTFIELD_CELL,
+	PRIM_METABALL,
+	NUM_PRIMITIVE_TYPES
+};
+
+struct RayStats
+{
+	RayStats() { clear(); }
+
+	void clear();
+	RayStats& operator +=( const RayStats& other );
+
+	unsigned long long secondaryRays() const
+	{
+		return reflectedRays + refractedRays;
+	}
+
+	unsigned long long totalRays() const
+	{
+		return primaryRays + secondaryRays() + shadowRays;
+	}
+
+	// A readable summary, one counter per line.
+	std::string report() const;
+
+	unsigned long long primaryRays;		// camera rays, one per sample
+	unsigned long long reflectedRays;
+	unsigned long long refractedRays;
+	unsigned long long shadowRays;		// Scene::occluded queries
+	unsigned long long intersectTests;	// Geometry::intersect calls
+	unsigned long long triangleTests;	// mesh faces tested, counted per mesh
+
+	// only counted with RAY_STATS
+	unsigned long long slabTests;		// BoundingBox::intersect calls and BVH nodes visited
+	unsigned long long intersectLocalCalls[ NUM_PRIMITIVE_TYPES ];
+	unsigned long long hits;			// intersection tests that found a hit
+	unsigned long long thresholdCutoffs;	// rays stopped by the adaptive threshold
+};
+
+// The counters of the calling thread.
+inline RayStats& threadRayStats()
+{
+	static thread_local RayStats stats;
+	return stats;
+}
+
+#endif // __RAYSTATS_H__
@@ -1,11 +1,14 @@
 #include <cmath>
+#include <cfloat>
+#include <climits>
+#include <chrono>
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
+#include "bvh.h"
+#include "raystats.h"
 #include "../SceneObjects/trimesh.h"
-
-extern TraceUI* traceUI;
+#include "../SceneObjects/Heightfield.h"
 
 void BoundingBox::operator=(const BoundingBox& target)
 {
@@ -31,116 +34,118 @@ bool BoundingBox::intersects(const vec3f& point) const
 // if the ray hits the box, put the "t" value of the intersection
 // closest to the origin in tMin and the "t" value of the far intersection
 // in tMax and return true, else return false.
-// Using Kay/Kajiya algorithm.
+// Using Kay/Kajiya algorithm, with the ray's cached inverse direction:
+// its sign picks which side of each slab is entered first, so there is no
+// division and no swap.  An axis the ray runs parallel to gives infinite
+// slab distances, which miss unless the origin is inside the slab (or NaN
+// if the origin lies exactly on a side, which the comparisons skip).
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	COUNT_RAY_STAT( slabTests );
+	const vec3f R0 = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
-	
+
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
-
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
+		const bool negative = r.getSign( currentaxis ) != 0;
 
 		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+		double t1 = ((negative ? max : min)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
+		double t2 = ((negative ? min : max)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
 
 		if (t1 > tMin)
 			tMin = t1;
 		if (t2 < tMax)
 			tMax = t2;
-
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
 	}
-	return true; // it made it past all 3 axes.
+
+	// missed, or behind the ray
+	return tMin <= tMax && tMax >= 0.0;
 }
 
 bool BoundingBox::intersect(const ray &r, double &tMin, double &tMax, vec3f &normal) const {
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	COUNT_RAY_STAT( slabTests );
+	const vec3f R0 = r.getPosition();
+	const vec3f& inv = r.getInverseDirection();
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
 
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++) 	{
-		double vd = Rd[currentaxis];
-
-		// if the ray is parallel to the face's plane (=0.0)
-		if (vd == 0.0)
-			continue;
-
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
+		const bool negative = r.getSign( currentaxis ) != 0;
 
 		// two slab intersections
-		double t1 = v1 / vd;
-		double t2 = v2 / vd;
-
-		if (t1 > t2) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+		double t1 = ((negative ? max : min)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
+		double t2 = ((negative ? min : max)[currentaxis] - R0[currentaxis]) * inv[currentaxis];
 
 		if (t1 > tMin) {
 			tMin = t1;
-			
-			// Set the normal vector
-			if (currentaxis == 0) {
-				normal = vec3f(Rd[0] < 0.0 ? 1.0 : -1.0, 0.0, 0.0);
-			} else if (currentaxis == 1) {
-				normal = vec3f(0.0, Rd[1] < 0.0 ? 1.0: -1.0, 0.0);
-			} else if (currentaxis == 2) {
-				normal = vec3f(0.0, 0.0, Rd[2] < 0.0 ? 1.0 : -1.0);
-			}
-			
+
+			// Set the normal vector: the side the ray enters through
+			normal = vec3f();
+			normal[currentaxis] = negative ? 1.0 : -1.0;
 		}
 		if (t2 < tMax)
 			tMax = t2;
-
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
 	}
-	return true; // it made it past all 3 axes.
+
+	// missed, or behind the ray
+	return tMin <= tMax && tMax >= 0.0;
+}
+
+
+void Geometry::setTransform(TransformNode *transform)
+{
+	this->transform = transform;
+
+	const mat4f& inv = transform->getInverse();
+	localLinear = inv.upper33();
+	localOffset = vec3f( inv[0][3], inv[1][3], inv[2][3] );
+
+	translateOnly = localLinear == mat3f();
+	identityTransform = translateOnly && localOffset.iszero();
 }
 
+ray Geometry::toLocalRay(const ray& r, double& length) const
+{
+	// World rays always carry unit directions, so a transform without a
+	// linear part leaves the direction (and hence distances) alone.
+	if (translateOnly) {
+		length = 1.0;
+		return ray( r.getPosition() + localOffset, r.getDirection() );
+	}
+
+	vec3f dir = localLinear * r.getDirection();
+	length = dir.length();
+	dir /= length;
+
+	return ray( localLinear * r.getPosition() + localOffset, dir );
+}
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
-    // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
-    dir /= length;
+	++threadRayStats().intersectTests;
 
-    ray localRay( pos, dir );
+	if (identityTransform) {
+		if (!intersectLocal(r, i))
+			return false;
+		COUNT_RAY_STAT( hits );
+		i.N = i.N.normalize();
+		return true;
+	}
+
+    // Transform the ray into the object's local coordinate space
+	double length;
+	ray localRay = toLocalRay(r, length);
 
     if (intersectLocal(localRay, i)) {
+		COUNT_RAY_STAT( hits );
+
         // Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
+		i.N = translateOnly ? i.N.normalize() : transform->localToGlobalCoordsNormal(i.N);
 		i.t /= length;
 
 		return true;
@@ -155,6 +160,75 @@ bool Geometry::intersectLocal( const ray& r, isect& i ) const
 	return false;
 }
 
+void Geometry::intersectSpans( const ray& r, SpanList& spans ) const
+{
+	spans.clear();
+
+	// A ray that misses the box is nowhere inside the object ahead of its
+	// start, and spans behind the start never change what it hits.
+	double tMin, tMax;
+	const bool bounded = hasBoundingBoxCapability();
+	if( bounded && !bounds.intersect( r, tMin, tMax ) )
+		return;
+
+	double length;
+	const ray localRay = toLocalRay( r, length );
+	if( intersectLocalSpans( localRay, spans ) ) {
+		for( int k = 0; k < spans.size(); ++k ) {
+			SpanEnd *ends[2] = { &spans[k].in, &spans[k].out };
+			for( int e = 0; e < 2; ++e ) {
+				ends[e]->t /= length;
+				if( !translateOnly )
+					ends[e]->N = transform->localToGlobalCoordsNormal( ends[e]->N );
+			}
+		}
+		return;
+	}
+
+	// Follow the ray from hit to hit, starting just before it enters the
+	// box (or at its start, without one), a hit on a surface facing the
+	// ray being an entry and any other an exit.  Spans still open at
+	// either end run on to infinity.  Starting behind the ray's start
+	// lets one-sided surfaces, which can't be seen from inside, still
+	// give their entry.  A ray that runs out of steps leaves the list cut
+	// off at its last hit.
+	const vec3f d = r.getDirection();
+	double offset = bounded ? tMin - 2 * RAY_EPSILON : 0.0;
+	bool inside = false;
+	SpanEnd in;
+	isect cur;
+	int k = 0;
+	for( ; k < 2 * SpanList::CAPACITY && intersect( ray( r.at( offset ), d ), cur ); ++k ) {
+		SpanEnd end( offset + cur.t, cur.N, cur.obj );
+		end.bary = cur.bary;
+		end.face = cur.face;
+		offset = end.t;
+
+		if( cur.N.dot( d ) < 0 ) {
+			if( !inside ) {
+				in = end;
+				inside = true;
+			}
+		} else {
+			if( !inside ) {
+				in = end;
+				in.t = -DBL_MAX;
+			}
+			spans.add( in, end );
+			inside = false;
+		}
+	}
+
+	if( k == 2 * SpanList::CAPACITY )
+		spans.cutOff( offset );
+
+	if( inside ) {
+		SpanEnd out = in;
+		out.t = DBL_MAX;
+		spans.add( in, out );
+	}
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -174,22 +248,75 @@ Scene::~Scene()
     giter g;
     liter l;
     
+	// boundedobjects and nonboundedobjects only partition the objects
+	// list, so every object is deleted exactly once here.
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	for( l = lights.begin(); l != lights.end(); ++l ) {
+		delete (*l);
 	}
 
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
+	delete bvh;
+}
+
+// The closest-hit query Scene::intersect runs over the BVH.  Ties go to
+// the object that was added to the scene first, and a hit already found on
+// an unbounded object wins all of them.
+struct SceneHitQuery
+{
+	const ray& r;
+	isect& i;
+	const vector<Geometry*>& objects;
+	bool have_one;
+	int hitIndex;
+	isect cur;
+
+	SceneHitQuery( const ray& r, isect& i, const vector<Geometry*>& objects, bool have_one )
+		: r( r ), i( i ), objects( objects ), have_one( have_one ),
+		  hitIndex( have_one ? -1 : INT_MAX ) {}
+
+	double limit() const { return have_one ? i.t : DBL_MAX; }
+
+	void test( int k )
+	{
+		if( objects[k]->intersect( r, cur ) ) {
+			if( !have_one || cur.t < i.t || (cur.t == i.t && k < hitIndex) ) {
+				i = cur;
+				have_one = true;
+				hitIndex = k;
+			}
+		}
 	}
+};
 
-	for( l = lights.begin(); l != lights.end(); ++l ) {
-		delete (*l);
+// The any-hit query Scene::occluded runs over the BVH: it stops at the
+// first opaque hit before tMax, and notes whether it passed through
+// anything transmissive on the way.
+struct SceneOcclusionQuery
+{
+	const ray& r;
+	double tMax;
+	const vector<Geometry*>& objects;
+	bool transmissive;
+	isect cur;
+
+	SceneOcclusionQuery( const ray& r, double tMax, const vector<Geometry*>& objects )
+		: r( r ), tMax( tMax ), objects( objects ), transmissive( false ) {}
+
+	bool test( int k )
+	{
+		cur.hasMaterial = false;
+		if( objects[k]->intersect( r, cur ) && cur.t < tMax ) {
+			cur.obj->resolveMaterial( cur );
+			if( cur.getMaterial().kt.iszero() )
+				return true;
+			transmissive = true;
+		}
+		return false;
 	}
-}
+};
 
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
@@ -211,28 +338,58 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
-			}
-		}
+	// try the bounded objects, through the hierarchy built in initScene
+	if( bvh ) {
+		SceneHitQuery query( r, i, boundedobjects, have_one );
+		bvh->closestHit( r, query );
+		have_one = query.have_one;
 	}
 
+	if( have_one )
+		i.obj->resolveMaterial( i );
 
 	return have_one;
 }
 
-void Scene::initScene()
+bool Scene::occluded( const ray& r, double tMax, bool& transmissive ) const
+{
+	typedef list<Geometry*>::const_iterator iter;
+
+	isect cur;
+	transmissive = false;
+	++threadRayStats().shadowRays;
+
+	for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+		cur.hasMaterial = false;
+		if( (*j)->intersect( r, cur ) && cur.t < tMax ) {
+			cur.obj->resolveMaterial( cur );
+			if( cur.getMaterial().kt.iszero() )
+				return true;
+			transmissive = true;
+		}
+	}
+
+	if( !bvh )
+		return false;
+
+	SceneOcclusionQuery query( r, tMax, boundedobjects );
+	const bool blocked = bvh->anyHit( r, tMax, query );
+	if( query.transmissive )
+		transmissive = true;
+	return blocked;
+}
+
+void Scene::initScene( BVHBuilder& builder )
 {
 	bool first_boundedobject = true;
 	BoundingBox b;
+	const chrono::steady_clock::time_point buildStart = chrono::steady_clock::now();
 	
 	typedef list<Geometry*>::const_iterator iter;
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		(*j)->buildAccelerationStructure( builder );
+
 		if( (*j)->hasBoundingBoxCapability() )
 		{
 			boundedobjects.push_back(*j);
@@ -252,101 +409,60 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
-}
-
-void Scene::loadHeightMap(unsigned char *ptr, const int &w, const int &h) {
-	Material *mat = new Material();
-	TransformRoot *transform = new TransformRoot;
-	Trimesh *mesh = new Trimesh(this, mat, transform);
-	mat->kd = vec3f(0.5f, 0.5f, 0.5f);
 
-	// Construct triangle vertexes
-	// Note that the height (intensity) of 3D vertex is y-axis 
-	for (int j = 0; j < h; j++) 	{
-		for (int i = 0; i < w; i++) 		{
-			double x = (1.0 * i) / w;
-			double y = (1.0 * j) / h;
-			double z = ptr[(i + j * w) * 3] / 255.f;
-			mesh->addVertex({x * 5,z,y * 5});
-			mesh->addMaterial(mat);
-		}
-	}
-	for (int j = 0; j < h - 1; j++) 	{
-		for (int i = 0; i < w - 1; i++) 		{
-			mesh->addFace(j * w + i, (j + 1) * w + i, j * w + i + 1);
-			mesh->addFace((j + 1) * w + i, (j + 1) * w + i + 1, j * w + i + 1);
-		}
+	// build the acceleration structure over the bounded objects
+	vector<BoundingBox> boxes( boundedobjects.size() );
+	vector<double> costs( boundedobjects.size() );
+	for( size_t k = 0; k < boundedobjects.size(); ++k ) {
+		boxes[k] = boundedobjects[k]->getBoundingBox();
+		costs[k] = boundedobjects[k]->intersectCost();
 	}
 
-	mesh->generateNormals();
-	for (auto &f : mesh->faces) 
-		this->boundedobjects.push_back(f);
-}
-
-SubtractNode::SubtractNode(Scene *scene, SceneObject *const a, SceneObject *const b)
-: SceneObject(scene), a(a), b(b) {}
-
-SubtractNode::~SubtractNode() {
-	delete a;
-	a = nullptr;
-	delete b;
-	b = nullptr;
-}
-
-const Material &SubtractNode::getMaterial() const {
-	// TODO: insert return statement here
-	return a->getMaterial();
-}
-
-void SubtractNode::setMaterial(Material *m) {
-	return a->setMaterial(m);
-}
-
-bool SubtractNode::intersect(const ray &r, isect &i) const {
-	i.obj = a;
-	isect aISect = i;
-	isect bISect = i;
-	const ray localRay = this->getLocalRay(r);
-	const bool isAIntersects = a->intersect(localRay, aISect);
-	const bool isBIntersects = b->intersect(localRay, bISect);
-
-	if (!isAIntersects) return false;
-	
-	const bool closer = aISect.t < bISect.t;
-	Geometry *nearObj = closer ? a : b;
-	Geometry *farObj  = closer ? b : a;
-	isect *nearISect  = closer ? &aISect : &bISect;
-
-	if (!isBIntersects || nearObj == a) {
-		i = aISect;
-		return true;
-	} else if (nearObj == b) {
-		const ray inRay = ray(localRay.at(bISect.t + RAY_EPSILON), localRay.getDirection());
-		const bool intersectsA = a->intersect(inRay, aISect);
-		const bool intersectsB = b->intersect(inRay, bISect);
-		if (intersectsA && intersectsB) {
-			isect aISect2 = aISect;
-			const ray inRay2 = ray(inRay.at(aISect.t + RAY_EPSILON), localRay.getDirection());
-			a->intersect(inRay2, aISect2);
-			if (bISect.t < aISect2.t) {
-				i = bISect;
-				i.N *= -1;
-				i.obj = a;
-				return true;
+	delete bvh;
+	bvh = builder.build( boxes );
+
+	accelStats.buildSeconds = chrono::duration<double>( chrono::steady_clock::now() - buildStart ).count();
+	accelStats.sahCost = bvh->sahCost( costs ) + nonboundedobjects.size();
+	accelStats.built = builder.built;
+	accelStats.loaded = builder.loaded;
+
+	// sum up the ambient lights once, and keep the order of the rest
+	ambientLight = vec3f( 0, 0, 0 );
+	shadingLights.clear();
+	for( liter l = lights.begin(); l != lights.end(); ++l ) {
+		if( AmbientLight *ambLight = dynamic_cast<AmbientLight *>( *l ) ) {
+			ambientLight += ambLight->getColor( vec3f( 0, 0, 0 ) );
+		} else {
+			ShadingLight s;
+			s.light = *l;
+			s.isSpot = false;
+			s.coneAngle = 0.0;
+			if( SpotLight *spotLight = dynamic_cast<SpotLight *>( *l ) ) {
+				s.isSpot = true;
+				s.coneAngle = spotLight->getConeAngle();
 			}
-
-			return false;
+			shadingLights.push_back( s );
 		}
-		return false;
 	}
 }
 
-bool SubtractNode::contains(bool intersections) const {
-	return a->contains(intersections) && !b->contains(intersections);
-}
+// Make a height field of the w by h image at ptr, the red value of each
+// pixel giving the height (0 to 1) of a sample.  The samples are placed
+// 5/w apart in x and 5/h in z, where this used to put the vertices of a
+// mesh of the same triangles.
+void Scene::loadHeightMap(unsigned char *ptr, const int &w, const int &h) {
+	if (w < 2 || h < 2)
+		return;
+
+	Material *mat = new Material();
+	mat->kd = vec3f(0.5f, 0.5f, 0.5f);
+
+	vector<float> heights(w * h);
+	for (int k = 0; k < w * h; k++)
+		heights[k] = ptr[k * 3] / 255.f;
 
-ray SubtractNode::getLocalRay(const ray &r) const {
-	const vec3f pos = transform->globalToLocalCoords(r.getPosition());
-	const vec3f dir = (transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos).normalize();
-	return ray(pos, dir);
+	Heightfield *field = new Heightfield(this, mat, w, h, heights,
+		5.0 * (w - 1) / w, 5.0 * (h - 1) / h);
+	field->setTransform(&transformRoot);
+	add(field);
 }
@@ -8,6 +8,7 @@
 #define __SCENE_H__
 
 #include <list>
+#include <vector>
 #include <algorithm>
 
 using namespace std;
@@ -15,10 +16,33 @@ using namespace std;
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
+#include "spans.h"
 #include "../vecmath/vecmath.h"
 
 class Light;
 class Scene;
+class BVH;
+class BVHBuilder;
+
+// How the bounding volume hierarchies are built (see bvh.h).  Binned SAH
+// makes the best trees; the linear BVH sorts the boxes along a Morton
+// curve and builds several times faster, for somewhat slower tracing.
+enum BVHBuildMode
+{
+	BVH_BUILD_SAH,
+	BVH_BUILD_LBVH
+};
+
+// What building the hierarchies of a scene took, for ray -t and raybench.
+struct AccelerationStats
+{
+	AccelerationStats() : buildSeconds( 0.0 ), sahCost( 0.0 ), built( 0 ), loaded( 0 ) {}
+
+	double buildSeconds;	// all of them, the objects' own included
+	double sahCost;			// expected cost of a ray, in primitive tests
+	int built;				// hierarchies built
+	int loaded;				// and taken from the on-disk cache instead
+};
 
 class SceneElement
 {
@@ -109,6 +133,9 @@ public:
         return (normi * v).normalize();
     }
 
+    const mat4f& getMatrix() const { return xform; }
+    const mat4f& getInverse() const { return inverse; }
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
@@ -148,6 +175,17 @@ public:
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+	// For CSG: the spans of the whole line through r (behind its start as
+	// well as ahead) that lie inside the object, in world space.  By default
+	// they come from intersectLocalSpans(), or if the object can't give
+	// them, from following the ray from hit to hit, telling entries from
+	// exits by the way the normal faces.
+	virtual void intersectSpans( const ray& r, SpanList& spans ) const;
+
+	// The same in the object's local space, for solids that can work their
+	// spans out directly.  Returns false for those that can't.
+	virtual bool intersectLocalSpans( const ray& r, SpanList& spans ) const { return false; }
+
 	//virtual bool intersect(const ray &r, isect &i, std::stack<Geometry *> &intersections) const { return false; };
 
 	virtual bool hasBoundingBoxCapability() const;
@@ -197,15 +235,40 @@ public:
     // this should be overridden if hasBoundingBoxCapability() is true.
     virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
-	virtual bool contains(bool intersections) const { return true; }
-    void setTransform(TransformNode *transform) { this->transform = transform; };
+	// Called once by Scene::initScene, after loading and before any ray
+	// is traced.  Objects with an acceleration structure of their own
+	// get it here, from the builder the scene is given.
+	virtual void buildAccelerationStructure( BVHBuilder& builder ) {}
+
+	// The expected cost of intersecting a ray with the object, counting
+	// one primitive test as 1.  Objects with a hierarchy of their own give
+	// its SAH cost, which the scene adds into its own.
+	virtual double intersectCost() const { return 1.0; }
+
+    void setTransform(TransformNode *transform);
+    TransformNode *getTransform() const { return transform; }
+
+    // Bring a world space ray into the object's local space, using the
+    // cached world-to-object map.  length receives the length of the
+    // transformed direction before it was renormalized; local hit
+    // distances are divided by it to get world distances.
+    ray toLocalRay(const ray& r, double& length) const;
     
 	Geometry( Scene *scene ) 
-		: SceneElement( scene ) {}
+		: SceneElement( scene ), transform( NULL ),
+		  identityTransform( true ), translateOnly( true ) {}
 
 protected:
 	BoundingBox bounds;
     TransformNode *transform;
+
+	// The inverse of transform, flattened into its 3x3 linear part and its
+	// offset when the transform is set.  The flags mark the common cases
+	// where the linear part (or the whole map) can be skipped.
+	mat3f localLinear;
+	vec3f localOffset;
+	bool identityTransform;
+	bool translateOnly;
 };
 
 // A SceneObject is a real actual thing that we want to model in the 
@@ -219,6 +282,12 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial( Material *m ) = 0;
 
+	// Called once for the closest hit of a ray, after all the candidate
+	// hits have been compared.  Objects whose material varies over the
+	// surface compute it here instead of in intersectLocal, so that hits
+	// which lose to a closer one never pay for it.
+	virtual void resolveMaterial( isect& i ) const {}
+
 protected:
 	SceneObject( Scene *scene )
 		: Geometry( scene ) {}
@@ -255,9 +324,18 @@ public:
 
     TransformRoot transformRoot;
 
+	// A non-ambient light as seen by Material::shade.  Spot lights also
+	// carry the cone angle, so shading never has to ask a light its type.
+	struct ShadingLight
+	{
+		const Light *light;
+		bool isSpot;
+		double coneAngle;
+	};
+
 public:
 	Scene() 
-		: transformRoot(), objects(), lights() {}
+		: transformRoot(), objects(), lights(), bvh( NULL ) {}
 	virtual ~Scene();
 
 	void add( Geometry* obj )
@@ -270,11 +348,33 @@ public:
 
 
 	bool intersect( const ray& r, isect& i ) const;
-	void initScene();
+
+	// Shadow ray query: is there an opaque object along r closer than tMax?
+	// Stops at the first opaque hit found, in no particular order.  If it
+	// returns false but passed through a transmissive object on the way,
+	// transmissive is set and the caller has to walk the hits in order
+	// with intersect() to work out how much light gets through.
+	bool occluded( const ray& r, double tMax, bool& transmissive ) const;
+
+	// Sort the objects and lights out and make the hierarchies, all with
+	// the same builder.
+	void initScene( BVHBuilder& builder );
 
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
+
+	// Every object added, in the order they were added.
+	cgiter beginObjects() const { return objects.begin(); }
+	cgiter endObjects() const { return objects.end(); }
+
+	// The lights sorted out by initScene(): the sum of all the ambient
+	// light colours, and every other light in the order it was added.
+	const vec3f& getAmbientLight() const { return ambientLight; }
+	const vector<ShadingLight>& getShadingLights() const { return shadingLights; }
 	Camera *getCamera() { return &camera; }
+	const Camera *getCamera() const { return &camera; }
+
+	const AccelerationStats& getAccelerationStats() const { return accelStats; }
 
 	void loadHeightMap(unsigned char *ptr, const int &w, const int &h);
 	
@@ -282,7 +382,7 @@ public:
 private:
     list<Geometry*> objects;
 	list<Geometry*> nonboundedobjects;
-	list<Geometry*> boundedobjects;
+	vector<Geometry*> boundedobjects;	// indexed by the leaves of bvh
     list<Light*> lights;
     Camera camera;
 	
@@ -290,24 +390,13 @@ private:
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
-};
-
-// Bonus : CSG
-class SubtractNode : public SceneObject {
-public:
-	SubtractNode(Scene *scene, SceneObject *const a, SceneObject *const b);
-	virtual ~SubtractNode();
-
-	const Material &getMaterial() const override;
-	void setMaterial(Material *m) override;
 
-	virtual bool intersect(const ray &r, isect &i) const override;
-	bool contains(bool intersections) const override;
-
-	ray getLocalRay(const ray &r) const;
-
-	SceneObject *a;
-	SceneObject *b;
+	// Acceleration structure over boundedobjects, built by initScene().
+	BVH *bvh;
+	AccelerationStats accelStats;
 
+	vec3f ambientLight;
+	vector<ShadingLight> shadingLights;
 };
+
 #endif // __SCENE_H__
@@ -0,0 +1,117 @@
+//
+// spans.h
+//
+// The stretches of a ray that lie inside a solid, which CSG nodes combine
+// (see SceneObjects/CSG.h).
+//
+
+#ifndef __SPANS_H__
+#define __SPANS_H__
+
+#include <cfloat>
+#include <cstddef>
+#include <new>
+
+#include "../vecmath/vecmath.h"
+
+class SceneObject;
+
+// Where a ray crosses the surface of a solid: what intersect() would have
+// put in the isect, with the normal facing out of the solid.
+struct SpanEnd
+{
+	SpanEnd()
+		: t( 0.0 ), face( -1 ), obj( NULL ) {}
+	SpanEnd( double t, const vec3f& N, const SceneObject *obj )
+		: t( t ), N( N ), face( -1 ), obj( obj ) {}
+
+	double t;
+	vec3f N;
+	vec3f bary;
+	int face;
+	const SceneObject *obj;
+};
+
+// The ray is inside the solid from in.t to out.t.
+struct Span
+{
+	Span( const SpanEnd& in, const SpanEnd& out )
+		: in( in ), out( out ) {}
+
+	SpanEnd in;
+	SpanEnd out;
+};
+
+// The spans of a ray inside a solid, in order along it and apart from
+// each other.  They are kept in a fixed block of storage, so that finding
+// them never allocates and a list costs nothing to make or copy beyond
+// the spans actually in it.  Spans wholly behind the ray's start are
+// never kept, since they can't change what it hits.
+//
+// A list can only tell where the solid is up to limit(): one that fills
+// up stops at the end of its last span, and the spans after it are
+// dropped.  Past that the list says nothing, not that the ray is outside,
+// which matters to a difference, where a cutter that ends early would
+// otherwise leave faces that aren't there.
+class SpanList
+{
+public:
+	enum { CAPACITY = 16 };
+
+	SpanList() : count( 0 ), end( DBL_MAX ) {}
+	SpanList( const SpanList& other ) : count( 0 ) { *this = other; }
+
+	SpanList& operator =( const SpanList& other )
+	{
+		count = other.count;
+		end = other.end;
+		for( int k = 0; k < count; ++k )
+			new( storage + k * sizeof( Span ) ) Span( other[k] );
+		return *this;
+	}
+
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+	const Span& operator []( int k ) const { return reinterpret_cast<const Span *>( storage )[k]; }
+	Span& operator []( int k ) { return reinterpret_cast<Span *>( storage )[k]; }
+
+	// How far along the ray the list holds every span, and whether that
+	// is all the way.
+	double limit() const { return end; }
+	bool complete() const { return end == DBL_MAX; }
+
+	void clear()
+	{
+		count = 0;
+		end = DBL_MAX;
+	}
+
+	// Add a span after the last one.
+	void add( const SpanEnd& in, const SpanEnd& out )
+	{
+		if( out.t < 0.0 )
+			return;
+
+		if( count == CAPACITY ) {
+			cutOff( (*this)[ count - 1 ].out.t );
+			return;
+		}
+
+		new( storage + count * sizeof( Span ) ) Span( in, out );
+		++count;
+	}
+
+	// Say nothing about the ray past t.
+	void cutOff( double t )
+	{
+		if( t < end )
+			end = t;
+	}
+
+private:
+	alignas( Span ) unsigned char storage[ CAPACITY * sizeof( Span ) ];
+	int count;
+	double end;
+};
+
+#endif // __SPANS_H__
@@ -27,7 +27,7 @@ void TraceUI::cb_load_scene(Fl_Menu_* o, void* v)
 {
 	TraceUI* pUI=whoami(o);
 	
-	char* newfile = fl_file_chooser("Open Scene?", "*.ray", NULL );
+	char* newfile = fl_file_chooser("Open Scene?", "*.{ray,rayb}", NULL );
 
 	if (newfile != NULL) {
 		char buf[256];
@@ -37,6 +37,8 @@ void TraceUI::cb_load_scene(Fl_Menu_* o, void* v)
 			done=true;	// terminate the previous rendering
 		} else{
 			sprintf(buf, "Ray <Not Loaded>");
+			if (!pUI->raytracer->getLoadError().empty())
+				fl_alert("%s", pUI->raytracer->getLoadError().c_str());
 		}
 
 		pUI->m_mainWindow->label(buf);
@@ -164,7 +166,7 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 
 		pUI->m_traceGlWindow->show();
 
-		pUI->raytracer->traceSetup(width, height);
+		pUI->raytracer->traceSetup(width, height, pUI->getRenderSettings());
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -278,6 +280,17 @@ int TraceUI::getSuperSample() const {
 	return this->m_nSuperSample;
 }
 
+// Snapshot of the current slider and button values for the next render
+RenderSettings TraceUI::getRenderSettings() const {
+	RenderSettings s;
+	s.depth				= m_nDepth;
+	s.threshold			= m_nThreshold;
+	s.superSample		= m_nSuperSample;
+	s.jittering			= m_nJittering;
+	s.textureMapping	= m_nTextureMapping;
+	return s;
+}
+
 // menu definition
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
@@ -66,6 +66,8 @@ public:
 	float		getTreshold()		const;
 	int			getSuperSample()	const;
 
+	RenderSettings	getRenderSettings()	const;
+
 private:
 	RayTracer*	raytracer;
 
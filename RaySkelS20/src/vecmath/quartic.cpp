@@ -18,6 +18,7 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <algorithm>
 #include <cmath>
 #include "quartic.h"
 
@@ -134,4 +135,74 @@ DComplex *solve_quartic(double a, double b, double c, double d) {
 	}
 
 	return retval;
-}
\ No newline at end of file
+}
+
+//---------------------------------------------------------------------------
+// Horner's scheme for x^4 + a*x^3 + b*x^2 + c*x + d and its derivative
+static inline double quartic(double x, double a, double b, double c, double d) {
+	return x * (x * (x * (x + a) + b) + c) + d;
+}
+
+static inline double quarticSlope(double x, double a, double b, double c) {
+	return x * (x * (4 * x + 3 * a) + 2 * b) + c;
+}
+
+//---------------------------------------------------------------------------
+// Find the real roots of x^4 + a*x^3 + b*x^2 + c*x + d between lo and hi
+unsigned int solveQuarticInterval(double *roots, double a, double b, double c, double d, double lo, double hi) {
+	if (!(lo < hi)) return 0;
+
+	// the ends of the pieces: lo, the turning points inside (lo, hi), hi
+	double ends[5];
+	unsigned int numEnds = 0;
+	ends[numEnds++] = lo;
+
+	// the derivative 4x^3 + 3a*x^2 + 2b*x + c, divided by 4
+	double x3[3];
+	unsigned int iTurns = solveP3(x3, 0.75 * a, 0.5 * b, 0.25 * c);
+	// solveP3 finds one, two (with a double root) or three, in no
+	// particular order, so sort them by compare-and-swap
+	if (iTurns >= 2 && x3[0] > x3[1]) std::swap(x3[0], x3[1]);
+	if (iTurns == 3) 	{
+		if (x3[1] > x3[2]) std::swap(x3[1], x3[2]);
+		if (x3[0] > x3[1]) std::swap(x3[0], x3[1]);
+	}
+	for (unsigned int i = 0; i < iTurns; i++) 	{
+		if (x3[i] > lo && x3[i] < hi) ends[numEnds++] = x3[i];
+	}
+	ends[numEnds++] = hi;
+
+	unsigned int iRoots = 0;
+	double fp = quartic(lo, a, b, c, d);
+	if (fp == 0) roots[iRoots++] = lo;
+
+	for (unsigned int i = 0; i + 1 < numEnds; i++) 	{
+		double p = ends[i];
+		double q = ends[i + 1];
+		double fq = quartic(q, a, b, c, d);
+
+		if (fq == 0) 		{
+			roots[iRoots++] = q;
+		} 		else if (fp != 0 && (fp < 0) != (fq < 0)) 		{
+			// the quartic is monotonic on [p, q]: keep the sign change
+			// bracketed while Newton's method closes in on it
+			double x = 0.5 * (p + q);
+			for (int k = 0; k < 100; k++) 			{
+				double fx = quartic(x, a, b, c, d);
+				if (fx == 0) break;
+				if ((fx < 0) == (fp < 0)) p = x; else q = x;
+
+				double slope = quarticSlope(x, a, b, c);
+				double next = slope != 0 ? x - fx / slope : p;
+				if (!(next > p && next < q)) next = 0.5 * (p + q);
+				if (fabs(next - x) <= eps * (1 + fabs(x))) { x = next; break; }
+				x = next;
+			}
+			roots[iRoots++] = x;
+		}
+
+		fp = fq;
+	}
+
+	return iRoots;
+}
@@ -62,4 +62,14 @@ unsigned int solveP3(double *x, double a, double b, double c);
 // (attention - this function returns dynamically allocated array. It has to be released afterwards)
 DComplex *solve_quartic(double a, double b, double c, double d);
 
+//---------------------------------------------------------------------------
+// Find the real roots of x^4 + a*x^3 + b*x^2 + c*x + d between lo and hi
+// roots - array of size 4, filled in increasing order; returns their number
+// Nothing is allocated.  The quartic is cut at the roots of its derivative
+// into pieces on which it only rises or falls, and the root in each piece
+// whose ends differ in sign is found by Newton's method, falling back on
+// bisection to stay inside it.  Roots where the quartic only touches zero
+// without crossing it (grazing rays) are not reported.
+unsigned int solveQuarticInterval(double *roots, double a, double b, double c, double d, double lo, double hi);
+
 #endif // QUARTIC_H_INCLUDED
\ No newline at end of file